@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+thread_local uint64_t allocation_count = 0;
+thread_local uint64_t allocated_bytes = 0;
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+    auto index = static_cast<size_t>(fraction * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+[[noreturn]] void Usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--min-time=<ms>] [--filter=<substring>]\n";
+    std::exit(1);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    allocated_bytes += size;
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace bench {
+
+uint64_t AllocationCount() {
+    return allocation_count;
+}
+
+uint64_t AllocatedBytes() {
+    return allocated_bytes;
+}
+
+Options ParseOptions(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--min-time=", 0) == 0) {
+            options.min_time = std::chrono::milliseconds(std::atoll(arg.c_str() + 11));
+        } else if (arg.rfind("--filter=", 0) == 0) {
+            options.filter = arg.substr(9);
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    return options;
+}
+
+void Runner::Report(const std::string& name, uint64_t iterations, double total_ns,
+                    std::vector<double> samples, uint64_t allocations, uint64_t bytes) {
+    std::sort(samples.begin(), samples.end());
+    auto ops = static_cast<double>(iterations);
+    char line[512];
+    std::snprintf(line, sizeof(line),
+                  "{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.1f,\"p50_ns\":%.1f,"
+                  "\"p90_ns\":%.1f,\"p99_ns\":%.1f,\"max_ns\":%.1f,\"allocs_per_op\":%.2f,"
+                  "\"bytes_per_op\":%.1f}\n",
+                  name.c_str(), static_cast<unsigned long long>(iterations), total_ns / ops,
+                  Percentile(samples, 0.5), Percentile(samples, 0.9), Percentile(samples, 0.99),
+                  samples.back(), static_cast<double>(allocations) / ops,
+                  static_cast<double>(bytes) / ops);
+    out_ << line << std::flush;
+}
+
+}  // namespace bench
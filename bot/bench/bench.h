@@ -0,0 +1,115 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// Heap allocations made by the calling thread so far, counted by the replacement
+// operator new in bench.cpp.
+uint64_t AllocationCount();
+uint64_t AllocatedBytes();
+
+// Keeps the compiler from dropping a computation whose result is unused.
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct Options {
+    // Time spent measuring each benchmark, after warm-up.
+    std::chrono::milliseconds min_time{500};
+    // Runs only the benchmarks whose name contains it.
+    std::string filter;
+};
+
+// Understands --min-time=<ms> and --filter=<substring>, exits on anything else.
+Options ParseOptions(int argc, char** argv);
+
+// Times benchmarks and prints one JSON object per benchmark and line:
+//     {"name":"parse/streaming/4","iterations":...,"ns_per_op":...,"p50_ns":...,
+//      "p90_ns":...,"p99_ns":...,"max_ns":...,"allocs_per_op":...,"bytes_per_op":...}
+// An operation is one call of the benchmarked function. Calls are timed in samples
+// of a few microseconds each, the percentiles are taken over the per-sample means.
+class Runner {
+public:
+    explicit Runner(const Options& options, std::ostream& out = std::cout)
+        : options_{options}, out_{out} {
+    }
+
+    // Whether a benchmark of that name would run, to skip an expensive setup.
+    bool Matches(const std::string& name) const {
+        return name.find(options_.filter) != std::string::npos;
+    }
+
+    template <typename Fn>
+    void Run(const std::string& name, Fn&& fn) {
+        if (!Matches(name)) {
+            return;
+        }
+
+        auto batch = Calibrate(fn);
+        std::vector<double> samples;
+        uint64_t iterations = 0;
+        auto allocations = AllocationCount();
+        auto bytes = AllocatedBytes();
+        auto start = Clock::now();
+        auto deadline = start + options_.min_time;
+        Clock::time_point now;
+        do {
+            auto sample_start = Clock::now();
+            for (uint64_t i = 0; i != batch; ++i) {
+                fn();
+            }
+            now = Clock::now();
+            samples.push_back(Nanoseconds(now - sample_start) / batch);
+            iterations += batch;
+        } while (now < deadline);
+
+        Report(name, iterations, Nanoseconds(now - start), std::move(samples),
+               AllocationCount() - allocations, AllocatedBytes() - bytes);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Target length of one sample, long enough to hide the cost of reading the clock.
+    static constexpr std::chrono::microseconds kSampleTime{20};
+
+    static double Nanoseconds(Clock::duration duration) {
+        return std::chrono::duration<double, std::nano>(duration).count();
+    }
+
+    // Warms up caches and the allocator and picks the number of calls per sample.
+    template <typename Fn>
+    static uint64_t Calibrate(Fn& fn) {
+        uint64_t batch = 1;
+        while (true) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i != batch; ++i) {
+                fn();
+            }
+            auto elapsed = Clock::now() - start;
+            if (elapsed >= kSampleTime || batch >= (1u << 20)) {
+                return batch;
+            }
+            batch *= 2;
+        }
+    }
+
+    void Report(const std::string& name, uint64_t iterations, double total_ns,
+                std::vector<double> samples, uint64_t allocations, uint64_t bytes);
+
+private:
+    Options options_;
+    std::ostream& out_;
+};
+
+}  // namespace bench
+
+#endif  // BENCH_H
@@ -0,0 +1,423 @@
+#include "bench.h"
+
+#include "../telegram/api.h"
+#include "../telegram/fake.h"
+#include "../telegram/fake_data.h"
+#include "../telegram/logger.h"
+#include "../telegram/message_handlers.h"
+
+#include <Poco/JSON/Object.h>
+#include <Poco/JSON/Parser.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/URI.h>
+#include <re2/re2.h>
+
+#include <future>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Stream buffer that throws everything away, so logger benchmarks measure the
+// logger rather than the terminal.
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int ch) override {
+        return ch;
+    }
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+};
+
+// A getUpdates reply holding the updates of the given one repeated times times, to
+// get a full batch out of the small FakeData replies.
+std::string RepeatUpdates(const std::string& reply, size_t times) {
+    auto begin = reply.find('[') + 1;
+    auto end = reply.rfind(']');
+    auto updates = reply.substr(begin, end - begin);
+    std::string result = reply.substr(0, begin);
+    for (size_t i = 0; i != times; ++i) {
+        if (i != 0) {
+            result += ',';
+        }
+        result += updates;
+    }
+    return result + reply.substr(end);
+}
+
+std::vector<tg::TelegramUpdate> ParseWithDom(const std::string& reply) {
+    std::istringstream in(reply);
+    Poco::JSON::Parser parser;
+    auto result = parser.parse(in).extract<Poco::JSON::Object::Ptr>()->getArray("result");
+    std::vector<tg::TelegramUpdate> updates;
+    for (size_t i = 0; i != result->size(); ++i) {
+        updates.emplace_back(*result->getObject(i));
+    }
+    return updates;
+}
+
+void BenchParseUpdates(bench::Runner& runner) {
+    std::vector<std::pair<std::string, std::string>> payloads{
+        {"1", FakeData::GetupdatesOneMessage},
+        {"4", FakeData::GetUpdatesFourMessagesJson},
+        {"100", RepeatUpdates(FakeData::GetUpdatesFourMessagesJson, 25)}};
+
+    for (const auto& [size, reply] : payloads) {
+        runner.Run("parse_updates/streaming/" + size, [&] {
+            std::istringstream in(reply);
+            auto updates = tg::ParseUpdates(in);
+            bench::DoNotOptimize(updates);
+        });
+        runner.Run("parse_updates/dom/" + size, [&] {
+            auto updates = ParseWithDom(reply);
+            bench::DoNotOptimize(updates);
+        });
+        // Lazy views read as far as sharding by chat needs, the body copied into the
+        // shared reply as the transports do.
+        runner.Run("parse_updates/views/" + size, [&] {
+            auto updates = tg::ParseUpdateViews(reply);
+            int64_t ids = 0;
+            for (const auto& update : updates) {
+                ids += update.UpdateId() + update.ChatId();
+            }
+            bench::DoNotOptimize(ids);
+        });
+    }
+}
+
+// Answers a command and does nothing, to fill the dispatch table.
+class CommandStub : public MessageHandler {
+public:
+    CommandStub(std::shared_ptr<tg::TelegramApi> api, std::string command)
+        : MessageHandler(api), command_{std::move(command)} {
+    }
+
+    void handle(const tg::TelegramApiMessage&) override {
+    }
+
+    bool matches(const tg::TelegramApiMessage& message) const override {
+        return message.text == command_;
+    }
+
+    std::string_view Command() const override {
+        return command_;
+    }
+
+private:
+    std::string command_;
+};
+
+void BenchGetHandler(bench::Runner& runner) {
+    auto api = std::make_shared<tg::TelegramApi>(
+        tg::TelegramCredentials{"token", "http://localhost/"});
+    std::istringstream in(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(in).at(0).message.value();
+    // Messages without entities, the command is taken from the text.
+    message.entities.clear();
+
+    // A command handler, the last built-in one and the default handler. The cost should
+    // not depend on the number of commands.
+    for (size_t commands : {0, 500}) {
+        MessageHandlerFactory factory(api);
+        for (size_t i = 0; i != commands; ++i) {
+            factory.AddHandler(std::make_shared<CommandStub>(api, "/command" + std::to_string(i)));
+        }
+        for (const char* text : {"/random", "/stop", "hello"}) {
+            message.text = text;
+            runner.Run("get_handler/" + std::to_string(commands) + "_commands/" + text, [&] {
+                auto& handler = factory.GetHandler(message);
+                bench::DoNotOptimize(handler);
+            });
+        }
+    }
+}
+
+// Matches its pattern in matches(), the way handlers without triggers are asked.
+class LinearRegexStub : public MessageHandler {
+public:
+    LinearRegexStub(std::shared_ptr<tg::TelegramApi> api, const std::string& pattern)
+        : MessageHandler(api), regex_{pattern} {
+    }
+
+    void handle(const tg::TelegramApiMessage&) override {
+    }
+
+    bool matches(const tg::TelegramApiMessage& message) const override {
+        return message.text && RE2::PartialMatch(*message.text, regex_);
+    }
+
+private:
+    RE2 regex_;
+};
+
+class TriggerStub : public RegexMessageHandler {
+public:
+    using RegexMessageHandler::RegexMessageHandler;
+
+    void handle(const tg::TelegramApiMessage&) override {
+    }
+};
+
+// A thousand regex handlers, each asked in turn against all of them in one RE2::Set.
+void BenchTriggers(bench::Runner& runner) {
+    constexpr size_t kPatterns = 1000;
+    auto api = std::make_shared<tg::TelegramApi>(
+        tg::TelegramCredentials{"token", "http://localhost/"});
+    std::istringstream in(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(in).at(0).message.value();
+    message.entities.clear();
+
+    MessageHandlerFactory linear(api);
+    MessageHandlerFactory set(api);
+    for (size_t i = 0; i != kPatterns; ++i) {
+        auto pattern = "\\bword" + std::to_string(i) + "\\b";
+        linear.AddHandler(std::make_shared<LinearRegexStub>(api, pattern));
+        set.AddHandler(std::make_shared<TriggerStub>(api, std::vector<std::string>{pattern}));
+    }
+
+    std::vector<std::pair<std::string, std::string>> texts{
+        {"miss", "Sorry, nothing to see here"}, {"last", "the word999 matches last"}};
+    for (const auto& [name, text] : texts) {
+        message.text = text;
+        auto suffix = "/" + std::to_string(kPatterns) + "/" + name;
+        runner.Run("triggers/linear" + suffix, [&] {
+            auto& handler = linear.GetHandler(message);
+            bench::DoNotOptimize(handler);
+        });
+        runner.Run("triggers/set" + suffix, [&] {
+            auto& handler = set.GetHandler(message);
+            bench::DoNotOptimize(handler);
+        });
+    }
+}
+
+// sendMessage bodies as formerly built through a Poco::JSON::Object stringified into a
+// stream, and as written by the JSON writer into a new string or the thread's buffer.
+void BenchSendMessageBody(bench::Runner& runner) {
+    const std::string text = "Sorry, your message is not recognized: \"hello\"";
+    const std::string plain(200, 'a');
+    runner.Run("send_message_body/poco", [&] {
+        Poco::JSON::Object obj;
+        obj.set("chat_id", int64_t{104519755});
+        obj.set("text", text);
+        obj.set("reply_to_message_id", int64_t{851793506});
+        std::stringstream stream;
+        obj.stringify(stream);
+        auto body = stream.str();
+        bench::DoNotOptimize(body);
+    });
+    runner.Run("send_message_body/plain", [&] {
+        auto body = tg::TelegramApi::MakeSendMessageBody(104519755, text);
+        bench::DoNotOptimize(body);
+    });
+    runner.Run("send_message_body/reply", [&] {
+        auto body = tg::TelegramApi::MakeSendMessageBody(104519755, text, 851793506);
+        bench::DoNotOptimize(body);
+    });
+    runner.Run("send_message_body/buffer", [&] {
+        auto body = tg::TelegramApi::WriteSendMessageBody(104519755, text, 851793506);
+        bench::DoNotOptimize(body);
+    });
+    runner.Run("send_message_body/buffer/unescaped", [&] {
+        auto body = tg::TelegramApi::WriteSendMessageBody(104519755, plain, 851793506);
+        bench::DoNotOptimize(body);
+    });
+}
+
+// getUpdates and sendMessage requests as built before the method templates, from a
+// Poco::URI parsed per request, and as built from the templates. The sessions
+// variants build the Poco request Perform hands to a session, from scratch or taken
+// from a RequestPool; the wire variants the bytes the non-blocking transports send,
+// which AsyncHttpClient used to format from the Poco request.
+void BenchRequestTemplates(bench::Runner& runner) {
+    const std::string api_url = "https://api.telegram.org/";
+    const std::string token = "123456789:AAHdqTcvCH1vGWJxfSeofSAs0K5PALDsaw";
+    const std::vector<std::pair<std::string, std::string>> poll{
+        {"timeout", "25"}, {"offset", "851793508"}, {"limit", "100"},
+        {"allowed_updates", R"(["message"])"}};
+    const auto body = tg::TelegramApi::MakeSendMessageBody(104519755, "Hi!");
+
+    auto poll_uri = [&] {
+        Poco::URI uri(api_url + "bot" + token + "/getUpdates");
+        for (const auto& [name, value] : poll) {
+            uri.addQueryParameter(name, value);
+        }
+        return uri;
+    };
+    auto poll_query = [&] {
+        std::string query;
+        query.reserve(128);
+        for (const auto& [name, value] : poll) {
+            AppendQueryParameter(query, name, value);
+        }
+        return query;
+    };
+    // The headers Perform sets, before and after.
+    auto set_headers = [](Poco::Net::HTTPRequest& request, const std::string& content_type,
+                          std::string_view body) {
+        if (!content_type.empty()) {
+            request.setContentType(content_type);
+        }
+        if (!body.empty() || request.getMethod() == Poco::Net::HTTPRequest::HTTP_POST) {
+            request.setContentLength(body.size());
+        }
+        request.setKeepAlive(true);
+    };
+
+    runner.Run("request/sessions/uri/getUpdates", [&] {
+        auto uri = poll_uri();
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPathAndQuery(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        set_headers(request, "", {});
+        bench::DoNotOptimize(request);
+    });
+    runner.Run("request/sessions/uri/sendMessage", [&] {
+        Poco::URI uri(api_url + "bot" + token + "/sendMessage");
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPath(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        set_headers(request, "application/json", body);
+        bench::DoNotOptimize(request);
+    });
+    runner.Run("request/wire/uri/getUpdates", [&] {
+        auto uri = poll_uri();
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPathAndQuery(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        auto wire = FormatHttpRequest(request.getMethod(), request.getURI(), uri.getHost(), "", "");
+        bench::DoNotOptimize(wire);
+    });
+    runner.Run("request/wire/uri/sendMessage", [&] {
+        Poco::URI uri(api_url + "bot" + token + "/sendMessage");
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPath(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        request.setContentLength(body.size());
+        request.setContentType("application/json");
+        auto wire = FormatHttpRequest(request.getMethod(), request.getURI(), uri.getHost(),
+                                      request.getContentType(), body);
+        bench::DoNotOptimize(wire);
+    });
+
+    Poco::URI base(api_url + "bot" + token + "/");
+    HttpRequestTemplate get_updates("GET", base.getPath() + "getUpdates", base.getHost());
+    HttpRequestTemplate send_message("POST", base.getPath() + "sendMessage", base.getHost(),
+                                     "application/json");
+    runner.Run("request/sessions/template/getUpdates", [&] {
+        Poco::Net::HTTPRequest request(get_updates.Method(), get_updates.Target(poll_query()),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        set_headers(request, get_updates.ContentType(), {});
+        bench::DoNotOptimize(request);
+    });
+    runner.Run("request/sessions/template/sendMessage", [&] {
+        Poco::Net::HTTPRequest request(send_message.Method(), send_message.Target({}),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        set_headers(request, send_message.ContentType(), body);
+        bench::DoNotOptimize(request);
+    });
+    tg::RequestPool get_updates_requests("GET", get_updates.Path());
+    tg::RequestPool send_message_requests("POST", send_message.Path(), "application/json");
+    runner.Run("request/sessions/pool/getUpdates", [&] {
+        auto request = get_updates_requests.Acquire(get_updates.Target(poll_query()), 0);
+        bench::DoNotOptimize(*request);
+    });
+    runner.Run("request/sessions/pool/sendMessage", [&] {
+        auto request = send_message_requests.Acquire(send_message_requests.Path(), body.size());
+        bench::DoNotOptimize(*request);
+    });
+    runner.Run("request/wire/template/getUpdates", [&] {
+        auto wire = get_updates.Format(poll_query(), {});
+        bench::DoNotOptimize(wire);
+    });
+    runner.Run("request/wire/template/sendMessage", [&] {
+        auto wire = send_message.Format({}, body);
+        bench::DoNotOptimize(wire);
+    });
+}
+
+void BenchLogger(bench::Runner& runner) {
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+    int64_t update_id = 851793506;
+
+    {
+        logger::OstreamLogger logger(null_stream);
+        runner.Run("logger/ostream", [&] {
+            logger.LogInfo("Handling update_id: ", update_id, ", message: ", "/random");
+        });
+        logger.SetMinLevel(logger::LogLevel::Error);
+        runner.Run("logger/ostream_disabled", [&] {
+            logger.LogInfo("Handling update_id: ", update_id, ", message: ", "/random");
+        });
+    }
+    {
+        logger::AsyncLogger logger(null_stream, 8192, logger::OverflowPolicy::Block);
+        runner.Run("logger/async", [&] {
+            logger.LogInfo("Handling update_id: ", update_id, ", message: ", "/random");
+        });
+        logger.Flush();
+    }
+}
+
+// A batch of SendMessageAsync over each transport, answered by the fake server in load
+// mode. The server runs in this process, so the times include its side; strace -c -f
+// shows the system calls each transport makes. io_uring falls back to epoll where it
+// is unavailable.
+void BenchTransports(bench::Runner& runner) {
+    if (!runner.Matches("transport/")) {
+        return;
+    }
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+    auto previous_logger = logger::LoggerFactory::GetDefaultLogger();
+    logger::LoggerFactory::SetDefaultLogger(std::make_shared<logger::OstreamLogger>(null_stream));
+
+    telegram::FakeServer fake(telegram::LoadConfig{});
+    fake.Start();
+    constexpr int kBatch = 64;
+    // Messages to one chat are sent in order, these go out in parallel.
+    constexpr int kChats = 16;
+    std::vector<std::pair<std::string, tg::Transport>> transports{
+        {"sessions", tg::Transport::Sessions},
+        {"epoll", tg::Transport::Epoll},
+        {"io_uring", tg::Transport::IoUring}};
+
+    for (const auto& [name, transport] : transports) {
+        tg::TelegramApiConfig config;
+        config.transport = transport;
+        tg::TelegramApi api(tg::TelegramCredentials{"token", fake.GetUrl()}, NetworkMode::HTTP,
+                            config);
+        runner.Run("transport/" + name + "/" + std::to_string(kBatch), [&] {
+            std::vector<std::future<tg::TelegramApiMessage>> sent;
+            sent.reserve(kBatch);
+            for (int i = 0; i != kBatch; ++i) {
+                sent.push_back(api.SendMessageAsync(i % kChats, "Hi!"));
+            }
+            for (auto& message : sent) {
+                message.get();
+            }
+        });
+    }
+
+    fake.Stop();
+    logger::LoggerFactory::SetDefaultLogger(previous_logger);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    auto options = bench::ParseOptions(argc, argv);
+    bench::Runner runner(options);
+
+    BenchParseUpdates(runner);
+    BenchGetHandler(runner);
+    BenchTriggers(runner);
+    BenchSendMessageBody(runner);
+    BenchRequestTemplates(runner);
+    BenchLogger(runner);
+    BenchTransports(runner);
+    return 0;
+}
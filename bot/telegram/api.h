@@ -1,16 +1,39 @@
 #ifndef API_H
 #define API_H
 
+#include "async_http_client.h"
+#include "flood_control.h"
+#include "json_index.h"
+#include "json_reader.h"
+#include "json_writer.h"
+#include "keyed_worker_pool.h"
 #include "network_mode.h"
 #include "logger.h"
+#include "session_pool.h"
+#include "trace.h"
+#include "uring_loop.h"
 #include "utils.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
-#include <Poco/Net/HTTPClientSession.h>
-#include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/Exception.h>
+#include <Poco/Net/NetException.h>
 
 #include <Poco/URI.h>
 
@@ -40,9 +63,40 @@ struct TelegramCredentials {
     std::string telegram_api_url;
 };
 
+struct OutboxConfig {
+    // Threads sending the messages of SendMessageAsync, each over its own keep-alive
+    // connection from the session pool. Started on the first asynchronous send.
+    size_t senders{4};
+    // Messages waiting to be sent, SendMessageAsync blocks beyond that.
+    size_t capacity{1024};
+};
+
+enum class Transport {
+    // Blocking Poco sessions, a thread per request in flight.
+    Sessions,
+    // Non-blocking sockets on a single epoll thread. Plain HTTP on Linux only, like a
+    // local Bot API server, otherwise Sessions are used.
+    Epoll,
+    // The same on io_uring, which batches the socket I/O of a loop iteration into one
+    // system call. Falls back to Epoll where io_uring is unavailable.
+    IoUring
+};
+
+struct TelegramApiConfig {
+    Transport transport{Transport::Sessions};
+    SessionPoolConfig session_pool;
+    // Of the Epoll and IoUring transports.
+    AsyncHttpClientConfig epoll;
+    OutboxConfig outbox;
+    // Records raw getUpdates replies and sendMessage bodies to this trace file, for
+    // replaying them with the fake server. Empty disables recording.
+    std::string trace_path;
+    FloodControlConfig flood_control;
+};
+
 struct TelegramApiUser {
-    int64_t id;
-    bool is_bot;
+    int64_t id{0};
+    bool is_bot{false};
     std::string first_name;
     std::optional<std::string> last_name;
     std::optional<std::string> username;
@@ -63,22 +117,66 @@ struct TelegramApiUser {
         supports_inline_queries =
             conversion_utils::GetNullableValue<bool>(from, "supports_inline_queries");
     }
+
+    TelegramApiUser(json::JsonReader &reader) {
+        std::string key;
+        reader.BeginObject();
+        while (reader.NextKey(key)) {
+            if (key == "id") {
+                id = reader.ReadInt64();
+            } else if (key == "is_bot") {
+                is_bot = reader.ReadBool();
+            } else if (key == "first_name") {
+                reader.ReadString(first_name);
+            } else if (key == "last_name") {
+                last_name = reader.ReadOptional<std::string>();
+            } else if (key == "username") {
+                username = reader.ReadOptional<std::string>();
+            } else if (key == "language_code") {
+                language_code = reader.ReadOptional<std::string>();
+            } else if (key == "can_join_groups") {
+                can_join_groups = reader.ReadOptional<bool>();
+            } else if (key == "can_read_all_group_messages") {
+                can_read_all_group_messages = reader.ReadOptional<bool>();
+            } else if (key == "supports_inline_queries") {
+                supports_inline_queries = reader.ReadOptional<bool>();
+            } else {
+                reader.Skip();
+            }
+        }
+    }
 };
 
 struct TelegramApiMessageEntity {
     std::string type;
-    int64_t offset;
-    int64_t length;
+    int64_t offset{0};
+    int64_t length{0};
 
     TelegramApiMessageEntity(const Poco::JSON::Object &from) {
         type = from.getValue<std::string>("type");
         offset = from.getValue<int64_t>("offset");
         length = from.getValue<int64_t>("length");
     }
+
+    TelegramApiMessageEntity(json::JsonReader &reader) {
+        std::string key;
+        reader.BeginObject();
+        while (reader.NextKey(key)) {
+            if (key == "type") {
+                reader.ReadString(type);
+            } else if (key == "offset") {
+                offset = reader.ReadInt64();
+            } else if (key == "length") {
+                length = reader.ReadInt64();
+            } else {
+                reader.Skip();
+            }
+        }
+    }
 };
 
 struct TelegramApiChat {
-    int64_t id;
+    int64_t id{0};
     std::string type;
     std::optional<std::string> username;
     std::optional<std::string> first_name;
@@ -89,12 +187,30 @@ struct TelegramApiChat {
         first_name = conversion_utils::GetNullableValue<std::string>(from, "first_name");
         id = from.getValue<int64_t>("id");
     }
+
+    TelegramApiChat(json::JsonReader &reader) {
+        std::string key;
+        reader.BeginObject();
+        while (reader.NextKey(key)) {
+            if (key == "id") {
+                id = reader.ReadInt64();
+            } else if (key == "type") {
+                reader.ReadString(type);
+            } else if (key == "username") {
+                username = reader.ReadOptional<std::string>();
+            } else if (key == "first_name") {
+                first_name = reader.ReadOptional<std::string>();
+            } else {
+                reader.Skip();
+            }
+        }
+    }
 };
 
 struct TelegramApiMessage {
-    int64_t message_id;
+    int64_t message_id{0};
     std::optional<TelegramApiUser> from;
-    int64_t date;
+    int64_t date{0};
     std::vector<TelegramApiMessageEntity> entities;
     std::optional<TelegramApiChat> chat;
     std::optional<std::string> text;
@@ -113,6 +229,31 @@ struct TelegramApiMessage {
         }
     }
 
+    TelegramApiMessage(json::JsonReader &reader) {
+        std::string key;
+        reader.BeginObject();
+        while (reader.NextKey(key)) {
+            if (key == "message_id") {
+                message_id = reader.ReadInt64();
+            } else if (key == "date") {
+                date = reader.ReadInt64();
+            } else if (key == "text") {
+                text = reader.ReadOptional<std::string>();
+            } else if (key == "chat") {
+                chat.emplace(reader);
+            } else if (key == "from") {
+                from.emplace(reader);
+            } else if (key == "entities") {
+                reader.BeginArray();
+                while (reader.NextElement()) {
+                    entities.emplace_back(reader);
+                }
+            } else {
+                reader.Skip();
+            }
+        }
+    }
+
     std::string GetTextOrEmpty() const {
         if (text.has_value()) {
             return text.value();
@@ -121,6 +262,106 @@ struct TelegramApiMessage {
     }
 };
 
+// An update read lazily out of the getUpdates reply it came in, which it keeps alive.
+// Nothing is decoded up front: the members of the update, of its message and of the
+// chat are indexed on first access with the structural index of the reply, and the
+// text is a view into the reply unless it has escapes. Most updates of a large batch
+// only need their id and chat, so this costs far less than a TelegramUpdate for them.
+// Copies share the reply but not the member indexes, and one view must not be used
+// by several threads at once.
+class TelegramUpdateView {
+public:
+    TelegramUpdateView(std::shared_ptr<const json::JsonDocument> reply, std::string_view update)
+        : reply_{std::move(reply)}, raw_{update} {
+    }
+
+    // The JSON of the update.
+    std::string_view Raw() const {
+        return raw_;
+    }
+
+    int64_t UpdateId() const {
+        auto id = Update().Find("update_id");
+        if (id.empty()) {
+            throw json::ParseError("update without update_id");
+        }
+        return json::ParseInt64(id);
+    }
+
+    // Update kinds the bot does not handle have no message, as in TelegramUpdate.
+    bool HasMessage() const {
+        return Message() != nullptr;
+    }
+
+    // 0 without a message.
+    int64_t MessageId() const {
+        auto message = Message();
+        return message ? json::ParseInt64(message->Find("message_id")) : 0;
+    }
+
+    // 0 without a message or chat, the chat the bot shards updates by otherwise.
+    int64_t ChatId() const {
+        auto chat = Chat();
+        return chat ? json::ParseInt64(chat->Find("id")) : 0;
+    }
+
+    // Valid as long as the view.
+    std::optional<std::string_view> Text() const {
+        auto message = Message();
+        if (!message) {
+            return {};
+        }
+        auto text = message->Find("text");
+        if (IsAbsent(text)) {
+            return {};
+        }
+        return json::ParseString(text, text_);
+    }
+
+private:
+    static bool IsAbsent(std::string_view raw) {
+        return raw.empty() || raw == "null";
+    }
+
+    const json::ObjectIndex &Update() const {
+        if (!update_) {
+            update_.emplace(*reply_, raw_);
+        }
+        return *update_;
+    }
+
+    const json::ObjectIndex *Message() const {
+        if (!message_) {
+            auto raw = Update().Find("message");
+            if (IsAbsent(raw)) {
+                return nullptr;
+            }
+            message_.emplace(*reply_, raw);
+        }
+        return &*message_;
+    }
+
+    const json::ObjectIndex *Chat() const {
+        if (!chat_) {
+            auto message = Message();
+            auto raw = message ? message->Find("chat") : std::string_view{};
+            if (IsAbsent(raw)) {
+                return nullptr;
+            }
+            chat_.emplace(*reply_, raw);
+        }
+        return &*chat_;
+    }
+
+    std::shared_ptr<const json::JsonDocument> reply_;
+    std::string_view raw_;
+    mutable std::optional<json::ObjectIndex> update_;
+    mutable std::optional<json::ObjectIndex> message_;
+    mutable std::optional<json::ObjectIndex> chat_;
+    // The decoded text if it has escapes.
+    mutable std::string text_;
+};
+
 struct TelegramUpdate {
     std::optional<TelegramApiMessage> message;
     int64_t update_id;
@@ -130,9 +371,40 @@ struct TelegramUpdate {
         update_id = from.getValue<int64_t>("update_id");
     }
 
+    // Update kinds the bot does not handle (edited messages, callbacks, ...) are
+    // skipped and leave message empty.
+    TelegramUpdate(json::JsonReader &reader) {
+        std::optional<int64_t> id;
+        std::string key;
+        reader.BeginObject();
+        while (reader.NextKey(key)) {
+            if (key == "update_id") {
+                id = reader.ReadInt64();
+            } else if (key == "message") {
+                message.emplace(reader);
+            } else {
+                reader.Skip();
+            }
+        }
+        if (!id) {
+            throw json::ParseError("update without update_id");
+        }
+        update_id = id.value();
+    }
+
     TelegramUpdate(const TelegramUpdate &from) : message{from.message}, update_id{from.update_id} {
     }
 
+    // Decodes all of a lazy update, for the code that takes a TelegramUpdate.
+    explicit TelegramUpdate(const TelegramUpdateView &view) {
+        json::ViewBuffer buffer(view.Raw());
+        std::istream in(&buffer);
+        json::JsonReader reader(in);
+        TelegramUpdate update(reader);
+        message = std::move(update.message);
+        update_id = update.update_id;
+    }
+
     std::string GetMessageTextOrEmpty() const {
         if (message.has_value()) {
             return message->GetTextOrEmpty();
@@ -141,152 +413,796 @@ struct TelegramUpdate {
     }
 };
 
+// Decodes a getUpdates reply in one pass over the stream, without building a DOM.
+inline std::vector<TelegramUpdate> ParseUpdates(std::istream &reply) {
+    std::vector<TelegramUpdate> updates;
+    json::JsonReader reader(reply);
+    std::string key;
+    reader.BeginObject();
+    while (reader.NextKey(key)) {
+        if (key == "result") {
+            reader.BeginArray();
+            while (reader.NextElement()) {
+                updates.emplace_back(reader);
+            }
+        } else {
+            reader.Skip();
+        }
+    }
+    return updates;
+}
+
+// Splits a getUpdates reply into lazy views of its updates, which share the reply.
+// Indexing the reply is the only pass over all of it, the updates are read on access.
+inline std::vector<TelegramUpdateView> ParseUpdateViews(std::string reply) {
+    auto document = std::make_shared<const json::JsonDocument>(std::move(reply));
+    std::vector<TelegramUpdateView> updates;
+    auto result = json::ObjectIndex(*document, document->Text()).Find("result");
+    if (result.empty()) {
+        return updates;
+    }
+    json::ForEachElement(*document, result, [&](std::string_view update) {
+        updates.emplace_back(document, update);
+    });
+    return updates;
+}
+
 class TelegramApiError : public std::runtime_error {
 public:
-    TelegramApiError(int http_code_p, const std::string &details_p)
+    // http_code is 0 for errors that happened before a reply was received.
+    TelegramApiError(int http_code_p, const std::string &details_p,
+                     const std::string &description_p = {},
+                     std::optional<int64_t> retry_after_p = {})
         : std::runtime_error("telegram api error: code=" + std::to_string(http_code_p) +
-                             " details=" + details_p),
-          details_(details_p) {
+                             " details=" + details_p +
+                             (description_p.empty() ? "" : ": " + description_p)),
+          http_code_(http_code_p),
+          details_(details_p),
+          description_(description_p),
+          retry_after_(retry_after_p) {
+    }
+
+    int HttpCode() const {
+        return http_code_;
+    }
+
+    // Telegram's explanation from the error reply, if it sent one.
+    const std::string &Description() const {
+        return description_;
+    }
+
+    // Seconds to wait before repeating the request, set on 429 Too Many Requests.
+    std::optional<int64_t> RetryAfter() const {
+        return retry_after_;
     }
 
 private:
+    int http_code_;
     std::string details_;
+    std::string description_;
+    std::optional<int64_t> retry_after_;
 };
 
 class TelegramApi {
 public:
-    TelegramApi(const TelegramCredentials &credentials, NetworkMode mode = NetworkMode::HTTP)
+    TelegramApi(const TelegramCredentials &credentials, NetworkMode mode = NetworkMode::HTTP,
+                const TelegramApiConfig &config = {})
         : credentials_{credentials},
+          api_uri_{credentials.telegram_api_url + "bot" + credentials.telegram_token + "/"},
+          get_me_{MakeMethod("getMe", Poco::Net::HTTPRequest::HTTP_GET)},
+          get_updates_{MakeMethod("getUpdates", Poco::Net::HTTPRequest::HTTP_GET)},
+          set_webhook_{MakeMethod("setWebhook", Poco::Net::HTTPRequest::HTTP_GET)},
+          send_message_{MakeMethod("sendMessage", Poco::Net::HTTPRequest::HTTP_POST,
+                                   "application/json")},
           mode_{mode},
-          logger_{logger::LoggerFactory::GetStdoutLogger()} {
+          session_pool_{mode, config.session_pool},
+          request_timeout_{config.session_pool.request_timeout},
+          flood_control_{config.flood_control},
+          logger_{logger::LoggerFactory::GetDefaultLogger()},
+          outbox_config_{config.outbox} {
+        if (!config.trace_path.empty()) {
+            trace_ = std::make_unique<TraceWriter>(config.trace_path);
+        }
+        if (config.transport != Transport::Sessions) {
+            StartEpollTransport(config.transport, config.epoll);
+        }
+    }
+
+    TelegramApi(const TelegramApi &) = delete;
+    TelegramApi &operator=(const TelegramApi &) = delete;
+
+    ~TelegramApi() {
+#if defined(__linux__)
+        if (reactor_) {
+            FlushOutbox();
+            reactor_->Stop();
+        }
+#endif
     }
 
     TelegramApiUser GetMe() {
         logger_->LogInfo("GetMe request...");
-        auto uri = GetURI("getMe");
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPath(),
-                                       Poco::Net::HTTPMessage::HTTP_1_1);
-
-        auto reply = SendRequestAndGetReply(uri, request);
+        auto reply = SendRequestAndGetReply(get_me_);
 
         auto result = reply.extract<Poco::JSON::Object::Ptr>()->getObject("result");
 
         return TelegramApiUser(*result);
     }
 
-    std::vector<TelegramUpdate> GetUpdates(std::optional<int64_t> offset = {},
-                                           std::optional<int64_t> timeout = {}) {
-        logger_->LogInfo("Getting updates with offset: " + GetString(offset) + "...");
+    // Username of the bot, from the first getMe that succeeds. Throws like GetMe until
+    // then. getMe runs outside the lock and at most once in kUsernameRetry, callers in
+    // between get the last error right away instead of a request each.
+    const std::string &Username() {
+        {
+            std::lock_guard<std::mutex> guard(username_mutex_);
+            if (username_) {
+                return *username_;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now < username_retry_at_) {
+                throw TelegramApiError(0, username_error_);
+            }
+            username_retry_at_ = now + kUsernameRetry;
+            username_error_ = "getMe error: waiting for the reply";
+        }
 
-        auto uri = GetURI("getUpdates");
-        if (timeout) {
-            uri.addQueryParameter("timeout", std::to_string(timeout.value()));
+        std::string username;
+        try {
+            username = GetMe().username.value_or("");
+        } catch (const std::exception &error) {
+            std::lock_guard<std::mutex> guard(username_mutex_);
+            username_error_ = error.what();
+            throw;
         }
-        if (offset) {
-            uri.addQueryParameter("offset", std::to_string(offset.value()));
+        std::lock_guard<std::mutex> guard(username_mutex_);
+        if (!username_) {
+            username_ = std::move(username);
         }
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPathAndQuery(),
-                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        return *username_;
+    }
 
-        auto reply = SendRequestAndGetReply(uri, request);
+    // timeout enables long polling: the server holds the request for up to that many
+    // seconds until an update arrives. An empty allowed_updates keeps the previous
+    // server-side setting.
+    std::vector<TelegramUpdate> GetUpdates(std::optional<int64_t> offset = {},
+                                           std::optional<int64_t> timeout = {},
+                                           std::optional<int64_t> limit = {},
+                                           const std::vector<std::string> &allowed_updates = {}) {
+        logger_->LogInfo("Getting updates with offset: ", offset, "...");
 
-        Poco::JSON::Array::Ptr updates_array =
-            reply.extract<Poco::JSON::Object::Ptr>()->getArray("result");
-        std::vector<TelegramUpdate> updates;
-        for (size_t obj_index = 0; obj_index != updates_array->size(); ++obj_index) {
-            updates.emplace_back(*updates_array->getObject(obj_index));
-        }
+        auto query = GetUpdatesQuery(offset, timeout, limit, allowed_updates);
+        auto updates = Perform(get_updates_, query, {}, std::chrono::seconds(timeout.value_or(0)),
+                               [this](std::istream &reply) { return ReadUpdates(reply); });
 
-        logger_->LogInfo("Got " + std::to_string(updates.size()) + " updates");
+        logger_->LogInfo("Got ", updates.size(), " updates");
 
         return updates;
     }
 
-    TelegramApiMessage SendMessage(int64_t chat_id, const std::string &message) {
-        Poco::JSON::Object obj;
-        logger_->LogInfo("Sending message: " + message + " to: " + std::to_string(chat_id) + "...");
-        obj.set("chat_id", chat_id);
-        obj.set("text", message);
-        std::stringstream body_to_send_stream;
-        obj.stringify(body_to_send_stream);
-        auto body_to_send = body_to_send_stream.str();
+    // The same as lazy views sharing the reply, which is kept whole in memory.
+    std::vector<TelegramUpdateView> GetUpdateViews(
+        std::optional<int64_t> offset = {}, std::optional<int64_t> timeout = {},
+        std::optional<int64_t> limit = {}, const std::vector<std::string> &allowed_updates = {}) {
+        logger_->LogInfo("Getting updates with offset: ", offset, "...");
+
+        auto query = GetUpdatesQuery(offset, timeout, limit, allowed_updates);
+        auto updates = Perform(get_updates_, query, {}, std::chrono::seconds(timeout.value_or(0)),
+                               [this](std::istream &reply) { return ReadUpdateViews(reply); });
+
+        logger_->LogInfo("Got ", updates.size(), " updates");
+
+        return updates;
+    }
+
+    // Has Telegram post updates to url instead of serving them to getUpdates, over at
+    // most max_connections connections at once. A non-empty secret_token comes back in
+    // the X-Telegram-Bot-Api-Secret-Token header of every delivery.
+    void SetWebhook(const std::string &url, const std::string &secret_token = {},
+                    std::optional<int64_t> max_connections = {},
+                    const std::vector<std::string> &allowed_updates = {}) {
+        logger_->LogInfo("Setting webhook: ", url, "...");
+
+        std::string query;
+        AppendQueryParameter(query, "url", url);
+        if (!secret_token.empty()) {
+            AppendQueryParameter(query, "secret_token", secret_token);
+        }
+        if (max_connections) {
+            AppendQueryParameter(query, "max_connections", std::to_string(max_connections.value()));
+        }
+        if (!allowed_updates.empty()) {
+            AppendQueryParameter(query, "allowed_updates", ToJsonArray(allowed_updates));
+        }
+
+        SendRequestAndGetReply(set_webhook_, query);
+    }
 
-        return SendMessageWithBody(body_to_send);
+    TelegramApiMessage SendMessage(int64_t chat_id, const std::string &message) {
+        logger_->LogInfo("Sending message: ", message, " to: ", chat_id, "...");
+        return SendMessageWithBody(chat_id, WriteSendMessageBody(chat_id, message, {}));
     }
 
     TelegramApiMessage SendMessage(int64_t chat_id, const std::string &message,
                                    int64_t reply_to_message_id) {
-        logger_->LogInfo("Sending reply message: " + message + " to: " + std::to_string(chat_id) +
-                         " on: " + std::to_string(reply_to_message_id) + "...");
-        Poco::JSON::Object obj;
-        obj.set("chat_id", chat_id);
-        obj.set("text", message);
-        obj.set("reply_to_message_id", reply_to_message_id);
-        std::stringstream body_to_send_stream;
-        obj.stringify(body_to_send_stream);
-        auto body_to_send = body_to_send_stream.str();
+        logger_->LogInfo("Sending reply message: ", message, " to: ", chat_id,
+                         " on: ", reply_to_message_id, "...");
+        return SendMessageWithBody(chat_id,
+                                   WriteSendMessageBody(chat_id, message, reply_to_message_id));
+    }
+
+    using SendCallback = std::function<void(std::future<TelegramApiMessage>)>;
+
+    // Queue the message for the sender threads and return right away. Messages to one
+    // chat are sent in the order they were queued. The future, or the one passed to
+    // on_sent, holds the sent message or the TelegramApiError.
+    std::future<TelegramApiMessage> SendMessageAsync(int64_t chat_id, const std::string &message) {
+        return EnqueueSend(chat_id, MakeSendMessageBody(chat_id, message));
+    }
+
+    std::future<TelegramApiMessage> SendMessageAsync(int64_t chat_id, const std::string &message,
+                                                     int64_t reply_to_message_id) {
+        return EnqueueSend(chat_id, MakeSendMessageBody(chat_id, message, reply_to_message_id));
+    }
+
+    // on_sent runs on a sender thread and must not block for long.
+    void SendMessageAsync(int64_t chat_id, const std::string &message, SendCallback on_sent) {
+        EnqueueSend(chat_id, MakeSendMessageBody(chat_id, message), std::move(on_sent));
+    }
+
+    void SendMessageAsync(int64_t chat_id, const std::string &message,
+                          int64_t reply_to_message_id, SendCallback on_sent) {
+        EnqueueSend(chat_id, MakeSendMessageBody(chat_id, message, reply_to_message_id),
+                    std::move(on_sent));
+    }
 
-        return SendMessageWithBody(body_to_send);
+    // Blocks until every message queued so far has been sent or has failed.
+    void FlushOutbox() {
+        if (outbox_) {
+            outbox_->Drain();
+        }
+#if defined(__linux__)
+        std::unique_lock<std::mutex> guard(reactor_sends_mutex_);
+        reactor_sends_done_.wait(guard, [this] { return reactor_sends_pending_ == 0; });
+#endif
+    }
+
+    // Writes out the buffered tail of the trace, so that it survives an exit that skips
+    // the destructors.
+    void FlushTrace() {
+        if (trace_) {
+            trace_->Flush();
+        }
+    }
+
+    // JSON body of a sendMessage request.
+    static std::string MakeSendMessageBody(int64_t chat_id, const std::string &message,
+                                           std::optional<int64_t> reply_to_message_id = {}) {
+        return std::string(WriteSendMessageBody(chat_id, message, reply_to_message_id));
+    }
+
+    // The same written into a buffer of the calling thread, which stays valid until the
+    // thread writes the next body. Once the buffer has grown to the longest message
+    // nothing is allocated.
+    static std::string_view WriteSendMessageBody(int64_t chat_id, std::string_view message,
+                                                 std::optional<int64_t> reply_to_message_id) {
+        thread_local std::string buffer;
+        buffer.clear();
+        json::JsonWriter writer(buffer);
+        writer.BeginObject();
+        writer.Key("chat_id");
+        writer.WriteInt64(chat_id);
+        writer.Key("text");
+        writer.WriteString(message);
+        if (reply_to_message_id) {
+            writer.Key("reply_to_message_id");
+            writer.WriteInt64(reply_to_message_id.value());
+        }
+        writer.EndObject();
+        return buffer;
     }
 
 private:
-    TelegramApiMessage SendMessageWithBody(const std::string &body_to_send) {
-        auto uri = GetURI("sendMessage");
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPath(),
-                                       Poco::Net::HTTPMessage::HTTP_1_1);
+    // A Bot API method: its name for errors and the templates of its requests, the
+    // wire form for the non-blocking transports and Poco requests for the sessions.
+    struct MethodTemplate {
+        std::string name;
+        HttpRequestTemplate request;
+        std::shared_ptr<RequestPool> session_requests;
+    };
 
-        request.setContentLength(body_to_send.size());
-        request.setContentType("application/json");
+    // A message of SendMessageAsync waiting in the outbox, or on the epoll transport.
+    struct QueuedSend {
+        int64_t chat_id{0};
+        std::string body;
+        int attempt{1};
+        std::promise<TelegramApiMessage> result;
+        SendCallback on_sent;
+    };
 
-        auto session = GetSession(uri);
+    std::future<TelegramApiMessage> EnqueueSend(int64_t chat_id, std::string body,
+                                                SendCallback on_sent = {}) {
+        logger_->LogInfo("Queueing message to: ", chat_id, "...");
+#if defined(__linux__)
+        if (http_client_) {
+            return EnqueueOnReactor(chat_id, std::move(body), std::move(on_sent));
+        }
+#endif
+        if (trace_) {
+            trace_->Write(TraceRecordKind::SendMessageRequest, body);
+        }
+        auto send = std::make_shared<QueuedSend>();
+        send->chat_id = chat_id;
+        send->body = std::move(body);
+        send->on_sent = std::move(on_sent);
+        std::future<TelegramApiMessage> result;
+        if (!send->on_sent) {
+            result = send->result.get_future();
+        }
 
-        session->sendRequest(request) << body_to_send;
+        // Flood control is the gate of the outbox: a chat out of slots is parked until
+        // its next one while the sender goes on with other chats.
+        std::call_once(outbox_started_, [this] {
+            KeyedWorkerPool::Gate gate;
+            if (flood_control_.Enabled()) {
+                gate = [this](int64_t chat_id, FloodControl::Clock::time_point now) {
+                    return flood_control_.TryTake(chat_id, now);
+                };
+            }
+            outbox_ = std::make_unique<KeyedWorkerPool>(outbox_config_.senders,
+                                                        outbox_config_.capacity, std::move(gate));
+        });
+        if (!outbox_->Submit(chat_id, [this, send] { RunOutboxSend(send); })) {
+            throw TelegramApiError(0, "sendMessage error: outbox is shut down");
+        }
+        return result;
+    }
 
-        Poco::Net::HTTPResponse response;
-        auto &body = session->receiveResponse(response);
+    // One attempt of an outbox send. A rejected message goes back to the head of its
+    // chat's lane, RetryDelay has paused the chat so the lane is parked meanwhile.
+    void RunOutboxSend(const std::shared_ptr<QueuedSend> &send) {
+        try {
+            send->result.set_value(SendMessageOnce(send->body));
+        } catch (const TelegramApiError &error) {
+            if (RetryDelay(send->chat_id, error, send->attempt)) {
+                ++send->attempt;
+                outbox_->Requeue(send->chat_id, [this, send] { RunOutboxSend(send); });
+                return;
+            }
+            send->result.set_exception(std::current_exception());
+        } catch (...) {
+            send->result.set_exception(std::current_exception());
+        }
+        NotifySent(*send);
+    }
 
-        if (response.getStatus() / 100 != 2) {
-            throw TelegramApiError(response.getStatus(), "sendMessage error");
+    void NotifySent(QueuedSend &send) {
+        if (!send.on_sent) {
+            return;
+        }
+        try {
+            send.on_sent(send.result.get_future());
+        } catch (const std::exception &error) {
+            logger_->LogError("sendMessage callback failed: ", error.what());
         }
+    }
 
-        Poco::JSON::Parser parser;
-        auto reply = parser.parse(body);
+    void StartEpollTransport([[maybe_unused]] Transport transport,
+                             [[maybe_unused]] const AsyncHttpClientConfig &config) {
+#if defined(__linux__)
+        if (mode_ == NetworkMode::HTTP) {
+            reactor_ = std::make_unique<IoThread>(MakeIoLoop(transport));
+            http_client_ = std::make_unique<AsyncHttpClient>(reactor_->Get(), config);
+            return;
+        }
+#endif
+        logger_->LogError("Non-blocking transports need plain HTTP on Linux, using sessions");
+    }
 
-        auto result = reply.extract<Poco::JSON::Object::Ptr>()->getObject("result");
-        return TelegramApiMessage(*result);
+#if defined(__linux__)
+    std::unique_ptr<IoLoop> MakeIoLoop(Transport transport) {
+#if defined(HAVE_IO_URING)
+        if (transport == Transport::IoUring) {
+            try {
+                return std::make_unique<UringLoop>();
+            } catch (const std::system_error &error) {
+                logger_->LogError("io_uring is unavailable, using epoll: ", error.what());
+            }
+        }
+#else
+        if (transport == Transport::IoUring) {
+            logger_->LogError("Built without io_uring, using epoll");
+        }
+#endif
+        return std::make_unique<Reactor>();
+    }
+#endif
+
+    // Reply of a request sent over a non-blocking transport, read like Perform does.
+    template <typename Reader>
+    static std::invoke_result_t<Reader &, std::istream &> ReadReply(const std::string &method,
+                                                                    const HttpResponse &response,
+                                                                    Reader &&read_reply) {
+        std::istringstream reply_stream(response.body);
+        if (response.status / 100 != 2) {
+            auto error = ReadErrorReply(reply_stream);
+            throw TelegramApiError(response.status, method + " error", error.description,
+                                   error.retry_after);
+        }
+        try {
+            return read_reply(reply_stream);
+        } catch (const json::ParseError &error) {
+            throw TelegramApiError(0, method + " malformed reply: " + error.what());
+        } catch (const Poco::Exception &error) {
+            throw TelegramApiError(0, method + " malformed reply: " + error.displayText());
+        } catch (const std::exception &error) {
+            // Like std::out_of_range from a reply without the expected fields.
+            throw TelegramApiError(0, method + " malformed reply: " + error.what());
+        }
+    }
+
+    static TelegramApiError TransportError(const std::string &method,
+                                           const HttpTransportError &error) {
+        return TelegramApiError(
+            0, method + (error.TimedOut() ? " timeout: " : " network error: ") + error.what());
+    }
+
+    HttpRequestSpec MakeRequestSpec(const MethodTemplate &method, std::string_view query,
+                                    std::string_view body,
+                                    std::chrono::seconds server_wait = {}) const {
+        HttpRequestSpec spec;
+        spec.host = api_uri_.getHost();
+        spec.port = api_uri_.getPort();
+        spec.wire = method.request.Format(query, body);
+        spec.timeout = request_timeout_ + server_wait;
+        return spec;
+    }
+
+#if defined(__linux__)
+    // Blocks the calling thread, never the loop thread, until the reply arrives.
+    HttpResponse WaitForResponse(HttpRequestSpec spec, const std::string &method) {
+        std::promise<HttpResponse> done;
+        auto response = done.get_future();
+        http_client_->Request(std::move(spec), [&done](std::future<HttpResponse> reply) {
+            try {
+                done.set_value(reply.get());
+            } catch (...) {
+                done.set_exception(std::current_exception());
+            }
+        });
+        try {
+            return response.get();
+        } catch (const HttpTransportError &error) {
+            throw TransportError(method, error);
+        }
     }
 
-    Poco::Dynamic::Var SendRequestAndGetReply(const Poco::URI &uri,
-                                              Poco::Net::HTTPRequest &request) {
-        auto session = GetSession(uri);
+    // Messages wait in a queue per chat and only the head of each queue is in flight,
+    // so one chat's messages are sent in order while all chats share the loop thread.
+    // Flood control delays and retries are timers instead of sleeping threads.
+    std::future<TelegramApiMessage> EnqueueOnReactor(int64_t chat_id, std::string body,
+                                                     SendCallback on_sent) {
+        if (trace_) {
+            trace_->Write(TraceRecordKind::SendMessageRequest, body);
+        }
+        auto send = std::make_shared<QueuedSend>();
+        send->chat_id = chat_id;
+        send->body = std::move(body);
+        send->on_sent = std::move(on_sent);
+        std::future<TelegramApiMessage> result;
+        if (!send->on_sent) {
+            result = send->result.get_future();
+        }
+        {
+            std::lock_guard<std::mutex> guard(reactor_sends_mutex_);
+            ++reactor_sends_pending_;
+        }
+        reactor_->Get().Post([this, send] {
+            auto &queue = reactor_sends_[send->chat_id];
+            queue.push_back(send);
+            if (queue.size() == 1) {
+                StartReactorSend(send);
+            }
+        });
+        return result;
+    }
 
-        session->sendRequest(request);
+    void StartReactorSend(const std::shared_ptr<QueuedSend> &send) {
+        if (flood_control_.Enabled()) {
+            auto now = FloodControl::Clock::now();
+            auto at = flood_control_.TryTake(send->chat_id, now);
+            if (at > now) {
+                reactor_->Get().RunAt(at, [this, send] { StartReactorSend(send); });
+                return;
+            }
+        }
 
-        Poco::Net::HTTPResponse response;
-        auto &body = session->receiveResponse(response);
+        auto spec = MakeRequestSpec(send_message_, {}, send->body);
+        http_client_->Request(std::move(spec), [this, send](std::future<HttpResponse> reply) {
+            OnReactorSendReply(send, std::move(reply));
+        });
+    }
 
-        if (response.getStatus() / 100 != 2) {
-            throw TelegramApiError(response.getStatus(), "getMe error");
+    void OnReactorSendReply(const std::shared_ptr<QueuedSend> &send,
+                            std::future<HttpResponse> reply) {
+        try {
+            try {
+                send->result.set_value(ReadReply("sendMessage", reply.get(), ReadSentMessage));
+            } catch (const HttpTransportError &error) {
+                throw TransportError("sendMessage", error);
+            }
+        } catch (const TelegramApiError &error) {
+            if (auto delay = RetryDelay(send->chat_id, error, send->attempt)) {
+                ++send->attempt;
+                reactor_->Get().RunAfter(*delay, [this, send] { StartReactorSend(send); });
+                return;
+            }
+            send->result.set_exception(std::current_exception());
+        } catch (...) {
+            send->result.set_exception(std::current_exception());
         }
+        FinishReactorSend(send);
+    }
 
+    void FinishReactorSend(const std::shared_ptr<QueuedSend> &send) {
+        NotifySent(*send);
+
+        auto queue = reactor_sends_.find(send->chat_id);
+        queue->second.pop_front();
+        if (queue->second.empty()) {
+            reactor_sends_.erase(queue);
+        } else {
+            StartReactorSend(queue->second.front());
+        }
+
+        std::lock_guard<std::mutex> guard(reactor_sends_mutex_);
+        if (--reactor_sends_pending_ == 0) {
+            reactor_sends_done_.notify_all();
+        }
+    }
+#endif
+
+    static std::string GetUpdatesQuery(std::optional<int64_t> offset,
+                                       std::optional<int64_t> timeout,
+                                       std::optional<int64_t> limit,
+                                       const std::vector<std::string> &allowed_updates) {
+        std::string query;
+        // Fits all the parameters of a usual poll, so the query is not reallocated.
+        query.reserve(128);
+        if (timeout) {
+            AppendQueryParameter(query, "timeout", std::to_string(timeout.value()));
+        }
+        if (offset) {
+            AppendQueryParameter(query, "offset", std::to_string(offset.value()));
+        }
+        if (limit) {
+            AppendQueryParameter(query, "limit", std::to_string(limit.value()));
+        }
+        if (!allowed_updates.empty()) {
+            AppendQueryParameter(query, "allowed_updates", ToJsonArray(allowed_updates));
+        }
+        return query;
+    }
+
+    std::vector<TelegramUpdate> ReadUpdates(std::istream &reply) {
+        if (!trace_) {
+            return ParseUpdates(reply);
+        }
+        std::string body{std::istreambuf_iterator<char>(reply), {}};
+        trace_->Write(TraceRecordKind::GetUpdatesReply, body);
+        std::istringstream body_stream(body);
+        return ParseUpdates(body_stream);
+    }
+
+    std::vector<TelegramUpdateView> ReadUpdateViews(std::istream &reply) {
+        std::string body{std::istreambuf_iterator<char>(reply), {}};
+        if (trace_) {
+            trace_->Write(TraceRecordKind::GetUpdatesReply, body);
+        }
+        return ParseUpdateViews(std::move(body));
+    }
+
+    // With flood control the message waits for a free slot of its chat, and a reply of
+    // 429 or 5xx means it was not delivered, so it is sent again later. Network errors
+    // are not retried, the message may have been delivered before the connection broke.
+    TelegramApiMessage SendMessageWithBody(int64_t chat_id, std::string_view body_to_send) {
+        if (trace_) {
+            trace_->Write(TraceRecordKind::SendMessageRequest, body_to_send);
+        }
+
+        for (int attempt = 1;; ++attempt) {
+            flood_control_.Acquire(chat_id);
+            try {
+                return SendMessageOnce(body_to_send);
+            } catch (const TelegramApiError &error) {
+                // The chat is paused for the delay, Acquire waits it out.
+                if (!RetryDelay(chat_id, error, attempt)) {
+                    throw;
+                }
+            }
+        }
+    }
+
+    // Time to wait before sending a rejected message again, nothing if it is given up.
+    // Pauses the chat in flood control for that time.
+    std::optional<std::chrono::milliseconds> RetryDelay(int64_t chat_id,
+                                                        const TelegramApiError &error,
+                                                        int attempt) {
+        auto retryable = error.HttpCode() == 429 || error.HttpCode() / 100 == 5;
+        if (!retryable || attempt >= flood_control_.MaxAttempts()) {
+            return std::nullopt;
+        }
+        auto delay = error.RetryAfter()
+                         ? std::chrono::milliseconds(error.RetryAfter().value() * 1000)
+                         : kServerErrorBackoff * (1 << (attempt - 1));
+        flood_control_.Backoff(chat_id, delay);
+        logger_->LogInfo("sendMessage to ", chat_id, " rejected, retrying in ", delay.count(),
+                         " ms: ", error.what());
+        return delay;
+    }
+
+    TelegramApiMessage SendMessageOnce(std::string_view body_to_send) {
+        return Perform(send_message_, {}, body_to_send, {}, ReadSentMessage);
+    }
+
+    static TelegramApiMessage ReadSentMessage(std::istream &reply) {
         Poco::JSON::Parser parser;
-        auto reply = parser.parse(body);
-        return reply;
+        auto result = parser.parse(reply).extract<Poco::JSON::Object::Ptr>()->getObject("result");
+        return TelegramApiMessage(*result);
     }
 
-    Poco::URI GetURI(std::string path) {
-        Poco::URI uri(credentials_.telegram_api_url + "bot" + credentials_.telegram_token + "/" +
-                      path);
-        return uri;
+    Poco::Dynamic::Var SendRequestAndGetReply(const MethodTemplate &method,
+                                              std::string_view query = {},
+                                              std::string_view body = {},
+                                              std::chrono::seconds server_wait = {}) {
+        return Perform(method, query, body, server_wait, [](std::istream &reply_stream) {
+            Poco::JSON::Parser parser;
+            return parser.parse(reply_stream);
+        });
     }
 
-    std::unique_ptr<Poco::Net::HTTPClientSession> GetSession(const Poco::URI &uri) {
-        if (mode_ == NetworkMode::HTTP) {
-            return std::make_unique<Poco::Net::HTTPClientSession>(uri.getHost(), uri.getPort());
+    // Sends a request of the method over a pooled keep-alive session and hands the body
+    // of a successful reply to read_reply. A reused session whose connection was closed
+    // by the server while idle is replaced by a fresh one once, if the request can't have
+    // been carried out: see MayResend.
+    template <typename Reader>
+    std::invoke_result_t<Reader &, std::istream &> Perform(const MethodTemplate &method,
+                                                           std::string_view query,
+                                                           std::string_view body,
+                                                           std::chrono::seconds server_wait,
+                                                           Reader &&read_reply) {
+#if defined(__linux__)
+        if (http_client_) {
+            auto spec = MakeRequestSpec(method, query, body, server_wait);
+            return ReadReply(method.name, WaitForResponse(std::move(spec), method.name),
+                             read_reply);
+        }
+#endif
+        // Poco writes the request itself, from one kept with its headers set.
+        auto &requests = *method.session_requests;
+        auto request = query.empty()
+                           ? requests.Acquire(requests.Path(), body.size())
+                           : requests.Acquire(method.request.Target(query), body.size());
+        for (int attempt = 0;; ++attempt) {
+            auto session = session_pool_.Acquire(api_uri_, server_wait);
+            auto stage = ExchangeStage::Sending;
+            try {
+                session->sendRequest(*request) << body;
+
+                stage = ExchangeStage::AwaitingStatus;
+                Poco::Net::HTTPResponse response;
+                auto &reply_stream = session->receiveResponse(response);
+                stage = ExchangeStage::Reading;
+
+                if (response.getStatus() / 100 != 2) {
+                    auto error = ReadErrorReply(reply_stream);
+                    session.Release();
+                    throw TelegramApiError(response.getStatus(), method.name + " error",
+                                           error.description, error.retry_after);
+                }
+
+                auto reply = read_reply(reply_stream);
+                SkipRest(reply_stream);
+                session.Release();
+                return reply;
+            } catch (const Poco::IOException &error) {
+                if (!session.IsReused() || attempt != 0 || !MayResend(method, stage, error)) {
+                    throw TelegramApiError(0, method.name + " network error: " +
+                                                  error.displayText());
+                }
+                logger_->LogInfo("Keep-alive connection to ", api_uri_.getHost(),
+                                 " was closed, reconnecting...");
+            } catch (const Poco::TimeoutException &error) {
+                throw TelegramApiError(0, method.name + " timeout: " + error.displayText());
+            } catch (const json::ParseError &error) {
+                throw TelegramApiError(0, method.name + " malformed reply: " + error.what());
+            } catch (const Poco::Exception &error) {
+                // Poco streams turn a connection broken in the middle of the body into an
+                // early end, which the DOM parser reports.
+                throw TelegramApiError(0, method.name + " malformed reply: " +
+                                              error.displayText());
+            } catch (const TelegramApiError &) {
+                throw;
+            } catch (const std::exception &error) {
+                throw TelegramApiError(0, method.name + " malformed reply: " + error.what());
+            }
+        }
+    }
+
+    enum class ExchangeStage { Sending, AwaitingStatus, Reading };
+
+    // GETs only read, so they are sent again whatever broke. Other methods are resent
+    // only if the server can't have acted on them: the request didn't go out, or the
+    // connection was closed without a byte of response, as an idle keep-alive
+    // connection is. Once a status line arrived the request was carried out, and
+    // sending it again would deliver a message twice.
+    static bool MayResend(const MethodTemplate &method, ExchangeStage stage,
+                          const Poco::IOException &error) {
+        if (method.request.Method() == Poco::Net::HTTPRequest::HTTP_GET) {
+            return true;
         }
-        return std::unique_ptr<Poco::Net::HTTPClientSession>(
-            std::make_unique<Poco::Net::HTTPSClientSession>(uri.getHost(), uri.getPort())
-                .release());
+        return stage == ExchangeStage::Sending ||
+               (stage == ExchangeStage::AwaitingStatus &&
+                dynamic_cast<const Poco::Net::NoMessageException *>(&error) != nullptr);
+    }
+
+    static std::string ToJsonArray(const std::vector<std::string> &values) {
+        std::string result = "[";
+        for (const auto &value : values) {
+            if (result.size() > 1) {
+                result += ",";
+            }
+            result += "\"" + value + "\"";
+        }
+        return result + "]";
+    }
+
+    struct ErrorReply {
+        std::string description;
+        std::optional<int64_t> retry_after;
+    };
+
+    // Picks the description and parameters.retry_after out of an error reply. Bodies
+    // that are not Telegram's JSON, like a proxy's error page, give an empty result.
+    static ErrorReply ReadErrorReply(std::istream &stream) {
+        std::string body{std::istreambuf_iterator<char>(stream), {}};
+        std::istringstream body_stream(body);
+        ErrorReply error;
+        try {
+            json::JsonReader reader(body_stream);
+            std::string key;
+            reader.BeginObject();
+            while (reader.NextKey(key)) {
+                if (key == "description") {
+                    reader.ReadString(error.description);
+                } else if (key == "parameters") {
+                    reader.BeginObject();
+                    while (reader.NextKey(key)) {
+                        if (key == "retry_after") {
+                            error.retry_after = reader.ReadInt64();
+                        } else {
+                            reader.Skip();
+                        }
+                    }
+                } else {
+                    reader.Skip();
+                }
+            }
+        } catch (const json::ParseError &) {
+            return {};
+        }
+        return error;
+    }
+
+    static void SkipRest(std::istream &stream) {
+        stream.ignore(std::numeric_limits<std::streamsize>::max());
+    }
+
+    MethodTemplate MakeMethod(const std::string &name, const std::string &http_method,
+                              const std::string &content_type = {}) const {
+        auto path = api_uri_.getPath() + name;
+        return MethodTemplate{
+            name, HttpRequestTemplate(http_method, path, api_uri_.getHost(), content_type),
+            std::make_shared<RequestPool>(http_method, path, content_type)};
     }
 
     std::string OffsetToString(std::optional<int64_t> current) const {
@@ -294,9 +1210,44 @@ private:
     }
 
 private:
+    // First wait before resending after a 5xx, doubled on every further attempt.
+    static constexpr std::chrono::milliseconds kServerErrorBackoff{500};
+    // Time after a failed getMe before Username asks again.
+    static constexpr std::chrono::seconds kUsernameRetry{30};
+
     TelegramCredentials credentials_;
+    // "https://api.telegram.org/bot<token>/", parsed once for all methods.
+    const Poco::URI api_uri_;
+    const MethodTemplate get_me_;
+    const MethodTemplate get_updates_;
+    const MethodTemplate set_webhook_;
+    const MethodTemplate send_message_;
     const NetworkMode mode_;
+    SessionPool session_pool_;
+    const std::chrono::seconds request_timeout_;
+    FloodControl flood_control_;
     std::shared_ptr<logger::Logger> logger_;
+    std::unique_ptr<TraceWriter> trace_;
+    std::mutex username_mutex_;
+    // Set once, then never changed.
+    std::optional<std::string> username_;
+    std::chrono::steady_clock::time_point username_retry_at_;
+    std::string username_error_;
+#if defined(__linux__)
+    // Epoll and IoUring transports. The loop thread is stopped in the destructor, before
+    // the client and the send queues it uses are destroyed.
+    std::unique_ptr<IoThread> reactor_;
+    std::unique_ptr<AsyncHttpClient> http_client_;
+    std::unordered_map<int64_t, std::deque<std::shared_ptr<QueuedSend>>> reactor_sends_;
+    std::mutex reactor_sends_mutex_;
+    std::condition_variable reactor_sends_done_;
+    size_t reactor_sends_pending_{0};
+#endif
+    const OutboxConfig outbox_config_;
+    std::once_flag outbox_started_;
+    // Last, so that its threads finish the queued sends while everything they use is
+    // still alive.
+    std::unique_ptr<KeyedWorkerPool> outbox_;
 };
 
 }  // namespace tg
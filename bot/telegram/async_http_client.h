@@ -0,0 +1,422 @@
+#ifndef ASYNC_HTTP_CLIENT_H
+#define ASYNC_HTTP_CLIENT_H
+
+#include "http_parser.h"
+#include "reactor.h"
+
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+struct AsyncHttpClientConfig {
+    // Requests beyond that wait for a connection to the host to become free.
+    size_t max_connections_per_host{64};
+    // Idle keep-alive connections kept per host, extra ones are closed.
+    size_t max_idle_per_host{64};
+    // Connections that were idle for longer are closed instead of being reused.
+    std::chrono::seconds max_idle_time{30};
+};
+
+struct HttpRequestSpec {
+    std::string host;
+    uint16_t port{80};
+    std::string method;
+    // Path and query.
+    std::string target;
+    std::string content_type;
+    std::string body;
+    // The whole request as sent, e.g. from an HttpRequestTemplate. If empty it is
+    // formatted from the fields above, which then need not be set besides host and port.
+    std::string wire;
+    // From sending the request to the end of the response.
+    std::chrono::milliseconds timeout{60000};
+};
+
+class HttpTransportError : public std::runtime_error {
+public:
+    HttpTransportError(const std::string& message, bool timed_out = false)
+        : std::runtime_error(message), timed_out_{timed_out} {
+    }
+
+    bool TimedOut() const {
+        return timed_out_;
+    }
+
+private:
+    bool timed_out_;
+};
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Plain HTTP/1.1 client on an IoLoop: non-blocking sockets, keep-alive connections
+// per host and a timeout per request, so one thread keeps any number of requests in
+// flight. Host names are resolved once, blocking the loop thread for that lookup.
+class AsyncHttpClient {
+public:
+    // The future holds the response, whatever its status, or HttpTransportError.
+    using Callback = std::function<void(std::future<HttpResponse>)>;
+
+    AsyncHttpClient(IoLoop& loop, const AsyncHttpClientConfig& config = {})
+        : loop_{loop}, config_{config} {
+    }
+
+    AsyncHttpClient(const AsyncHttpClient&) = delete;
+    AsyncHttpClient& operator=(const AsyncHttpClient&) = delete;
+
+    // The loop must not run anymore.
+    ~AsyncHttpClient() {
+        for (auto& [fd, connection] : connections_) {
+            close(fd);
+        }
+    }
+
+    // Safe to call from any thread. done runs on the loop thread and must not block.
+    void Request(HttpRequestSpec request, Callback done) {
+        if (request.wire.empty()) {
+            request.wire = FormatHttpRequest(request.method, request.target, request.host,
+                                             request.content_type, request.body);
+        }
+        auto exchange = std::make_shared<Exchange>();
+        exchange->request = std::move(request);
+        exchange->done = std::move(done);
+        if (loop_.InLoopThread()) {
+            Start(std::move(exchange));
+        } else {
+            loop_.Post([this, exchange] { Start(exchange); });
+        }
+    }
+
+private:
+    using Clock = IoLoop::Clock;
+
+    struct Exchange {
+        HttpRequestSpec request;
+        Callback done;
+        // Already resent once after a reused connection turned out to be closed.
+        bool resent{false};
+    };
+
+    struct Connection {
+        int fd{-1};
+        std::string host_key;
+        sockaddr_storage address;
+        bool connected{false};
+        bool reused{false};
+        // Wire form of the request of the exchange.
+        std::string_view out;
+        size_t written{0};
+        HttpResponseParser parser;
+        std::shared_ptr<Exchange> exchange;
+        IoLoop::TimerId timer{0};
+        Clock::time_point idle_since;
+    };
+
+    struct Host {
+        std::optional<sockaddr_storage> address;
+        socklen_t address_length{0};
+        size_t open{0};
+        std::vector<Connection*> idle;
+        std::deque<std::shared_ptr<Exchange>> waiting;
+    };
+
+    static std::string HostKey(const HttpRequestSpec& request) {
+        return request.host + ":" + std::to_string(request.port);
+    }
+
+    void Start(std::shared_ptr<Exchange> exchange) {
+        auto key = HostKey(exchange->request);
+        auto& host = hosts_[key];
+        auto now = Clock::now();
+        while (!host.idle.empty()) {
+            auto connection = host.idle.back();
+            host.idle.pop_back();
+            if (now - connection->idle_since <= config_.max_idle_time) {
+                Send(connection, std::move(exchange));
+                return;
+            }
+            Close(connection);
+        }
+        if (host.open >= config_.max_connections_per_host) {
+            host.waiting.push_back(std::move(exchange));
+            return;
+        }
+
+        Connection* connection;
+        try {
+            connection = Connect(key, host, exchange->request);
+        } catch (const HttpTransportError&) {
+            Deliver(*exchange, std::current_exception());
+            return;
+        }
+        Send(connection, std::move(exchange));
+    }
+
+    // Completions of the loop never outlive a connection: Close drops them. They find
+    // the connection by descriptor, like the timers do.
+    Connection* Connect(const std::string& key, Host& host, const HttpRequestSpec& request) {
+        if (!host.address) {
+            Resolve(host, request);
+        }
+        auto fd = socket(host.address->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw HttpTransportError(std::string("socket: ") + std::strerror(errno));
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto connection = std::make_unique<Connection>();
+        connection->fd = fd;
+        connection->host_key = key;
+        connection->address = *host.address;
+        auto raw = connection.get();
+        connections_.emplace(fd, std::move(connection));
+        ++host.open;
+        try {
+            loop_.Connect(fd, reinterpret_cast<const sockaddr*>(&raw->address),
+                          host.address_length, [this, fd](int result) {
+                              if (auto connection = Find(fd)) {
+                                  OnConnected(connection, result);
+                              }
+                          });
+        } catch (const std::system_error& error) {
+            connections_.erase(fd);
+            --host.open;
+            close(fd);
+            throw HttpTransportError(error.what());
+        }
+        return raw;
+    }
+
+    static void Resolve(Host& host, const HttpRequestSpec& request) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        auto port = std::to_string(request.port);
+        if (auto error = getaddrinfo(request.host.c_str(), port.c_str(), &hints, &found)) {
+            throw HttpTransportError("can't resolve " + request.host + ": " +
+                                     gai_strerror(error));
+        }
+        // IPv4 first: local servers often listen on it only.
+        auto chosen = found;
+        for (auto entry = found; entry; entry = entry->ai_next) {
+            if (entry->ai_family == AF_INET) {
+                chosen = entry;
+                break;
+            }
+        }
+        host.address.emplace();
+        std::memcpy(&*host.address, chosen->ai_addr, chosen->ai_addrlen);
+        host.address_length = chosen->ai_addrlen;
+        freeaddrinfo(found);
+    }
+
+    Connection* Find(int fd) {
+        auto it = connections_.find(fd);
+        return it == connections_.end() ? nullptr : it->second.get();
+    }
+
+    void OnConnected(Connection* connection, int result) {
+        if (result < 0) {
+            // The address may be stale, resolve again next time.
+            hosts_[connection->host_key].address.reset();
+            Fail(connection, std::string("connect: ") + std::strerror(-result));
+            return;
+        }
+        connection->connected = true;
+        // A receive stays pending for the life of the connection, so a server closing
+        // an idle one is noticed.
+        Receive(connection);
+        Write(connection);
+    }
+
+    void Send(Connection* connection, std::shared_ptr<Exchange> exchange) {
+        const auto& request = exchange->request;
+        connection->out = request.wire;
+        connection->written = 0;
+        connection->parser.Reset();
+        connection->exchange = std::move(exchange);
+        auto fd = connection->fd;
+        connection->timer = loop_.RunAfter(request.timeout, [this, fd] {
+            if (auto connection = Find(fd)) {
+                connection->timer = 0;
+                Fail(connection, "request timed out", true);
+            }
+        });
+        if (connection->connected) {
+            Write(connection);
+        }
+    }
+
+    void Write(Connection* connection) {
+        auto fd = connection->fd;
+        loop_.Send(fd, connection->out.data() + connection->written,
+                   connection->out.size() - connection->written, [this, fd](int result) {
+                       if (auto connection = Find(fd)) {
+                           OnSent(connection, result);
+                       }
+                   });
+    }
+
+    void OnSent(Connection* connection, int result) {
+        if (result < 0) {
+            Fail(connection, std::string("send: ") + std::strerror(-result));
+            return;
+        }
+        connection->written += result;
+        if (connection->written < connection->out.size()) {
+            Write(connection);
+        }
+    }
+
+    void Receive(Connection* connection) {
+        auto fd = connection->fd;
+        loop_.Receive(fd, [this, fd](int result, const char* data) {
+            if (auto connection = Find(fd)) {
+                OnReceived(connection, result, data);
+            }
+        });
+    }
+
+    void OnReceived(Connection* connection, int result, const char* data) {
+        if (result < 0) {
+            Fail(connection, std::string("recv: ") + std::strerror(-result));
+            return;
+        }
+        if (!connection->exchange) {
+            // An idle connection was closed by the server or got unexpected bytes.
+            Close(connection);
+            return;
+        }
+        try {
+            if (result == 0) {
+                connection->parser.Finish();
+                Complete(connection, false);
+                return;
+            }
+            auto used = connection->parser.Feed(std::string_view(data, result));
+            if (connection->parser.Done()) {
+                // Responses are not pipelined, extra bytes mean a broken stream.
+                Complete(connection, used == static_cast<size_t>(result));
+                return;
+            }
+        } catch (const HttpParseError& error) {
+            Fail(connection, error.what());
+            return;
+        }
+        Receive(connection);
+    }
+
+    void Complete(Connection* connection, bool reusable) {
+        loop_.Cancel(connection->timer);
+        auto exchange = std::move(connection->exchange);
+        auto response = std::move(connection->parser.Response());
+        auto& host = hosts_[connection->host_key];
+        if (!reusable || !response.keep_alive) {
+            Close(connection);
+        } else {
+            // Before the callback, which may start requests of its own.
+            Receive(connection);
+            connection->reused = true;
+            if (!host.waiting.empty()) {
+                auto next = std::move(host.waiting.front());
+                host.waiting.pop_front();
+                Send(connection, std::move(next));
+            } else if (host.idle.size() < config_.max_idle_per_host) {
+                connection->idle_since = Clock::now();
+                connection->out = {};
+                host.idle.push_back(connection);
+            } else {
+                Close(connection);
+            }
+        }
+
+        std::promise<HttpResponse> result;
+        result.set_value(std::move(response));
+        CallBack(*exchange, result.get_future());
+    }
+
+    void Fail(Connection* connection, const std::string& message, bool timed_out = false) {
+        loop_.Cancel(connection->timer);
+        auto exchange = std::move(connection->exchange);
+        // A kept-alive connection may have been closed by the server while idle. Nothing
+        // was answered then, so the request is sent once more on a new connection.
+        auto resend = exchange && connection->reused && !timed_out &&
+                      !connection->parser.Started() && !exchange->resent;
+        Close(connection);
+        if (!exchange) {
+            return;
+        }
+        if (resend) {
+            exchange->resent = true;
+            Start(std::move(exchange));
+            return;
+        }
+        Deliver(*exchange,
+                std::make_exception_ptr(HttpTransportError(
+                    exchange->request.method + " " + HostKey(exchange->request) + ": " + message,
+                    timed_out)));
+    }
+
+    void Close(Connection* connection) {
+        auto key = connection->host_key;
+        auto fd = connection->fd;
+        auto& host = hosts_[key];
+        host.idle.erase(std::remove(host.idle.begin(), host.idle.end(), connection),
+                        host.idle.end());
+        --host.open;
+        loop_.Close(fd);
+        connections_.erase(fd);
+
+        // A connection slot is free for a waiting request.
+        if (!host.waiting.empty()) {
+            auto next = std::move(host.waiting.front());
+            host.waiting.pop_front();
+            loop_.Post([this, next] { Start(next); });
+        }
+    }
+
+    void Deliver(Exchange& exchange, std::exception_ptr error) {
+        std::promise<HttpResponse> result;
+        result.set_exception(error);
+        CallBack(exchange, result.get_future());
+    }
+
+    void CallBack(Exchange& exchange, std::future<HttpResponse> result) {
+        // A throwing callback must not take down the loop.
+        try {
+            exchange.done(std::move(result));
+        } catch (...) {
+        }
+    }
+
+private:
+    IoLoop& loop_;
+    const AsyncHttpClientConfig config_;
+    std::unordered_map<std::string, Host> hosts_;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+};
+
+#endif  // __linux__
+
+#endif  // ASYNC_HTTP_CLIENT_H
@@ -3,21 +3,31 @@
 
 #include "api.h"
 #include "config.h"
+#include "keyed_worker_pool.h"
 #include "logger.h"
 #include "message_handlers.h"
+#include "offset_checkpoint.h"
 #include "utils.h"
+#include "webhook_server.h"
 
-#include <fstream>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+
+#include <unistd.h>
 
 class BotServer {
 public:
     BotServer(std::shared_ptr<BotServerConfig> config)
         : config_{config},
-          api_{std::make_shared<tg::TelegramApi>(config->credentials, config->network_mode)},
-          logger_{logger::LoggerFactory::GetStdoutLogger()} {
+          api_{std::make_shared<tg::TelegramApi>(config->credentials, config->network_mode,
+                                                 config->api)},
+          logger_{logger::LoggerFactory::GetDefaultLogger()},
+          checkpoint_{config->path_to_backup_file, config->checkpoint},
+          queued_updates_{checkpoint_.LastUpdateId()} {
+        logger_->SetMinLevel(config->min_level);
         message_handler_factory_ = std::make_shared<MessageHandlerFactory>(api_);
-        LoadOffset();
     }
 
     ~BotServer() {
@@ -28,44 +38,182 @@ public:
 
     void Start() {
         logger_->LogInfo("Starting telegram bot server");
+        if (config_->webhook.enabled) {
+            RunWebhook();
+        } else if (config_->dispatch.pipelined) {
+            RunPipelined();
+        } else {
+            RunSequential();
+        }
+        message_handler_factory_->Drain();
+        api_->FlushOutbox();
+        // The crash is what a recorded trace is replayed for.
+        api_->FlushTrace();
+        LogAndIgnoreCheckpointErrors([&] { checkpoint_.Flush(); });
+        logger_->Flush();
+        if (crash_requested_) {
+            // Like a crash, no destructors run.
+            _exit(-1);
+        }
+    }
+
+    // Makes Start return like /stop does. Safe to call from any thread.
+    void RequestShutdown() {
+        std::lock_guard<std::mutex> guard(shutdown_mutex_);
+        shutdown_ = true;
+        shutdown_requested_.notify_all();
+        queued_updates_.Interrupt();
+    }
+
+    // For adding handlers before Start.
+    MessageHandlerFactory& Handlers() {
+        return *message_handler_factory_;
+    }
+
+private:
+    // Handles every update on the polling thread before fetching the next batch.
+    void RunSequential() {
+        PollLoop(
+            [&](tg::TelegramUpdate& update) {
+                AdvanceOffset(update.update_id);
+                DispatchUpdate(update);
+                return true;
+            },
+            [] {});
+    }
+
+    // Keeps polling while a worker pool runs the handlers, so a slow handler never
+    // delays the next getUpdates. Updates are sharded by chat: one chat's messages are
+    // handled in order, different chats in parallel. The offset moves past an update
+    // only once it and every update before it are handled, so a kill loses none of the
+    // queued ones. Polls from that offset return the queued updates again, they are
+    // skipped; a batch of nothing else waits for its first update to be handled.
+    // Updates queued before a shutdown request are still handled.
+    void RunPipelined() {
+        KeyedWorkerPool pool(config_->dispatch.workers, config_->dispatch.queue_capacity);
+
+        std::optional<int64_t> first_queued_before;
+        auto fresh = false;
+        PollLoop(
+            [&](tg::TelegramUpdate& update) {
+                auto update_id = update.update_id;
+                if (!queued_updates_.Take(update_id)) {
+                    first_queued_before = first_queued_before.value_or(update_id);
+                    return true;
+                }
+                fresh = true;
+                auto chat_id = GetChatId(update);
+                return pool.Submit(chat_id, [this, update = std::move(update)] {
+                    DispatchUpdate(update);
+                    if (auto handled = queued_updates_.Done(update.update_id)) {
+                        AdvanceOffset(handled.value());
+                    }
+                });
+            },
+            [&] {
+                if (!fresh && first_queued_before) {
+                    queued_updates_.WaitUntilHandled(first_queued_before.value());
+                }
+                first_queued_before.reset();
+                fresh = false;
+            });
+
+        pool.Shutdown();
+    }
+
+    // Telegram pushes the updates to an embedded HTTP server, whose threads queue them
+    // for the workers sharded by chat like RunPipelined. A delivery is acknowledged
+    // once queued, so a full queue holds Telegram back instead of losing updates.
+    // Throws if the server can't listen or setWebhook fails.
+    void RunWebhook() {
+        const auto& webhook = config_->webhook;
+        KeyedWorkerPool pool(config_->dispatch.workers, config_->dispatch.queue_capacity);
+
+        WebhookServer server(webhook, [&](tg::TelegramUpdate& update) {
+            auto chat_id = GetChatId(update);
+            return pool.Submit(chat_id, [this, update = std::move(update)] {
+                DispatchUpdate(update);
+            });
+        });
+        server.Start();
+        if (!webhook.url.empty()) {
+            api_->SetWebhook(webhook.url, webhook.secret_token,
+                             webhook.max_connections.value_or(webhook.max_threads),
+                             webhook.allowed_updates);
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(shutdown_mutex_);
+            shutdown_requested_.wait(guard, [this] { return shutdown_.load(); });
+        }
+        server.Stop();
+        pool.Shutdown();
+    }
+
+    static int64_t GetChatId(const tg::TelegramUpdate& update) {
+        if (update.message && update.message->chat) {
+            return update.message->chat->id;
+        }
+        return 0;
+    }
+
+    // Fetches batches until shutdown and passes each update to consume, which
+    // returns false to drop the rest of the batch. end_batch runs after each batch.
+    template <typename Consumer, typename BatchEnd>
+    void PollLoop(Consumer&& consume, BatchEnd&& end_batch) {
+        const auto& polling = config_->polling;
+        auto timeout = polling.idle_timeout;
         while (!shutdown_) {
             LogAndIgnoreTelegramErrors([&]() {
                 auto offset = NextOffset();
 
-                auto updates = api_->GetUpdates(offset);
+                auto updates = api_->GetUpdates(offset, timeout.count(), polling.limit,
+                                                polling.allowed_updates);
+                timeout = NextPollTimeout(updates.size());
 
-                for (const auto& update : updates) {
-                    if (shutdown_) {
+                for (auto& update : updates) {
+                    if (shutdown_ || !consume(update)) {
                         break;
                     }
-
-                    logger_->LogInfo("Handling update_id: " + std::to_string(update.update_id) +
-                                     ", message: " + update.GetMessageTextOrEmpty());
-
-                    HandleUpdate(update);
                 }
+                end_batch();
+                LogAndIgnoreCheckpointErrors([&] { checkpoint_.EndBatch(); });
             });
         }
     }
 
-private:
-    void HandleUpdate(const tg::TelegramUpdate& update) {
-        UpdateAndDumpOffset(update);
+    // A full batch means more updates are likely waiting, so the next poll should
+    // return right away instead of being held by the server.
+    std::chrono::seconds NextPollTimeout(size_t batch_size) const {
+        const auto& polling = config_->polling;
+        auto full_batch = static_cast<size_t>(polling.limit.value_or(kDefaultUpdatesLimit));
+        return batch_size >= full_batch ? polling.backlog_timeout : polling.idle_timeout;
+    }
+
+    void DispatchUpdate(const tg::TelegramUpdate& update) {
+        logger_->LogInfo("Handling update_id: ", update.update_id, ", message: ",
+                         [&] { return update.GetMessageTextOrEmpty(); });
+
         if (!update.message.has_value()) {
             return;
         }
-        auto message = update.message.value();
-        auto handler = message_handler_factory_->GetHandler(message);
+        const auto& message = update.message.value();
+        auto& handler = message_handler_factory_->GetHandler(message);
         try {
-            handler->handle(message);
+            handler.handle(message);
         } catch (handler_exceptions::CrashRequested) {
+            // Start exits once the updates already taken are handled, like for /stop:
+            // their offset is committed or acknowledged, a crash right away would lose
+            // them. The crash request itself counts as handled, so it is not delivered
+            // again after the restart.
             logger_->LogError("Got crash request");
-            exit(-1);
+            crash_requested_ = true;
+            RequestShutdown();
         } catch (handler_exceptions::ShutdownRequested) {
             logger_->LogInfo("Got shutdown request");
-            shutdown_ = true;
+            RequestShutdown();
         } catch (std::exception exception) {
-            logger_->LogError("Unknown exception: " + std::string(exception.what()));
+            logger_->LogError("Unknown exception: ", exception.what());
         } catch (...) {
             logger_->LogError("Unknown exception");
         }
@@ -76,55 +224,46 @@ private:
         try {
             lambda();
         } catch (tg::TelegramApiError err) {
-            logger_->LogError("Telegram api error: " + std::string(err.what()));
+            logger_->LogError("Telegram api error: ", err.what());
         }
     }
 
-    void UpdateAndDumpOffset(const tg::TelegramUpdate& update) {
-        auto old_offset = offset_;
-        if (offset_.has_value()) {
-            offset_ = std::max(offset_.value(), update.update_id);
-        } else {
-            offset_ = update.update_id;
-        }
-        logger_->LogInfo("Saving offset from " + GetString(old_offset) + " to " +
-                         GetString(offset_));
-        DumpOffset();
-    }
-
-    std::optional<int64_t> NextOffset() const {
-        if (offset_.has_value()) {
-            return offset_.value() + 1;
+    template <typename Code>
+    void LogAndIgnoreCheckpointErrors(Code&& lambda) {
+        try {
+            lambda();
+        } catch (const std::system_error& err) {
+            logger_->LogError("Offset checkpoint error: ", err.what());
         }
-        return offset_;
     }
 
-    void DumpOffset() {
-        if (!offset_.has_value()) {
-            return;
-        }
-        std::ofstream out(config_->path_to_backup_file, std::ios::out);
-        out << offset_.value() << std::endl;
-        out.close();
+    void AdvanceOffset(int64_t update_id) {
+        LogAndIgnoreCheckpointErrors([&] { checkpoint_.Advance(update_id); });
     }
 
-    void LoadOffset() {
-        std::ifstream in(config_->path_to_backup_file, std::ios::in);
-        if (!in.is_open()) {
-            return;
+    std::optional<int64_t> NextOffset() const {
+        auto last_update_id = checkpoint_.LastUpdateId();
+        if (last_update_id.has_value()) {
+            return last_update_id.value() + 1;
         }
-        int64_t current;
-        in >> current;
-        offset_ = current;
+        return last_update_id;
     }
 
 private:
+    static constexpr int64_t kDefaultUpdatesLimit = 100;
+
     std::shared_ptr<BotServerConfig> config_;
     std::shared_ptr<tg::TelegramApi> api_;
     std::shared_ptr<MessageHandlerFactory> message_handler_factory_;
     std::shared_ptr<logger::Logger> logger_;
-    std::optional<int64_t> offset_;
-    bool shutdown_{false};
+    OffsetCheckpoint checkpoint_;
+    // Updates RunPipelined has queued for the workers.
+    UpdateTracker queued_updates_;
+    std::atomic<bool> shutdown_{false};
+    std::atomic<bool> crash_requested_{false};
+    // Wakes RunWebhook, the polling loops check shutdown_ between batches.
+    std::mutex shutdown_mutex_;
+    std::condition_variable shutdown_requested_;
 };
 
 #endif  // BOT_MAIN_H
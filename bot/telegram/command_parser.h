@@ -0,0 +1,72 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace tg {
+
+// Separates a command from its arguments.
+inline constexpr std::string_view kCommandSpace = " \t\r\n";
+
+// Byte length of the first units UTF-16 code units of UTF-8 text, which is how
+// Telegram counts entity offsets and lengths. npos if the text is shorter.
+inline size_t Utf16ToBytes(std::string_view text, int64_t units) {
+    size_t pos = 0;
+    while (units > 0) {
+        if (pos == text.size()) {
+            return std::string_view::npos;
+        }
+        auto lead = static_cast<unsigned char>(text[pos]);
+        // Code points beyond the Basic Multilingual Plane take a surrogate pair.
+        units -= lead >= 0xF0 ? 2 : 1;
+        ++pos;
+        while (pos < text.size() && (static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80) {
+            ++pos;
+        }
+    }
+    return pos;
+}
+
+// "/random@our_bot 10" split into views of the text it was parsed from.
+struct BotCommand {
+    // "/random".
+    std::string_view name;
+    // "our_bot", empty if the command is not addressed to a bot.
+    std::string_view bot;
+    // "10", without the whitespace around it.
+    std::string_view arguments;
+};
+
+// Splits text starting with a command of length bytes, e.g. from its bot_command
+// entity. Nullopt if the text doesn't start with '/'.
+inline std::optional<BotCommand> ParseBotCommand(std::string_view text, size_t length) {
+    if (text.empty() || text.front() != '/' || length > text.size()) {
+        return std::nullopt;
+    }
+    BotCommand command;
+    command.name = text.substr(0, length);
+    if (auto at = command.name.find('@'); at != std::string_view::npos) {
+        command.bot = command.name.substr(at + 1);
+        command.name = command.name.substr(0, at);
+    }
+    auto arguments = text.substr(length);
+    auto begin = arguments.find_first_not_of(kCommandSpace);
+    if (begin != std::string_view::npos) {
+        auto end = arguments.find_last_not_of(kCommandSpace) + 1;
+        command.arguments = arguments.substr(begin, end - begin);
+    }
+    return command;
+}
+
+// The same for text without entities: the command is the first word.
+inline std::optional<BotCommand> ParseBotCommand(std::string_view text) {
+    return ParseBotCommand(text, std::min(text.find_first_of(kCommandSpace), text.size()));
+}
+
+}  // namespace tg
+
+#endif  // COMMAND_PARSER_H
@@ -1,16 +1,49 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <chrono>
+#include <optional>
 #include <string>
+#include <vector>
 #include "api.h"
 #include "logger.h"
 #include "network_mode.h"
+#include "offset_checkpoint.h"
+#include "webhook_server.h"
+
+struct PollingConfig {
+    // Long-poll timeout while the bot is idle, zero falls back to short polling.
+    std::chrono::seconds idle_timeout{25};
+    // Timeout right after a full batch, while a backlog is being drained.
+    std::chrono::seconds backlog_timeout{0};
+    // Max updates per getUpdates reply, Telegram defaults to 100.
+    std::optional<int64_t> limit{100};
+    // Update types to receive, empty keeps the previous server-side setting.
+    std::vector<std::string> allowed_updates{"message"};
+};
+
+struct DispatchConfig {
+    // Poll from one thread while workers run the handlers, instead of handling each
+    // batch before fetching the next one. Webhook deliveries always go to the workers.
+    bool pipelined{false};
+    // Updates polled ahead of the handlers, the poller waits once it is full. Polls
+    // start at the oldest unhandled update, so at most a poll limit of updates past it
+    // are queued in any case.
+    size_t queue_capacity{256};
+    // Handler threads. Messages of one chat are always handled in order.
+    size_t workers{8};
+};
 
 struct BotServerConfig {
     tg::TelegramCredentials credentials;
     std::string path_to_backup_file;
     NetworkMode network_mode{NetworkMode::HTTP};
     logger::LogLevel min_level{logger::LogLevel::Info};
+    tg::TelegramApiConfig api;
+    PollingConfig polling;
+    DispatchConfig dispatch;
+    CheckpointConfig checkpoint;
+    WebhookConfig webhook;
 
     BotServerConfig(const tg::TelegramCredentials& creds, const std::string& backup_file_path,
                     NetworkMode mode, logger::LogLevel level = logger::LogLevel::Info)
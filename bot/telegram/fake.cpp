@@ -1,18 +1,37 @@
 #include "fake.h"
 #include "fake_data.h"
-
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <iomanip>
+#include <map>
 #include <mutex>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <thread>
 #include <stdexcept>
 #include <sstream>
+#include <vector>
 
 #include <Poco/URI.h>
 
+#include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/HTTPRequestHandler.h>
 #include <Poco/Net/SocketAddress.h>
+#include <Poco/Net/StreamSocket.h>
 
+#include <Poco/JSON/Array.h>
+#include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
 
 namespace telegram {
@@ -26,6 +45,16 @@ class TestCase {
 public:
     virtual void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) = 0;
 
+    // Time to hold the request before handling it. Other requests are served meanwhile.
+    virtual std::chrono::milliseconds ResponseDelay(HTTPServerRequest&) {
+        return std::chrono::milliseconds(0);
+    }
+
+    // Summary printed after a run, see FakeServer::GetReport.
+    virtual std::string Report() {
+        return {};
+    }
+
     std::mutex Mutex;
 
     std::vector<std::string> Expectations;
@@ -107,6 +136,26 @@ public:
     }
 };
 
+class FailingGetMeTestCase : public TestCase {
+public:
+    FailingGetMeTestCase() {
+        Expectations = {"Client sends getMe request once and receives Internal Server error"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        ExpectURI(request, "/bot123/getMe");
+        ExpectMethod(request, "GET");
+
+        Fulfilled++;
+        if (Fulfilled == 1) {
+            response.setStatus(HTTPResponse::HTTP_INTERNAL_SERVER_ERROR);
+            response.send() << "Internal server error";
+        } else {
+            Fail("Unexpected extra request");
+        }
+    }
+};
+
 class ErrorHandlingTestCase : public TestCase {
 public:
     ErrorHandlingTestCase() {
@@ -131,6 +180,28 @@ public:
     }
 };
 
+class UnexpectedReplyTestCase : public TestCase {
+public:
+    UnexpectedReplyTestCase() {
+        Expectations = {"Client sends getMe request and receives an array",
+                        "Client sends getMe request again and receives an array"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        ExpectURI(request, "/bot123/getMe");
+        ExpectMethod(request, "GET");
+
+        if (++Fulfilled > 2) {
+            Fail("Unexpected extra request");
+        }
+        // Valid JSON, but not the object the reader expects.
+        static const std::string kBody = "[]";
+        response.setStatus(HTTPResponse::HTTP_OK);
+        response.setContentType("application/json");
+        response.sendBuffer(kBody.data(), kBody.size());
+    }
+};
+
 class GetUpdatesAndSendMessagesTestCase : public TestCase {
 public:
     GetUpdatesAndSendMessagesTestCase() {
@@ -247,12 +318,1013 @@ public:
     }
 };
 
+class KeepAliveTestCase : public TestCase {
+public:
+    KeepAliveTestCase() {
+        Expectations = {"Client sends getMe request",
+                        "Client sends second getMe request over the same connection"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        ExpectURI(request, "/bot123/getMe");
+        ExpectMethod(request, "GET");
+
+        ++Fulfilled;
+        if (Fulfilled == 1) {
+            FirstClient = request.clientAddress().toString();
+        } else if (Fulfilled == 2) {
+            if (request.clientAddress().toString() != FirstClient) {
+                Fail("Connection was not reused: " + FirstClient + " then " +
+                     request.clientAddress().toString());
+            }
+        } else {
+            Fail("Unexpected extra request");
+        }
+
+        // Keep-alive needs a known body length, otherwise the server closes the connection.
+        response.setStatus(HTTPResponse::HTTP_OK);
+        response.sendBuffer(FakeData::GetMeJson.data(), FakeData::GetMeJson.size());
+    }
+
+private:
+    std::string FirstClient;
+};
+
+class ResetAfterStatusTestCase : public TestCase {
+public:
+    ResetAfterStatusTestCase() {
+        Expectations = {"Client sends sendMessage request",
+                        "Client sends second sendMessage request over the same connection"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        ExpectURI(request, "/bot123/sendMessage");
+        ExpectMethod(request, "POST");
+
+        ++Fulfilled;
+        const auto& reply = FakeData::SendMessageHiJson;
+        if (Fulfilled == 1) {
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.sendBuffer(reply.data(), reply.size());
+            return;
+        }
+        if (Fulfilled > 2) {
+            Fail("sendMessage was sent again after the reply had started");
+        }
+
+        // The message is sent, but the connection breaks in the middle of the reply.
+        response.setStatus(HTTPResponse::HTTP_OK);
+        response.setContentLength(reply.size());
+        auto& out = response.send();
+        out.write(reply.data(), reply.size() / 2);
+        out.flush();
+        auto& socket = static_cast<HTTPServerRequestImpl&>(request).socket();
+        socket.setLinger(true, 0);
+        socket.close();
+    }
+};
+
+class LongPollingTestCase : public TestCase {
+public:
+    LongPollingTestCase() {
+        Expectations = {"Client long-polls and receives a full batch",
+                        "Client replies to the first message",
+                        "Client replies to the second message",
+                        "Client drains the backlog without waiting",
+                        "Client long-polls again while idle and receives /stop"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        const std::string allowedUpdates = "&limit=2&allowed_updates=%5B%22message%22%5D";
+
+        if (URI(request.getURI()).getPath() == "/bot123/sendMessage") {
+            ExpectMethod(request, "POST");
+            if (++Replies > 2) {
+                Fail("Unexpected extra message");
+            }
+            ++Fulfilled;
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::SendMessageHiJson;
+            return;
+        }
+
+        ExpectMethod(request, "GET");
+        ++Polls;
+        ++Fulfilled;
+        if (Polls == 1) {
+            ExpectURI(request, "/bot123/getUpdates?timeout=1" + allowedUpdates);
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::GetUpdatesTwoMessages;
+        } else if (Polls == 2) {
+            ExpectURI(request, "/bot123/getUpdates?offset=851793508&timeout=0" + allowedUpdates);
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::GetUpdatesZeroMessages;
+        } else if (Polls == 3) {
+            ExpectURI(request, "/bot123/getUpdates?offset=851793508&timeout=1" + allowedUpdates);
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::GetUpdatesStopMessage;
+        } else {
+            Fail("Unexpected extra request");
+        }
+    }
+
+private:
+    int Polls = 0;
+    int Replies = 0;
+};
+
+class PipelinedDispatchTestCase : public TestCase {
+public:
+    PipelinedDispatchTestCase() {
+        Expectations = {"Client receives a batch of two messages",
+                        "Client polls again while a handler is still sending its reply",
+                        "Client replies to the first message",
+                        "Client replies to the second message",
+                        "Client receives /stop after both replies"};
+    }
+
+    std::chrono::milliseconds ResponseDelay(HTTPServerRequest& request) override {
+        // Slow replies keep the handlers busy, held polls avoid a busy loop.
+        if (URI(request.getURI()).getPath() == "/bot123/sendMessage") {
+            return std::chrono::milliseconds(300);
+        }
+        return std::chrono::milliseconds(Polls > 0 ? 50 : 0);
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        if (URI(request.getURI()).getPath() == "/bot123/sendMessage") {
+            ExpectMethod(request, "POST");
+            if (++Replies > 2) {
+                Fail("Unexpected extra message");
+            }
+            ++Fulfilled;
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::SendMessageHiJson;
+            return;
+        }
+
+        ExpectMethod(request, "GET");
+        response.setStatus(HTTPResponse::HTTP_OK);
+        ++Polls;
+        if (Polls == 1) {
+            ++Fulfilled;
+            response.send() << FakeData::GetUpdatesTwoMessages;
+        } else if (Replies == 0 && !PolledAhead) {
+            PolledAhead = true;
+            ++Fulfilled;
+            response.send() << FakeData::GetUpdatesZeroMessages;
+        } else if (Replies == 2 && !StopSent) {
+            StopSent = true;
+            ++Fulfilled;
+            response.send() << FakeData::GetUpdatesStopMessage;
+        } else {
+            response.send() << FakeData::GetUpdatesZeroMessages;
+        }
+    }
+
+private:
+    std::atomic<int> Polls = 0;
+    int Replies = 0;
+    bool PolledAhead = false;
+    bool StopSent = false;
+};
+
+class FloodControlTestCase : public TestCase {
+public:
+    FloodControlTestCase() {
+        Expectations = {"Client without flood control gets 429 and gives up",
+                        "Client with flood control gets 429 and waits retry_after",
+                        "Client retries after 502",
+                        "Client sends the message"};
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        ExpectURI(request, "/bot123/sendMessage");
+        ExpectMethod(request, "POST");
+
+        auto now = std::chrono::steady_clock::now();
+        ++Fulfilled;
+        if (Fulfilled == 1 || Fulfilled == 2) {
+            Rejected = now;
+            response.setStatus(HTTPResponse::HTTP_TOO_MANY_REQUESTS);
+            response.send() << R"({"ok":false,"error_code":429,)"
+                            << R"("description":"Too Many Requests: retry after 1",)"
+                            << R"("parameters":{"retry_after":1}})";
+        } else if (Fulfilled == 3) {
+            if (now - Rejected < std::chrono::milliseconds(900)) {
+                Fail("retry_after was not honored");
+            }
+            response.setStatus(HTTPResponse::HTTP_BAD_GATEWAY);
+            response.send() << "Bad Gateway";
+        } else if (Fulfilled == 4) {
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::SendMessageHiJson;
+        } else {
+            Fail("Unexpected extra request");
+        }
+    }
+
+private:
+    std::chrono::steady_clock::time_point Rejected;
+};
+
+class AsyncSendTestCase : public TestCase {
+public:
+    AsyncSendTestCase() {
+        Expectations = {"Client sends every queued message",
+                        "Client sends to different chats in parallel"};
+    }
+
+    std::chrono::milliseconds ResponseDelay(HTTPServerRequest&) override {
+        // Slow replies make parallel sends overlap.
+        ++InFlight;
+        return std::chrono::milliseconds(50);
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        MaxInFlight = std::max(MaxInFlight, InFlight.load());
+        --InFlight;
+
+        ExpectURI(request, "/bot123/sendMessage");
+        ExpectMethod(request, "POST");
+
+        Poco::JSON::Parser parser;
+        auto message = parser.parse(request.stream()).extract<Poco::JSON::Object::Ptr>();
+        auto chatId = message->getValue<int64_t>("chat_id");
+        auto text = message->getValue<std::string>("text");
+
+        if (text == "fail") {
+            response.setStatus(HTTPResponse::HTTP_BAD_REQUEST);
+            response.send() << R"({"ok":false,"error_code":400,)"
+                            << R"("description":"Bad Request: chat not found"})";
+        } else {
+            // Texts are numbers counting up within a chat.
+            auto number = std::stoi(text);
+            if (number <= LastNumber[chatId]) {
+                Fail("Message " + text + " to chat " + std::to_string(chatId) +
+                     " arrived out of order");
+            }
+            LastNumber[chatId] = number;
+            if (message->has("reply_to_message_id") &&
+                message->getValue<int64_t>("reply_to_message_id") != 2) {
+                Fail("reply_to_message_id field is incorrect");
+            }
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::SendMessageHiJson;
+        }
+
+        if (++Received == kMessages) {
+            Fulfilled = MaxInFlight > 1 ? 2 : 1;
+        } else if (Received > kMessages) {
+            Fail("Unexpected extra request");
+        }
+    }
+
+private:
+    static constexpr int kMessages = 21;
+
+    std::atomic<int> InFlight = 0;
+    int MaxInFlight = 0;
+    int Received = 0;
+    std::map<int64_t, int> LastNumber;
+};
+
+class WebhookTestCase : public TestCase {
+public:
+    WebhookTestCase() {
+        Expectations = {"Client sets the webhook",
+                        "Client rejects a delivery without the secret token",
+                        "Client accepts every delivered update",
+                        "Client replies to the first message",
+                        "Client replies to the second message"};
+    }
+
+    ~WebhookTestCase() {
+        if (Delivery_.joinable()) {
+            Delivery_.join();
+        }
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        auto path = URI(request.getURI()).getPath();
+        if (path == "/bot123/sendMessage") {
+            ExpectMethod(request, "POST");
+            if (++Replies > 2) {
+                Fail("Unexpected extra message");
+            }
+            ++Fulfilled;
+
+            response.setStatus(HTTPResponse::HTTP_OK);
+            response.send() << FakeData::SendMessageHiJson;
+            return;
+        }
+
+        if (Delivery_.joinable()) {
+            Fail("Unexpected extra request");
+        }
+        ExpectURI(request,
+                  "/bot123/setWebhook?url=http://localhost:8081/telegram&secret_token=secret"
+                  "&max_connections=4&allowed_updates=%5B%22message%22%5D");
+        ExpectMethod(request, "GET");
+        ++Fulfilled;
+
+        response.setStatus(HTTPResponse::HTTP_OK);
+        response.send() << R"({"ok":true,"result":true,"description":"Webhook was set"})";
+
+        // Like Telegram, posts the updates from a thread of its own once the webhook is set.
+        Delivery_ = std::thread([this] { Deliver(); });
+    }
+
+private:
+    void Deliver() {
+        auto updates = SplitUpdates(FakeData::GetUpdatesTwoMessages);
+        auto stop = SplitUpdates(FakeData::GetUpdatesStopMessage).front();
+
+        auto rejected = Post(updates.front(), "wrong") == HTTPResponse::HTTP_UNAUTHORIZED;
+        auto accepted = true;
+        for (const auto& update : updates) {
+            accepted = Post(update, "secret") == HTTPResponse::HTTP_OK && accepted;
+        }
+        {
+            // Counted before /stop, the client may be checked as soon as it stops.
+            std::lock_guard<std::mutex> guard(Mutex);
+            Fulfilled += rejected;
+            Fulfilled += accepted;
+        }
+        Post(stop, "secret");
+    }
+
+    // The updates of a getUpdates reply, each as Telegram posts it to a webhook.
+    static std::vector<std::string> SplitUpdates(const std::string& reply) {
+        Poco::JSON::Parser parser;
+        auto result = parser.parse(reply).extract<Poco::JSON::Object::Ptr>()->getArray("result");
+        std::vector<std::string> updates;
+        for (unsigned i = 0; i < result->size(); ++i) {
+            std::ostringstream update;
+            result->getObject(i)->stringify(update);
+            updates.push_back(update.str());
+        }
+        return updates;
+    }
+
+    static HTTPResponse::HTTPStatus Post(const std::string& update, const std::string& secret) {
+        HTTPClientSession session("localhost", 8081);
+        HTTPRequest request(HTTPRequest::HTTP_POST, "/telegram", HTTPMessage::HTTP_1_1);
+        request.setContentType("application/json");
+        request.setContentLength(update.size());
+        request.set("X-Telegram-Bot-Api-Secret-Token", secret);
+        session.sendRequest(request) << update;
+
+        HTTPResponse response;
+        session.receiveResponse(response).ignore(std::numeric_limits<std::streamsize>::max());
+        return response.getStatus();
+    }
+
+    int Replies = 0;
+    std::thread Delivery_;
+};
+
+// Base of the test cases serving a stream of updates rather than a script: matches
+// replies to the updates they answer and reports throughput and reply latency.
+class TrafficTestCase : public TestCase {
+public:
+    std::string Report() override {
+        std::stringstream out;
+        if (!Started_) {
+            out << "No getUpdates requests received" << std::endl;
+            return out.str();
+        }
+
+        auto seconds = std::max(Seconds(Last_ - Start_), 1e-3);
+        out << std::fixed << std::setprecision(1);
+        out << "Served " << Served_ << " updates and received " << Replies_ << " replies in "
+            << seconds << " s" << std::endl;
+        out << "Throughput: " << Served_ / seconds << " updates/s, " << Replies_ / seconds
+            << " replies/s" << std::endl;
+        out << "Unanswered updates: " << Served_ - Replies_
+            << ", unexpected replies: " << UnexpectedReplies_ << std::endl;
+        out << "getUpdates: " << Polls_ << " requests, " << EmptyPolls_ << " empty ("
+            << EmptyPolls_ * 60 / seconds << " per minute)" << std::endl;
+        if (Latencies_.empty()) {
+            return out.str();
+        }
+
+        auto sorted = Latencies_;
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double fraction) {
+            return sorted[static_cast<size_t>(fraction * (sorted.size() - 1))];
+        };
+        out << "Reply latency, ms: p50 " << percentile(0.5) << ", p90 " << percentile(0.9)
+            << ", p99 " << percentile(0.99) << ", max " << sorted.back() << std::endl;
+
+        const std::vector<double> bounds = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+        std::vector<size_t> counts(bounds.size() + 1);
+        for (auto latency : sorted) {
+            counts[std::lower_bound(bounds.begin(), bounds.end(), latency) - bounds.begin()]++;
+        }
+        for (size_t i = 0; i != counts.size(); ++i) {
+            std::stringstream bucket;
+            if (i == bounds.size()) {
+                bucket << "> " << bounds.back();
+            } else {
+                bucket << "<= " << bounds[i];
+            }
+            out << std::setw(10) << bucket.str() << " ms " << std::setw(8) << counts[i] << " "
+                << std::string(counts[i] * 50 / sorted.size(), '#') << std::endl;
+        }
+        return out.str();
+    }
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Poll {
+        std::optional<int64_t> Offset;
+        int64_t Timeout = 0;
+        int64_t Limit = 100;
+    };
+
+    static bool EndsWith(const std::string& value, const std::string& suffix) {
+        return value.size() >= suffix.size() &&
+               value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static double Seconds(Clock::duration duration) {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    static Poll ParsePoll(const URI& uri) {
+        Poll poll;
+        for (const auto& [name, value] : uri.getQueryParameters()) {
+            if (name == "offset") {
+                poll.Offset = std::stoll(value);
+            } else if (name == "timeout") {
+                poll.Timeout = std::stoll(value);
+            } else if (name == "limit") {
+                poll.Limit = std::stoll(value);
+            }
+        }
+        return poll;
+    }
+
+    // The clock of the run starts with the first poll.
+    void StartClock(Clock::time_point now) {
+        if (!Started_) {
+            Started_ = true;
+            Start_ = now;
+        }
+    }
+
+    void UpdateServed(int64_t chatId, Clock::time_point now) {
+        Unanswered_[chatId].push_back(now);
+        ++Served_;
+    }
+
+    void PollServed(int64_t updates, Clock::time_point now) {
+        ++Polls_;
+        if (updates == 0) {
+            ++EmptyPolls_;
+        } else {
+            Last_ = now;
+        }
+    }
+
+    void AcceptReply(HTTPServerRequest& request, Clock::time_point now,
+                     HTTPServerResponse& response) {
+        Poco::JSON::Parser parser;
+        auto message = parser.parse(request.stream()).extract<Poco::JSON::Object::Ptr>();
+        auto chatId = message->getValue<int64_t>("chat_id");
+
+        auto& waiting = Unanswered_[chatId];
+        if (waiting.empty()) {
+            ++UnexpectedReplies_;
+        } else {
+            Latencies_.push_back(
+                std::chrono::duration<double, std::milli>(now - waiting.front()).count());
+            waiting.pop_front();
+            ++Replies_;
+        }
+        Last_ = now;
+
+        auto chat = std::to_string(chatId);
+        Send(response, R"({"ok":true,"result":{"message_id":)" + std::to_string(++SentMessages_) +
+                           R"(,"from":{"id":1234567,"is_bot":true,"first_name":"Test Bot"})" +
+                           R"(,"chat":{"id":)" + chat + R"(,"type":"private"},"date":)" +
+                           std::to_string(std::time(nullptr)) + R"(,"text":"ok"}})");
+    }
+
+    // Keep-alive needs a known body length, otherwise the server closes the connection.
+    static void Send(HTTPServerResponse& response, const std::string& body) {
+        response.setStatus(HTTPResponse::HTTP_OK);
+        response.setContentType("application/json");
+        response.sendBuffer(body.data(), body.size());
+    }
+
+protected:
+    bool Started_ = false;
+    Clock::time_point Start_;
+    // Last update served or reply received.
+    Clock::time_point Last_;
+    int64_t Served_ = 0;
+    int64_t Replies_ = 0;
+
+private:
+    // Serve times of the updates of each chat still waiting for a reply. Replies
+    // within a chat are matched to updates in order.
+    std::map<int64_t, std::deque<Clock::time_point>> Unanswered_;
+    std::vector<double> Latencies_;
+    int64_t UnexpectedReplies_ = 0;
+    int64_t SentMessages_ = 0;
+    int64_t Polls_ = 0;
+    int64_t EmptyPolls_ = 0;
+};
+
+class LoadTestCase : public TrafficTestCase {
+public:
+    LoadTestCase(const LoadConfig& config) : Config_(config) {
+        if (Config_.UpdatesPerSecond <= 0 || Config_.Chats <= 0 || Config_.MaxBatch <= 0) {
+            throw std::invalid_argument("Invalid load config");
+        }
+        if (Config_.Updates > 0) {
+            Expectations = {"Client answers every update and receives /stop"};
+        }
+    }
+
+    // Long polls are held until the next update is due, like the real server does.
+    std::chrono::milliseconds ResponseDelay(HTTPServerRequest& request) override {
+        auto uri = URI(request.getURI());
+        if (!EndsWith(uri.getPath(), "/getUpdates")) {
+            return std::chrono::milliseconds(0);
+        }
+        auto poll = ParsePoll(uri);
+        std::chrono::milliseconds timeout(poll.Timeout * 1000);
+
+        std::lock_guard<std::mutex> guard(Mutex);
+        auto now = Clock::now();
+        Generate(now);
+        if (timeout.count() <= 0 || HasUpdatesFrom(poll.Offset)) {
+            return std::chrono::milliseconds(0);
+        }
+        if (StopGenerated_) {
+            return timeout;
+        }
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(NextArrival() - now);
+        return std::clamp(wait, std::chrono::milliseconds(0), timeout);
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        auto uri = URI(request.getURI());
+        auto now = Clock::now();
+        if (EndsWith(uri.getPath(), "/getUpdates")) {
+            ExpectMethod(request, "GET");
+            ServeUpdates(ParsePoll(uri), now, response);
+        } else if (EndsWith(uri.getPath(), "/sendMessage")) {
+            ExpectMethod(request, "POST");
+            AcceptReply(request, now, response);
+        } else {
+            Fail("Unexpected request " + uri.getPath());
+        }
+        CheckFinished();
+    }
+
+private:
+    static constexpr int64_t FirstChatId = 1000000;
+    static constexpr int64_t StopChatId = 999999;
+
+    struct PendingUpdate {
+        int64_t Id;
+        int64_t ChatId;
+        bool Served = false;
+        bool Stop = false;
+    };
+
+    // Makes available every update due by now.
+    void Generate(Clock::time_point now) {
+        StartClock(now);
+        auto due = static_cast<int64_t>(Seconds(now - Start_) * Config_.UpdatesPerSecond) + 1;
+        if (Config_.Updates > 0) {
+            due = std::min(due, Config_.Updates);
+        }
+        for (; Generated_ < due; ++Generated_) {
+            Pending_.push_back({Generated_ + 1, FirstChatId + Generated_ % Config_.Chats});
+        }
+        if (Config_.Updates > 0 && Generated_ == Config_.Updates && !StopGenerated_) {
+            StopGenerated_ = true;
+            Pending_.push_back({Generated_ + 1, StopChatId, false, true});
+        }
+    }
+
+    Clock::time_point NextArrival() const {
+        return Start_ + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(Generated_ / Config_.UpdatesPerSecond));
+    }
+
+    bool HasUpdatesFrom(std::optional<int64_t> offset) const {
+        return !Pending_.empty() && (!offset || Pending_.back().Id >= *offset);
+    }
+
+    void ServeUpdates(const Poll& poll, Clock::time_point now, HTTPServerResponse& response) {
+        Generate(now);
+        while (poll.Offset && !Pending_.empty() && Pending_.front().Id < *poll.Offset) {
+            Pending_.pop_front();
+        }
+
+        auto limit = std::min<int64_t>(poll.Limit > 0 ? poll.Limit : 100, Config_.MaxBatch);
+        auto date = std::to_string(std::time(nullptr));
+        std::string body = R"({"ok":true,"result":[)";
+        int64_t count = 0;
+        for (auto& update : Pending_) {
+            if (count == limit) {
+                break;
+            }
+            if (count++ != 0) {
+                body += ',';
+            }
+            AppendUpdate(update, date, body);
+
+            if (!update.Served) {
+                update.Served = true;
+                if (update.Stop) {
+                    StopServed_ = true;
+                } else {
+                    UpdateServed(update.ChatId, now);
+                }
+            }
+        }
+        body += "]}";
+
+        PollServed(count, now);
+        Send(response, body);
+    }
+
+    static void AppendUpdate(const PendingUpdate& update, const std::string& date,
+                             std::string& body) {
+        static const char* texts[] = {"/random", "/weather", "/styleguide", "Hello"};
+        auto id = std::to_string(update.Id);
+        auto chat = std::to_string(update.ChatId);
+        body += R"({"update_id":)" + id + R"(,"message":{"message_id":)" + id +
+                R"(,"from":{"id":)" + chat + R"(,"is_bot":false,"first_name":"Load"})" +
+                R"(,"chat":{"id":)" + chat + R"(,"first_name":"Load","type":"private"})" +
+                R"(,"date":)" + date + R"(,"text":")" +
+                (update.Stop ? "/stop" : texts[update.Id % 4]) + R"("}})";
+    }
+
+    void CheckFinished() {
+        if (!Expectations.empty() && Fulfilled == 0 && StopServed_ &&
+            Replies_ == Config_.Updates) {
+            ++Fulfilled;
+        }
+    }
+
+private:
+    const LoadConfig Config_;
+    int64_t Generated_ = 0;
+    bool StopGenerated_ = false;
+    bool StopServed_ = false;
+    std::deque<PendingUpdate> Pending_;
+};
+
+class ReplayTestCase : public TrafficTestCase {
+public:
+    ReplayTestCase(const ReplayConfig& config) : Config_(config) {
+        if (Config_.Speed <= 0) {
+            throw std::invalid_argument("Invalid replay speed");
+        }
+
+        TraceReader reader(Config_.TracePath);
+        std::optional<std::chrono::microseconds> first;
+        while (auto record = reader.Next()) {
+            if (record->kind == TraceRecordKind::SendMessageRequest) {
+                ++RecordedReplies_;
+                continue;
+            }
+            auto batch = ParseBatch(std::move(record->payload));
+            if (!batch) {
+                // Idle polls only shaped the timing, which the batch times keep.
+                continue;
+            }
+            if (!first) {
+                first = record->time;
+            }
+            batch->Due = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double, std::micro>((record->time - *first).count()) /
+                Config_.Speed);
+            Batches_.push_back(std::move(*batch));
+        }
+    }
+
+    // Long polls are held until the next recorded batch is due.
+    std::chrono::milliseconds ResponseDelay(HTTPServerRequest& request) override {
+        auto uri = URI(request.getURI());
+        if (!EndsWith(uri.getPath(), "/getUpdates")) {
+            return std::chrono::milliseconds(0);
+        }
+        auto poll = ParsePoll(uri);
+        std::chrono::milliseconds timeout(poll.Timeout * 1000);
+
+        std::lock_guard<std::mutex> guard(Mutex);
+        auto now = Clock::now();
+        StartClock(now);
+        if (timeout.count() <= 0 || Unacknowledged(poll.Offset)) {
+            return std::chrono::milliseconds(0);
+        }
+        if (NextBatch_ == Batches_.size()) {
+            return timeout;
+        }
+        auto wait =
+            std::chrono::ceil<std::chrono::milliseconds>(Start_ + Batches_[NextBatch_].Due - now);
+        return std::clamp(wait, std::chrono::milliseconds(0), timeout);
+    }
+
+    void HandleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        auto uri = URI(request.getURI());
+        auto now = Clock::now();
+        if (EndsWith(uri.getPath(), "/getUpdates")) {
+            ExpectMethod(request, "GET");
+            ServeBatch(ParsePoll(uri), now, response);
+        } else if (EndsWith(uri.getPath(), "/sendMessage")) {
+            ExpectMethod(request, "POST");
+            AcceptReply(request, now, response);
+        } else {
+            Fail("Unexpected request " + uri.getPath());
+        }
+    }
+
+    std::string Report() override {
+        std::stringstream out;
+        out << TrafficTestCase::Report();
+        out << "Replayed " << NextBatch_ << " of " << Batches_.size() << " recorded batches at "
+            << Config_.Speed << "x, the recording had " << RecordedReplies_ << " replies"
+            << std::endl;
+        return out.str();
+    }
+
+private:
+    struct Batch {
+        std::string Body;
+        // Chats of the message updates, in order.
+        std::vector<int64_t> ChatIds;
+        int64_t LastUpdateId = 0;
+        // Since the start of the replay.
+        Clock::duration Due{0};
+    };
+
+    // Returns nothing for an empty reply.
+    static std::optional<Batch> ParseBatch(std::string body) {
+        Batch batch;
+        Poco::JSON::Parser parser;
+        auto result = parser.parse(body).extract<Poco::JSON::Object::Ptr>()->getArray("result");
+        if (!result || result->size() == 0) {
+            return std::nullopt;
+        }
+        for (size_t i = 0; i != result->size(); ++i) {
+            auto update = result->getObject(i);
+            auto updateId = update->getValue<int64_t>("update_id");
+            batch.LastUpdateId = std::max(batch.LastUpdateId, updateId);
+            if (auto message = update->getObject("message")) {
+                batch.ChatIds.push_back(message->getObject("chat")->getValue<int64_t>("id"));
+            }
+        }
+        batch.Body = std::move(body);
+        return batch;
+    }
+
+    // The last batch served was not acknowledged by the offset of this poll.
+    bool Unacknowledged(std::optional<int64_t> offset) const {
+        return NextBatch_ != 0 && (!offset || *offset <= Batches_[NextBatch_ - 1].LastUpdateId);
+    }
+
+    void ServeBatch(const Poll& poll, Clock::time_point now, HTTPServerResponse& response) {
+        StartClock(now);
+        if (Unacknowledged(poll.Offset)) {
+            PollServed(Batches_[NextBatch_ - 1].ChatIds.size(), now);
+            Send(response, Batches_[NextBatch_ - 1].Body);
+            return;
+        }
+        if (NextBatch_ == Batches_.size() || Start_ + Batches_[NextBatch_].Due > now) {
+            PollServed(0, now);
+            Send(response, R"({"ok":true,"result":[]})");
+            return;
+        }
+
+        const auto& batch = Batches_[NextBatch_++];
+        for (auto chatId : batch.ChatIds) {
+            UpdateServed(chatId, now);
+        }
+        PollServed(batch.ChatIds.size(), now);
+        Send(response, batch.Body);
+    }
+
+private:
+    const ReplayConfig Config_;
+    std::vector<Batch> Batches_;
+    size_t NextBatch_ = 0;
+    int64_t RecordedReplies_ = 0;
+};
+
+// Response that keeps the body in memory, so it can be sent later in another way.
+class BufferedResponse : public HTTPServerResponse {
+public:
+    void sendContinue() override {
+    }
+
+    std::ostream& send() override {
+        Sent_ = true;
+        return Body;
+    }
+
+    void sendFile(const std::string&, const std::string&) override {
+        throw std::logic_error("sendFile is not supported by BufferedResponse");
+    }
+
+    void sendBuffer(const void* buffer, std::size_t length) override {
+        Sent_ = true;
+        setContentLength(length);
+        Body.write(static_cast<const char*>(buffer), length);
+    }
+
+    void redirect(const std::string&, HTTPStatus) override {
+        throw std::logic_error("redirect is not supported by BufferedResponse");
+    }
+
+    void requireAuthentication(const std::string&) override {
+        throw std::logic_error("requireAuthentication is not supported by BufferedResponse");
+    }
+
+    bool sent() const override {
+        return Sent_;
+    }
+
+    std::stringstream Body;
+
+private:
+    bool Sent_ = false;
+};
+
+enum class FaultKind { None, TooManyRequests, ServerError, Reset, Trickle };
+
+struct Fault {
+    FaultKind Kind = FaultKind::None;
+    std::chrono::milliseconds Delay{0};
+};
+
+class FaultInjector {
+public:
+    FaultInjector(const FaultConfig& config) : Config_(config), Random_(config.Seed) {
+    }
+
+    Fault Next(HTTPServerRequest& request) {
+        auto path = URI(request.getURI()).getPath();
+        auto method = path.substr(path.find_last_of('/') + 1);
+        if (!Config_.Methods.empty() &&
+            std::find(Config_.Methods.begin(), Config_.Methods.end(), method) ==
+                Config_.Methods.end()) {
+            return {};
+        }
+
+        std::lock_guard<std::mutex> guard(Mutex_);
+        Fault fault;
+        fault.Delay = NextDelay();
+        TotalDelay_ += fault.Delay;
+
+        if (BurstLeft_ > 0) {
+            --BurstLeft_;
+            fault.Kind = FaultKind::ServerError;
+        } else if (Happens(Config_.ServerErrorRate)) {
+            BurstLeft_ = Config_.ServerErrorBurst - 1;
+            fault.Kind = FaultKind::ServerError;
+        } else if (Happens(Config_.TooManyRequestsRate)) {
+            fault.Kind = FaultKind::TooManyRequests;
+        } else if (Happens(Config_.ResetRate)) {
+            fault.Kind = FaultKind::Reset;
+        } else if (Happens(Config_.TrickleRate)) {
+            fault.Kind = FaultKind::Trickle;
+        }
+        ++Counts_[fault.Kind];
+        return fault;
+    }
+
+    // Answers in place of the test case.
+    void Inject(FaultKind kind, HTTPServerRequest& request, HTTPServerResponse& response) {
+        if (kind == FaultKind::Reset) {
+            // Zero linger makes close() send RST instead of FIN.
+            auto& socket = static_cast<HTTPServerRequestImpl&>(request).socket();
+            socket.setLinger(true, 0);
+            socket.close();
+        } else if (kind == FaultKind::TooManyRequests) {
+            auto retryAfter = std::to_string(Config_.RetryAfter);
+            SendError(response, HTTPResponse::HTTP_TOO_MANY_REQUESTS,
+                      R"({"ok":false,"error_code":429,"description":"Too Many Requests: )"
+                      R"(retry after )" + retryAfter +
+                          R"(","parameters":{"retry_after":)" + retryAfter + "}}");
+        } else if (kind == FaultKind::ServerError) {
+            SendError(response, HTTPResponse::HTTP_BAD_GATEWAY,
+                      R"({"ok":false,"error_code":502,"description":"Bad Gateway"})");
+        }
+    }
+
+    // Sends a buffered response a few bytes at a time.
+    void Trickle(BufferedResponse& buffered, HTTPServerResponse& response) {
+        auto body = buffered.Body.str();
+        response.setStatusAndReason(buffered.getStatus(), buffered.getReason());
+        for (const auto& [name, value] : buffered) {
+            response.set(name, value);
+        }
+        response.setChunkedTransferEncoding(false);
+        response.setContentLength(body.size());
+
+        auto& out = response.send();
+        auto chunk = std::max<size_t>(Config_.TrickleChunk, 1);
+        for (size_t offset = 0; offset < body.size(); offset += chunk) {
+            out.write(body.data() + offset, std::min(chunk, body.size() - offset));
+            out.flush();
+            std::this_thread::sleep_for(Config_.TricklePause);
+        }
+    }
+
+    std::string Report() {
+        std::lock_guard<std::mutex> guard(Mutex_);
+        std::stringstream out;
+        out << "Faults: " << Counts_[FaultKind::TooManyRequests] << " x 429, "
+            << Counts_[FaultKind::ServerError] << " x 502, " << Counts_[FaultKind::Reset]
+            << " resets, " << Counts_[FaultKind::Trickle] << " trickled, "
+            << Counts_[FaultKind::None] << " untouched, " << TotalDelay_.count()
+            << " ms of injected delay" << std::endl;
+        return out.str();
+    }
+
+private:
+    bool Happens(double rate) {
+        return rate > 0 && std::uniform_real_distribution<double>(0, 1)(Random_) < rate;
+    }
+
+    std::chrono::milliseconds NextDelay() {
+        double delay = static_cast<double>(Config_.Delay.count());
+        if (delay <= 0) {
+            return std::chrono::milliseconds(0);
+        }
+        switch (Config_.Distribution) {
+            case DelayDistribution::Fixed:
+                break;
+            case DelayDistribution::Uniform:
+                delay = std::uniform_real_distribution<double>(0, 2 * delay)(Random_);
+                break;
+            case DelayDistribution::Exponential:
+                delay = std::exponential_distribution<double>(1 / delay)(Random_);
+                break;
+            case DelayDistribution::LogNormal:
+                delay =
+                    std::lognormal_distribution<double>(std::log(delay), Config_.Sigma)(Random_);
+                break;
+        }
+        return std::chrono::milliseconds(static_cast<int64_t>(delay));
+    }
+
+    static void SendError(HTTPServerResponse& response, HTTPResponse::HTTPStatus status,
+                          const std::string& body) {
+        response.setStatus(status);
+        response.setContentType("application/json");
+        response.sendBuffer(body.data(), body.size());
+    }
+
+private:
+    const FaultConfig Config_;
+    std::mutex Mutex_;
+    std::mt19937 Random_;
+    int BurstLeft_ = 0;
+    std::map<FaultKind, int64_t> Counts_;
+    std::chrono::milliseconds TotalDelay_{0};
+};
+
 class FakeHandler : public HTTPRequestHandler {
 public:
-    FakeHandler(TestCase* testCase) : TestCase_(testCase) {
+    FakeHandler(TestCase* testCase, FaultInjector* faults) : TestCase_(testCase), Faults_(faults) {
     }
 
     virtual void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override {
+        auto fault = Faults_ ? Faults_->Next(request) : Fault();
+        std::this_thread::sleep_for(TestCase_->ResponseDelay(request) + fault.Delay);
+
+        if (fault.Kind == FaultKind::None) {
+            Handle(request, response);
+        } else if (fault.Kind == FaultKind::Trickle) {
+            // Handled into a buffer so the slow write does not block other requests.
+            BufferedResponse buffered;
+            Handle(request, buffered);
+            Faults_->Trickle(buffered, response);
+        } else {
+            Faults_->Inject(fault.Kind, request, response);
+        }
+    }
+
+private:
+    void Handle(HTTPServerRequest& request, HTTPServerResponse& response) {
         std::unique_lock<std::mutex> guard(TestCase_->Mutex);
         try {
             TestCase_->HandleRequest(request, response);
@@ -267,35 +1339,66 @@ public:
 
 private:
     TestCase* TestCase_;
+    FaultInjector* Faults_;
 };
 
 class FakeHandlerFactory : public HTTPRequestHandlerFactory {
 public:
-    FakeHandlerFactory(TestCase* testCase) : TestCase_(testCase) {
+    FakeHandlerFactory(TestCase* testCase, FaultInjector* faults)
+        : TestCase_(testCase), Faults_(faults) {
     }
 
     virtual HTTPRequestHandler* createRequestHandler(const HTTPServerRequest&) {
-        return new FakeHandler(TestCase_);
+        return new FakeHandler(TestCase_, Faults_);
     }
 
 private:
     TestCase* TestCase_;
+    FaultInjector* Faults_;
 };
 
 FakeServer::FakeServer(const std::string& testCase) {
     if (testCase == "Single getMe") {
         TestCase_.reset(new SingleGetMeTestCase());
+    } else if (testCase == "Failing getMe") {
+        TestCase_.reset(new FailingGetMeTestCase());
+    } else if (testCase == "getMe unexpected reply") {
+        TestCase_.reset(new UnexpectedReplyTestCase());
     } else if (testCase == "getMe error handling") {
         TestCase_.reset(new ErrorHandlingTestCase());
     } else if (testCase == "Single getUpdates and send messages") {
         TestCase_.reset(new GetUpdatesAndSendMessagesTestCase());
     } else if (testCase == "Handle getUpdates offset") {
         TestCase_.reset(new HandleOffsetTestCase());
+    } else if (testCase == "Reuse keep-alive connection") {
+        TestCase_.reset(new KeepAliveTestCase());
+    } else if (testCase == "Reply reset after the status line") {
+        TestCase_.reset(new ResetAfterStatusTestCase());
+    } else if (testCase == "Bot long polling") {
+        TestCase_.reset(new LongPollingTestCase());
+    } else if (testCase == "Bot pipelined dispatch") {
+        TestCase_.reset(new PipelinedDispatchTestCase());
+    } else if (testCase == "Flood control retries rejected messages") {
+        TestCase_.reset(new FloodControlTestCase());
+    } else if (testCase == "Async send messages") {
+        TestCase_.reset(new AsyncSendTestCase());
+    } else if (testCase == "Bot webhook") {
+        TestCase_.reset(new WebhookTestCase());
     } else {
         throw std::runtime_error("Unknown test case name " + testCase);
     }
 }
 
+FakeServer::FakeServer(const LoadConfig& load) : TestCase_(new LoadTestCase(load)) {
+}
+
+FakeServer::FakeServer(const ReplayConfig& replay) : TestCase_(new ReplayTestCase(replay)) {
+}
+
+void FakeServer::InjectFaults(const FaultConfig& faults) {
+    Faults_ = std::make_shared<FaultInjector>(faults);
+}
+
 FakeServer::~FakeServer() {
     Stop();
 }
@@ -303,8 +1406,8 @@ FakeServer::~FakeServer() {
 void FakeServer::Start() {
     Socket_.reset(new ServerSocket(SocketAddress("localhost", 8080)));
 
-    Server_.reset(
-        new HTTPServer(new FakeHandlerFactory(TestCase_.get()), *Socket_, new HTTPServerParams()));
+    Server_.reset(new HTTPServer(new FakeHandlerFactory(TestCase_.get(), Faults_.get()), *Socket_,
+                                 new HTTPServerParams()));
 
     Server_->start();
 }
@@ -328,4 +1431,16 @@ void FakeServer::StopAndCheckExpectations() {
     TestCase_->Check();
 }
 
+std::string FakeServer::GetReport() {
+    std::string report;
+    {
+        std::lock_guard<std::mutex> guard(TestCase_->Mutex);
+        report = TestCase_->Report();
+    }
+    if (Faults_) {
+        report += Faults_->Report();
+    }
+    return report;
+}
+
 }  // namespace telegram
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/ServerSocket.h>
@@ -9,13 +12,84 @@
 namespace telegram {
 
 class TestCase;
+class FaultInjector;
+
+// Synthetic traffic for load-testing a bot instead of running a scripted test case.
+struct LoadConfig {
+    // Rate at which new updates become available to getUpdates.
+    double UpdatesPerSecond = 100;
+    // Updates are spread round-robin over this many private chats.
+    int Chats = 10;
+    // Largest batch served by one getUpdates, the client's limit wins if smaller.
+    int MaxBatch = 100;
+    // Stop after this many updates and send /stop right after the last one, zero
+    // means no end.
+    int64_t Updates = 0;
+};
+
+// Serves the getUpdates replies of a trace recorded by bot-run --record, in their
+// original rhythm or faster, and accepts any sendMessage calls.
+struct ReplayConfig {
+    std::string TracePath;
+    // 2 replays twice as fast as recorded.
+    double Speed = 1;
+};
+
+enum class DelayDistribution {
+    // Always Delay.
+    Fixed,
+    // Uniform between zero and twice Delay.
+    Uniform,
+    // Exponential with mean Delay.
+    Exponential,
+    // Log-normal with median Delay and shape Sigma, a long tail for Sigma around 1.
+    LogNormal
+};
+
+// Misbehaviour of the upstream server, applied on top of a test case. Rates are
+// probabilities per request, the faults are drawn from a seeded generator so runs
+// are repeatable.
+struct FaultConfig {
+    // Methods the faults apply to, e.g. {"getUpdates"}; empty means all of them.
+    std::vector<std::string> Methods;
+
+    // Extra time before a response.
+    DelayDistribution Distribution = DelayDistribution::Fixed;
+    std::chrono::milliseconds Delay{0};
+    double Sigma = 1;
+
+    // 429 Too Many Requests with parameters.retry_after set.
+    double TooManyRequestsRate = 0;
+    int RetryAfter = 1;
+
+    // Start of a run of consecutive 502 Bad Gateway responses.
+    double ServerErrorRate = 0;
+    int ServerErrorBurst = 3;
+
+    // Connection reset instead of a response.
+    double ResetRate = 0;
+
+    // Response body written a few bytes at a time.
+    double TrickleRate = 0;
+    size_t TrickleChunk = 16;
+    std::chrono::milliseconds TricklePause{10};
+
+    unsigned Seed = 1;
+};
 
 class FakeServer {
 public:
     FakeServer(const std::string& testCase);
 
+    FakeServer(const LoadConfig& load);
+
+    FakeServer(const ReplayConfig& replay);
+
     ~FakeServer();
 
+    // Must be called before Start.
+    void InjectFaults(const FaultConfig& faults);
+
     void Start();
 
     std::string GetUrl();
@@ -24,8 +98,14 @@ public:
 
     void StopAndCheckExpectations();
 
+    // Statistics gathered in load and replay mode: throughput, a histogram of the time from an
+    // update being served to the reply to it, and how often the client polled for
+    // nothing, plus the faults injected. Empty for scripted test cases without faults.
+    std::string GetReport();
+
 private:
     std::shared_ptr<TestCase> TestCase_;
+    std::shared_ptr<FaultInjector> Faults_;
     std::unique_ptr<Poco::Net::ServerSocket> Socket_;
     std::unique_ptr<Poco::Net::HTTPServer> Server_;
 };
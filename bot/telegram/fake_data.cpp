@@ -298,3 +298,37 @@ std::string FakeData::GetupdatesOneMessage = R"(
    ],
    "ok" : true
 })" + 1;
+
+std::string FakeData::GetUpdatesStopMessage = R"(
+{
+   "result" : [
+      {
+         "message" : {
+            "date" : 1510520123,
+            "text" : "/stop",
+            "chat" : {
+               "type" : "private",
+               "username" : "darth_slon",
+               "first_name" : "Fedor",
+               "id" : 104519755
+            },
+            "from" : {
+               "is_bot" : false,
+               "username" : "darth_slon",
+               "id" : 104519755,
+               "first_name" : "Fedor"
+            },
+            "message_id" : 12,
+            "entities" : [
+               {
+                  "offset" : 0,
+                  "length" : 5,
+                  "type" : "bot_command"
+               }
+            ]
+         },
+         "update_id" : 851793508
+      }
+   ],
+   "ok" : true
+})" + 1;
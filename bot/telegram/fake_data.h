@@ -14,4 +14,6 @@ struct FakeData {
     static std::string GetUpdatesTwoMessages;
     static std::string GetUpdatesZeroMessages;
     static std::string GetupdatesOneMessage;
+
+    static std::string GetUpdatesStopMessage;
 };
\ No newline at end of file
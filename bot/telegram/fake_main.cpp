@@ -1,10 +1,153 @@
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 #include <telegram/fake.h>
 
+namespace {
+
+void Usage(const char* program) {
+    std::cerr << "usage: " << program << " <test-case>" << std::endl;
+    std::cerr << "       " << program
+              << " load [--rate=<updates/s>] [--chats=<n>] [--batch=<n>] [--updates=<n>]"
+              << std::endl;
+    std::cerr << "            [--delay=<ms>] [--delay-dist=fixed|uniform|exp|lognormal]"
+              << " [--sigma=<x>]" << std::endl;
+    std::cerr << "            [--429-rate=<p>] [--retry-after=<s>] [--5xx-rate=<p>]"
+              << " [--5xx-burst=<n>]" << std::endl;
+    std::cerr << "            [--reset-rate=<p>] [--trickle-rate=<p>]"
+              << " [--fault-methods=<method,...>] [--seed=<n>]" << std::endl;
+    std::cerr << "       " << program << " replay <trace> [--speed=<x>]" << std::endl;
+}
+
+bool ParseDistribution(const std::string& name, telegram::DelayDistribution* distribution) {
+    if (name == "fixed") {
+        *distribution = telegram::DelayDistribution::Fixed;
+    } else if (name == "uniform") {
+        *distribution = telegram::DelayDistribution::Uniform;
+    } else if (name == "exp") {
+        *distribution = telegram::DelayDistribution::Exponential;
+    } else if (name == "lognormal") {
+        *distribution = telegram::DelayDistribution::LogNormal;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ParseFault(const std::string& name, const std::string& value,
+                telegram::FaultConfig* faults) {
+    if (name == "--delay") {
+        faults->Delay = std::chrono::milliseconds(std::atoll(value.c_str()));
+    } else if (name == "--delay-dist") {
+        return ParseDistribution(value, &faults->Distribution);
+    } else if (name == "--sigma") {
+        faults->Sigma = std::atof(value.c_str());
+    } else if (name == "--429-rate") {
+        faults->TooManyRequestsRate = std::atof(value.c_str());
+    } else if (name == "--retry-after") {
+        faults->RetryAfter = std::atoi(value.c_str());
+    } else if (name == "--5xx-rate") {
+        faults->ServerErrorRate = std::atof(value.c_str());
+    } else if (name == "--5xx-burst") {
+        faults->ServerErrorBurst = std::atoi(value.c_str());
+    } else if (name == "--reset-rate") {
+        faults->ResetRate = std::atof(value.c_str());
+    } else if (name == "--trickle-rate") {
+        faults->TrickleRate = std::atof(value.c_str());
+    } else if (name == "--fault-methods") {
+        std::stringstream methods(value);
+        for (std::string method; std::getline(methods, method, ',');) {
+            faults->Methods.push_back(method);
+        }
+    } else if (name == "--seed") {
+        faults->Seed = std::atoi(value.c_str());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool ParseLoadConfig(int argc, char* argv[], telegram::LoadConfig* load,
+                     telegram::FaultConfig* faults, bool* hasFaults) {
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (eq == std::string::npos) {
+            return false;
+        }
+        auto name = arg.substr(0, eq);
+        auto value = arg.substr(eq + 1);
+        if (name == "--rate") {
+            load->UpdatesPerSecond = std::atof(value.c_str());
+        } else if (name == "--chats") {
+            load->Chats = std::atoi(value.c_str());
+        } else if (name == "--batch") {
+            load->MaxBatch = std::atoi(value.c_str());
+        } else if (name == "--updates") {
+            load->Updates = std::atoll(value.c_str());
+        } else if (!ParseFault(name, value, faults)) {
+            return false;
+        } else {
+            *hasFaults = true;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
+    if (argc >= 2 && std::string(argv[1]) == "load") {
+        telegram::LoadConfig load;
+        telegram::FaultConfig faults;
+        bool hasFaults = false;
+        if (!ParseLoadConfig(argc, argv, &load, &faults, &hasFaults)) {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        telegram::FakeServer fake(load);
+        if (hasFaults) {
+            fake.InjectFaults(faults);
+        }
+        fake.Start();
+
+        std::cout << "Fake server is serving " << load.UpdatesPerSecond << " updates/s at "
+                  << fake.GetUrl() << ", press Enter to stop" << std::endl;
+        std::cin.get();
+
+        fake.Stop();
+        std::cout << fake.GetReport();
+        return 0;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "replay") {
+        telegram::ReplayConfig replay;
+        replay.TracePath = argv[2];
+        const std::string speedFlag = "--speed=";
+        if (argc == 4 && std::string(argv[3]).rfind(speedFlag, 0) == 0) {
+            replay.Speed = std::atof(argv[3] + speedFlag.size());
+        } else if (argc != 3) {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        telegram::FakeServer fake(replay);
+        fake.Start();
+
+        std::cout << "Fake server is replaying " << replay.TracePath << " at " << fake.GetUrl()
+                  << ", press Enter to stop" << std::endl;
+        std::cin.get();
+
+        fake.Stop();
+        std::cout << fake.GetReport();
+        return 0;
+    }
+
     if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " <test-case>" << std::endl;
+        Usage(argv[0]);
         return 1;
     }
 
@@ -0,0 +1,143 @@
+#ifndef FLOOD_CONTROL_H
+#define FLOOD_CONTROL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct FloodControlConfig {
+    // Pace sendMessage calls and retry the ones rejected with 429 or a 5xx.
+    bool enabled{false};
+    // Telegram's limits: about 30 messages per second overall, one per second in a
+    // private chat and 20 per minute in a group.
+    double global_per_second{30};
+    double chat_per_second{1};
+    double group_per_minute{20};
+    // Sends of one message before its error is given up and thrown.
+    int max_attempts{5};
+};
+
+// Rate limiter in its virtual scheduling form (GCRA): instead of a token count it
+// keeps the time the next token becomes free, so a caller that finds it empty knows
+// exactly how long to wait. Not thread-safe.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate_per_second, double burst = 1)
+        : interval_{std::chrono::duration_cast<Clock::duration>(
+              std::chrono::duration<double>(1 / rate_per_second))},
+          tolerance_{std::chrono::duration_cast<Clock::duration>(interval_ * (burst - 1))} {
+    }
+
+    // Earliest time a token can be taken.
+    Clock::time_point Earliest(Clock::time_point now) const {
+        return std::max(now, next_free_ - tolerance_);
+    }
+
+    // Takes a token at time at, which must not be before Earliest.
+    void Take(Clock::time_point at) {
+        next_free_ = std::max(next_free_, at) + interval_;
+    }
+
+    // No tokens until the given time.
+    void PauseUntil(Clock::time_point until) {
+        next_free_ = std::max(next_free_, until + tolerance_);
+    }
+
+    // The bucket is full again, forgetting it changes nothing.
+    bool Idle(Clock::time_point now) const {
+        return next_free_ <= now;
+    }
+
+private:
+    const Clock::duration interval_;
+    const Clock::duration tolerance_;
+    Clock::time_point next_free_{};
+};
+
+// Paces outgoing messages under the global and per-chat limits. Safe to use from
+// several threads.
+class FloodControl {
+public:
+    using Clock = TokenBucket::Clock;
+
+    explicit FloodControl(const FloodControlConfig& config)
+        : config_{config}, global_{config.global_per_second} {
+    }
+
+    bool Enabled() const {
+        return config_.enabled;
+    }
+
+    int MaxAttempts() const {
+        return config_.enabled ? std::max(config_.max_attempts, 1) : 1;
+    }
+
+    // Blocks until a message may be sent to chat_id.
+    void Acquire(int64_t chat_id) {
+        if (!config_.enabled) {
+            return;
+        }
+        while (true) {
+            auto now = Clock::now();
+            auto at = TryTake(chat_id, now);
+            if (at <= now) {
+                return;
+            }
+            std::this_thread::sleep_until(at);
+        }
+    }
+
+    // Takes a slot for chat_id if both limits allow a message at now and returns now,
+    // otherwise returns the time to try again. Slots are never booked ahead: a waiting
+    // chat must not hold up the global limit for the others.
+    Clock::time_point TryTake(int64_t chat_id, Clock::time_point now) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto& chat = ChatBucket(chat_id, now);
+        auto at = std::max(global_.Earliest(now), chat.Earliest(now));
+        if (at <= now) {
+            global_.Take(now);
+            chat.Take(now);
+        }
+        return at;
+    }
+
+    // The server asked to wait before sending to chat_id again.
+    void Backoff(int64_t chat_id, Clock::duration delay) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> guard(mutex_);
+        ChatBucket(chat_id, now).PauseUntil(now + delay);
+    }
+
+private:
+    // Chats beyond which buckets of idle chats are dropped.
+    static constexpr size_t kMaxIdleChats = 4096;
+
+    TokenBucket& ChatBucket(int64_t chat_id, Clock::time_point now) {
+        auto it = chats_.find(chat_id);
+        if (it != chats_.end()) {
+            return it->second;
+        }
+        if (chats_.size() >= kMaxIdleChats) {
+            for (auto chat = chats_.begin(); chat != chats_.end();) {
+                chat = chat->second.Idle(now) ? chats_.erase(chat) : std::next(chat);
+            }
+        }
+        // Negative ids are groups, supergroups and channels.
+        auto rate = chat_id < 0 ? config_.group_per_minute / 60 : config_.chat_per_second;
+        return chats_.emplace(chat_id, TokenBucket(rate)).first->second;
+    }
+
+private:
+    const FloodControlConfig config_;
+    std::mutex mutex_;
+    TokenBucket global_;
+    std::unordered_map<int64_t, TokenBucket> chats_;
+};
+
+#endif  // FLOOD_CONTROL_H
@@ -0,0 +1,393 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HTTP/1.1 client side without any I/O: requests are formatted into a buffer and
+// responses are parsed from whatever bytes have arrived so far. Used by the
+// non-blocking transports, which own the sockets.
+
+struct HttpResponse {
+    int status{0};
+    std::string reason;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // False if the server closes the connection after this response.
+    bool keep_alive{true};
+
+    // Value of the first header with the name, compared case-insensitively, or "".
+    const std::string& Header(std::string_view name) const {
+        static const std::string kNone;
+        for (const auto& [key, value] : headers) {
+            if (EqualsIgnoreCase(key, name)) {
+                return value;
+            }
+        }
+        return kNone;
+    }
+};
+
+class HttpParseError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Appends name=value to a query string, after a '&' unless it is the first parameter.
+// The value is percent-encoded except for the characters RFC 3986 leaves unreserved.
+inline void AppendQueryParameter(std::string& query, std::string_view name,
+                                 std::string_view value) {
+    static constexpr char kHex[] = "0123456789ABCDEF";
+    if (!query.empty()) {
+        query += '&';
+    }
+    query.append(name).append(1, '=');
+    for (auto c : value) {
+        auto byte = static_cast<unsigned char>(c);
+        if ((byte >= 'A' && byte <= 'Z') || (byte >= 'a' && byte <= 'z') ||
+            (byte >= '0' && byte <= '9') || byte == '-' || byte == '.' || byte == '_' ||
+            byte == '~') {
+            query += c;
+        } else {
+            query += '%';
+            query += kHex[byte >> 4];
+            query += kHex[byte & 0xF];
+        }
+    }
+}
+
+// Requests to one path that differ only in query string and body, e.g. the calls of
+// one Bot API method. The request line up to the query and the headers are serialized
+// once, Format splices in the rest with a single allocation and gives what
+// FormatHttpRequest would.
+class HttpRequestTemplate {
+public:
+    HttpRequestTemplate(std::string_view method, std::string_view path, std::string_view host,
+                        std::string_view content_type = {})
+        : method_{method},
+          path_{path},
+          content_type_{content_type},
+          content_length_{method == "POST"} {
+        start_.append(method).append(" ").append(path);
+        headers_.append(" HTTP/1.1\r\nHost: ").append(host).append("\r\n");
+        if (!content_type.empty()) {
+            headers_.append("Content-Type: ").append(content_type).append("\r\n");
+        }
+    }
+
+    const std::string& Method() const {
+        return method_;
+    }
+
+    const std::string& Path() const {
+        return path_;
+    }
+
+    const std::string& ContentType() const {
+        return content_type_;
+    }
+
+    // Path, with the query if there is one.
+    std::string Target(std::string_view query) const {
+        std::string target;
+        target.reserve(path_.size() + 1 + query.size());
+        target.append(path_);
+        if (!query.empty()) {
+            target.append(1, '?').append(query);
+        }
+        return target;
+    }
+
+    std::string Format(std::string_view query, std::string_view body) const {
+        static constexpr std::string_view kContentLength = "Content-Length: ";
+        static constexpr size_t kMaxLengthDigits = 20;
+        std::string request;
+        request.reserve(start_.size() + 1 + query.size() + headers_.size() +
+                        kContentLength.size() + kMaxLengthDigits + 4 + body.size());
+        request.append(start_);
+        if (!query.empty()) {
+            request.append(1, '?').append(query);
+        }
+        request.append(headers_);
+        if (!body.empty() || content_length_) {
+            char digits[kMaxLengthDigits];
+            auto end = std::to_chars(digits, digits + sizeof(digits), body.size()).ptr;
+            request.append(kContentLength).append(digits, end).append("\r\n");
+        }
+        request.append("\r\n").append(body);
+        return request;
+    }
+
+private:
+    std::string method_;
+    std::string path_;
+    std::string content_type_;
+    // "POST /bot123/sendMessage", the query goes right after it.
+    std::string start_;
+    // " HTTP/1.1\r\nHost: ...\r\n" and Content-Type.
+    std::string headers_;
+    bool content_length_;
+};
+
+// Request line, headers and body of a request with a keep-alive connection.
+inline std::string FormatHttpRequest(std::string_view method, std::string_view target,
+                                     std::string_view host, std::string_view content_type,
+                                     std::string_view body) {
+    std::string request;
+    request.reserve(128 + target.size() + body.size());
+    request.append(method).append(" ").append(target).append(" HTTP/1.1\r\nHost: ");
+    request.append(host).append("\r\n");
+    if (!content_type.empty()) {
+        request.append("Content-Type: ").append(content_type).append("\r\n");
+    }
+    if (!body.empty() || method == "POST") {
+        request.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+    }
+    request.append("\r\n").append(body);
+    return request;
+}
+
+// Parses one response at a time: feed it bytes until Done(), take the Response()
+// and Reset() it for the next one on the same connection.
+class HttpResponseParser {
+public:
+    // Uses the bytes it needs and returns how many. Bytes left over belong to
+    // whatever follows the response. Throws HttpParseError.
+    size_t Feed(std::string_view data) {
+        size_t pos = 0;
+        started_ = started_ || !data.empty();
+        while (pos < data.size() && state_ != State::Done) {
+            switch (state_) {
+                case State::StatusLine:
+                    if (ReadLine(data, pos)) {
+                        ParseStatusLine();
+                        state_ = State::Headers;
+                    }
+                    break;
+                case State::Headers:
+                    if (ReadLine(data, pos)) {
+                        if (line_.empty()) {
+                            StartBody();
+                        } else {
+                            ParseHeader();
+                        }
+                    }
+                    break;
+                case State::Body:
+                case State::ChunkData:
+                case State::UntilClose: {
+                    auto size = state_ == State::UntilClose
+                                    ? data.size() - pos
+                                    : std::min<size_t>(remaining_, data.size() - pos);
+                    response_.body.append(data.substr(pos, size));
+                    pos += size;
+                    remaining_ -= state_ == State::UntilClose ? 0 : size;
+                    if (state_ != State::UntilClose && remaining_ == 0) {
+                        state_ = state_ == State::Body ? State::Done : State::ChunkDataEnd;
+                    }
+                    break;
+                }
+                case State::ChunkSize:
+                    if (ReadLine(data, pos)) {
+                        remaining_ = ParseChunkSize();
+                        state_ = remaining_ == 0 ? State::Trailers : State::ChunkData;
+                    }
+                    break;
+                case State::ChunkDataEnd:
+                    if (ReadLine(data, pos)) {
+                        if (!line_.empty()) {
+                            throw HttpParseError("missing CRLF after chunk");
+                        }
+                        state_ = State::ChunkSize;
+                    }
+                    break;
+                case State::Trailers:
+                    if (ReadLine(data, pos) && line_.empty()) {
+                        state_ = State::Done;
+                    }
+                    break;
+                case State::Done:
+                    break;
+            }
+        }
+        return pos;
+    }
+
+    // The server closed the connection. Completes a body that runs until the close,
+    // throws HttpParseError if the response is cut short.
+    void Finish() {
+        if (state_ == State::UntilClose) {
+            state_ = State::Done;
+        }
+        if (state_ != State::Done) {
+            throw HttpParseError("connection closed before the response was complete");
+        }
+    }
+
+    bool Done() const {
+        return state_ == State::Done;
+    }
+
+    // Any byte of a response arrived since the last Reset.
+    bool Started() const {
+        return started_;
+    }
+
+    HttpResponse& Response() {
+        return response_;
+    }
+
+    void Reset() {
+        state_ = State::StatusLine;
+        line_.clear();
+        line_complete_ = false;
+        remaining_ = 0;
+        started_ = false;
+        response_ = HttpResponse();
+    }
+
+private:
+    enum class State {
+        StatusLine,
+        Headers,
+        Body,
+        ChunkSize,
+        ChunkData,
+        ChunkDataEnd,
+        Trailers,
+        UntilClose,
+        Done
+    };
+
+    // Longest status, header or chunk size line accepted.
+    static constexpr size_t kMaxLine = 16 * 1024;
+
+    // Collects a line across calls, true once it is complete. The line is in line_
+    // without its CRLF.
+    bool ReadLine(std::string_view data, size_t& pos) {
+        if (line_complete_) {
+            line_.clear();
+            line_complete_ = false;
+        }
+        auto end = data.find('\n', pos);
+        auto size = (end == std::string_view::npos ? data.size() : end) - pos;
+        if (line_.size() + size > kMaxLine) {
+            throw HttpParseError("line too long");
+        }
+        line_.append(data.substr(pos, size));
+        if (end == std::string_view::npos) {
+            pos = data.size();
+            return false;
+        }
+        pos = end + 1;
+        if (!line_.empty() && line_.back() == '\r') {
+            line_.pop_back();
+        }
+        line_complete_ = true;
+        return true;
+    }
+
+    void ParseStatusLine() {
+        // HTTP/1.1 200 OK
+        if (line_.compare(0, 5, "HTTP/") != 0 || line_.size() < 12 || line_[8] != ' ') {
+            throw HttpParseError("malformed status line: " + line_);
+        }
+        int status = 0;
+        for (size_t i = 9; i < 12; ++i) {
+            if (!std::isdigit(static_cast<unsigned char>(line_[i]))) {
+                throw HttpParseError("malformed status line: " + line_);
+            }
+            status = status * 10 + (line_[i] - '0');
+        }
+        response_.status = status;
+        response_.reason = line_.size() > 13 ? line_.substr(13) : "";
+        response_.keep_alive = line_.compare(5, 3, "1.0") != 0;
+    }
+
+    void ParseHeader() {
+        auto colon = line_.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            throw HttpParseError("malformed header: " + line_);
+        }
+        auto value_begin = line_.find_first_not_of(" \t", colon + 1);
+        auto value_end = line_.find_last_not_of(" \t");
+        auto value = value_begin == std::string::npos
+                         ? std::string()
+                         : line_.substr(value_begin, value_end - value_begin + 1);
+        response_.headers.emplace_back(line_.substr(0, colon), std::move(value));
+    }
+
+    void StartBody() {
+        // 1xx are interim responses, the real one follows.
+        if (response_.status / 100 == 1) {
+            response_.headers.clear();
+            state_ = State::StatusLine;
+            return;
+        }
+        const auto& connection = response_.Header("Connection");
+        if (EqualsIgnoreCase(connection, "close")) {
+            response_.keep_alive = false;
+        } else if (EqualsIgnoreCase(connection, "keep-alive")) {
+            response_.keep_alive = true;
+        }
+
+        if (response_.status == 204 || response_.status == 304) {
+            state_ = State::Done;
+        } else if (EqualsIgnoreCase(response_.Header("Transfer-Encoding"),
+                                                  "chunked")) {
+            state_ = State::ChunkSize;
+        } else if (const auto& length = response_.Header("Content-Length"); !length.empty()) {
+            remaining_ = ParseNumber(length, 10);
+            state_ = remaining_ == 0 ? State::Done : State::Body;
+        } else {
+            response_.keep_alive = false;
+            state_ = State::UntilClose;
+        }
+    }
+
+    size_t ParseChunkSize() const {
+        // Chunk extensions after ';' are ignored.
+        return ParseNumber(std::string_view(line_).substr(0, line_.find(';')), 16);
+    }
+
+    static size_t ParseNumber(std::string_view text, int base) {
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+            text.remove_suffix(1);
+        }
+        if (text.empty() || text.size() > 15) {
+            throw HttpParseError("malformed length: " + std::string(text));
+        }
+        size_t value = 0;
+        for (char c : text) {
+            int digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (base == 16 && std::isxdigit(static_cast<unsigned char>(c))) {
+                digit = std::tolower(static_cast<unsigned char>(c)) - 'a' + 10;
+            } else {
+                throw HttpParseError("malformed length: " + std::string(text));
+            }
+            value = value * base + digit;
+        }
+        return value;
+    }
+
+private:
+    State state_{State::StatusLine};
+    std::string line_;
+    bool line_complete_{false};
+    size_t remaining_{0};
+    bool started_{false};
+    HttpResponse response_;
+};
+
+#endif  // HTTP_PARSER_H
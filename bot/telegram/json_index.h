@@ -0,0 +1,307 @@
+#ifndef JSON_INDEX_H
+#define JSON_INDEX_H
+
+#include "json_reader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace json {
+
+// Read-only stream buffer over memory owned elsewhere, to run a JsonReader over a
+// part of a buffer without copying it.
+class ViewBuffer : public std::streambuf {
+public:
+    explicit ViewBuffer(std::string_view text) {
+        auto begin = const_cast<char *>(text.data());
+        setg(begin, begin, begin + text.size());
+    }
+};
+
+namespace detail {
+
+inline size_t SkipSpace(std::string_view text, size_t pos) {
+    while (pos < text.size() &&
+           (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t')) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Position of the next quote or backslash at or after pos, the size of text if none.
+inline size_t NextQuoteOrBackslash(std::string_view text, size_t pos) {
+#if defined(__SSE2__)
+    const auto quote = _mm_set1_epi8('"');
+    const auto backslash = _mm_set1_epi8('\\');
+    for (; pos + 16 <= text.size(); pos += 16) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + pos));
+        auto mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (pos < text.size() && text[pos] != '"' && text[pos] != '\\') {
+        ++pos;
+    }
+    return pos;
+}
+
+// End of the string literal whose opening quote is at pos.
+inline size_t SkipString(std::string_view text, size_t pos) {
+    ++pos;
+    while ((pos = NextQuoteOrBackslash(text, pos)) < text.size()) {
+        if (text[pos] == '"') {
+            return pos + 1;
+        }
+        // The escaped character can't end the string.
+        pos += 2;
+    }
+    throw ParseError("unterminated string");
+}
+
+// Position of the next quote or bracket at or after pos, the size of text if none.
+// Indexing a document spends its time here.
+inline size_t NextStructural(std::string_view text, size_t pos) {
+#if defined(__SSE2__)
+    const auto quote = _mm_set1_epi8('"');
+    // Setting bit 0x20 turns '[' and ']' into '{' and '}'.
+    const auto fold = _mm_set1_epi8(0x20);
+    const auto open = _mm_set1_epi8('{');
+    const auto close = _mm_set1_epi8('}');
+    for (; pos + 16 <= text.size(); pos += 16) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + pos));
+        auto folded = _mm_or_si128(chunk, fold);
+        auto brackets = _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close));
+        auto mask = _mm_movemask_epi8(_mm_or_si128(brackets, _mm_cmpeq_epi8(chunk, quote)));
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (pos < text.size() && text[pos] != '"' && (text[pos] | 0x20) != '{' &&
+           (text[pos] | 0x20) != '}') {
+        ++pos;
+    }
+    return pos;
+}
+
+}  // namespace detail
+
+// A JSON document kept whole in memory with a structural index: one pass over the
+// text finds where each object and array ends, without decoding anything. Readers
+// then step over a nested value with a lookup instead of scanning it, so indexing
+// an object costs in the number of its members rather than in its size. The values
+// are not validated beyond their brackets, that is left to whoever reads them.
+class JsonDocument {
+public:
+    // Throws ParseError if a string or container is cut off.
+    explicit JsonDocument(std::string text) : text_{std::move(text)} {
+        // About one container in every few dozen bytes of a Bot API reply.
+        containers_.reserve(text_.size() / 32 + 1);
+        std::vector<size_t> open;
+        open.reserve(16);
+        size_t pos = 0;
+        while ((pos = detail::NextStructural(text_, pos)) < text_.size()) {
+            auto c = text_[pos];
+            if (c == '"') {
+                pos = detail::SkipString(text_, pos);
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                open.push_back(containers_.size());
+                containers_.push_back({pos, 0});
+            } else {
+                if (open.empty()) {
+                    throw ParseError(std::string("unexpected '") + c + "'");
+                }
+                containers_[open.back()].end = pos + 1;
+                open.pop_back();
+            }
+            ++pos;
+        }
+        if (!open.empty()) {
+            throw ParseError("unexpected end of input");
+        }
+    }
+
+    JsonDocument(const JsonDocument &) = delete;
+    JsonDocument &operator=(const JsonDocument &) = delete;
+
+    std::string_view Text() const {
+        return text_;
+    }
+
+    // End of the value starting at or after pos.
+    size_t ValueEnd(size_t pos) const {
+        pos = detail::SkipSpace(text_, pos);
+        if (pos == text_.size()) {
+            throw ParseError("unexpected end of input");
+        }
+        auto c = text_[pos];
+        if (c == '"') {
+            return detail::SkipString(text_, pos);
+        }
+        if (c == '{' || c == '[') {
+            auto container = std::lower_bound(
+                containers_.begin(), containers_.end(), pos,
+                [](const Container &container, size_t begin) { return container.begin < begin; });
+            return container->end;
+        }
+        auto begin = pos;
+        while (pos < text_.size() && !std::strchr(",:]} \n\r\t", text_[pos])) {
+            ++pos;
+        }
+        if (pos == begin) {
+            throw ParseError("expected value");
+        }
+        return pos;
+    }
+
+    // Offset of a view into the text.
+    size_t Offset(std::string_view part) const {
+        return part.data() - text_.data();
+    }
+
+private:
+    struct Container {
+        size_t begin;
+        size_t end;
+    };
+
+    const std::string text_;
+    // In the order the containers begin.
+    std::vector<Container> containers_;
+};
+
+// The raw values of the members of an object of the document, found with a pass
+// over the members alone. Keys are compared as written, which is enough for the
+// plain ASCII keys of the Bot API.
+class ObjectIndex {
+public:
+    ObjectIndex(const JsonDocument &document, std::string_view object) {
+        // Enough for the objects of an update without growing.
+        members_.reserve(8);
+        auto text = document.Text();
+        auto pos = Expect(text, document.Offset(object), '{');
+        if (Peek(text, pos) == '}') {
+            return;
+        }
+        while (true) {
+            auto key_begin = detail::SkipSpace(text, pos);
+            if (Peek(text, key_begin) != '"') {
+                throw ParseError("expected key");
+            }
+            auto key_end = detail::SkipString(text, key_begin);
+            auto value_begin = detail::SkipSpace(text, Expect(text, key_end, ':'));
+            auto value_end = document.ValueEnd(value_begin);
+            members_.push_back({text.substr(key_begin + 1, key_end - key_begin - 2),
+                                text.substr(value_begin, value_end - value_begin)});
+            pos = detail::SkipSpace(text, value_end);
+            if (Peek(text, pos) == '}') {
+                return;
+            }
+            pos = Expect(text, pos, ',');
+        }
+    }
+
+    // The raw value of the key, empty if the object has no such member.
+    std::string_view Find(std::string_view key) const {
+        for (const auto &member : members_) {
+            if (member.key == key) {
+                return member.value;
+            }
+        }
+        return {};
+    }
+
+private:
+    static char Peek(std::string_view text, size_t pos) {
+        pos = detail::SkipSpace(text, pos);
+        if (pos == text.size()) {
+            throw ParseError("unexpected end of input");
+        }
+        return text[pos];
+    }
+
+    // Position after the expected character.
+    static size_t Expect(std::string_view text, size_t pos, char expected) {
+        pos = detail::SkipSpace(text, pos);
+        if (Peek(text, pos) != expected) {
+            throw ParseError(std::string("expected '") + expected + "'");
+        }
+        return pos + 1;
+    }
+
+    struct Member {
+        std::string_view key;
+        std::string_view value;
+    };
+
+    std::vector<Member> members_;
+};
+
+// Calls visit with the raw value of each element of an array of the document.
+template <typename Visitor>
+void ForEachElement(const JsonDocument &document, std::string_view array, Visitor &&visit) {
+    auto text = document.Text();
+    auto pos = detail::SkipSpace(text, document.Offset(array));
+    if (pos == text.size() || text[pos] != '[') {
+        throw ParseError("expected '['");
+    }
+    pos = detail::SkipSpace(text, pos + 1);
+    while (pos < text.size() && text[pos] != ']') {
+        auto end = document.ValueEnd(pos);
+        visit(text.substr(pos, end - pos));
+        pos = detail::SkipSpace(text, end);
+        if (pos < text.size() && text[pos] == ',') {
+            pos = detail::SkipSpace(text, pos + 1);
+        }
+    }
+    if (pos == text.size()) {
+        throw ParseError("unexpected end of input");
+    }
+}
+
+inline int64_t ParseInt64(std::string_view raw) {
+    int64_t value = 0;
+    auto [end, error] = std::from_chars(raw.data(), raw.data() + raw.size(), value);
+    if (raw.empty() || error != std::errc() || end != raw.data() + raw.size()) {
+        throw ParseError("expected integer, got " + std::string(raw));
+    }
+    return value;
+}
+
+// The text of a raw string literal. Points into the literal unless it has escapes,
+// then it is decoded into scratch.
+inline std::string_view ParseString(std::string_view raw, std::string &scratch) {
+    if (raw.size() < 2 || raw.front() != '"' || raw.back() != '"') {
+        throw ParseError("expected string");
+    }
+    auto text = raw.substr(1, raw.size() - 2);
+    if (text.find('\\') == std::string_view::npos) {
+        return text;
+    }
+    ViewBuffer buffer(raw);
+    std::istream in(&buffer);
+    JsonReader(in).ReadString(scratch);
+    return scratch;
+}
+
+}  // namespace json
+
+#endif  // JSON_INDEX_H
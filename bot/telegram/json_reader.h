@@ -0,0 +1,377 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace json {
+
+class ParseError : public std::runtime_error {
+public:
+    ParseError(const std::string &details)
+        : std::runtime_error("json parse error: " + details) {
+    }
+};
+
+enum class ValueType { Null, Bool, Number, String, Object, Array };
+
+// Pull parser reading a JSON document straight from a stream. Callers walk the
+// document in the order it arrives and decode fields into their own structs,
+// everything they are not interested in is skipped without being materialized:
+//
+//     reader.BeginObject();
+//     while (reader.NextKey(key)) {
+//         if (key == "id") {
+//             id = reader.Read<int64_t>();
+//         } else {
+//             reader.Skip();
+//         }
+//     }
+class JsonReader {
+public:
+    explicit JsonReader(std::istream &in) : buf_{in.rdbuf()} {
+    }
+
+    ValueType Peek() {
+        switch (PeekNonSpace()) {
+            case '{':
+                return ValueType::Object;
+            case '[':
+                return ValueType::Array;
+            case '"':
+                return ValueType::String;
+            case 't':
+            case 'f':
+                return ValueType::Bool;
+            case 'n':
+                return ValueType::Null;
+            default:
+                return ValueType::Number;
+        }
+    }
+
+    void BeginObject() {
+        Expect('{');
+        first_in_container_ = true;
+    }
+
+    // Reads the next key of the current object and the colon after it. Returns
+    // false once the closing brace is consumed.
+    bool NextKey(std::string &key) {
+        if (!NextInContainer('}')) {
+            return false;
+        }
+        ReadString(key);
+        Expect(':');
+        return true;
+    }
+
+    void BeginArray() {
+        Expect('[');
+        first_in_container_ = true;
+    }
+
+    // Positions the reader at the next array element. Returns false once the
+    // closing bracket is consumed.
+    bool NextElement() {
+        return NextInContainer(']');
+    }
+
+    // Consumes a null literal if it is the next value.
+    bool TryNull() {
+        if (PeekNonSpace() != 'n') {
+            return false;
+        }
+        ExpectLiteral("null");
+        return true;
+    }
+
+    bool ReadBool() {
+        if (PeekNonSpace() == 't') {
+            ExpectLiteral("true");
+            return true;
+        }
+        ExpectLiteral("false");
+        return false;
+    }
+
+    int64_t ReadInt64() {
+        ReadNumberToken();
+        int64_t value = 0;
+        auto [end, error] =
+            std::from_chars(number_.data(), number_.data() + number_.size(), value);
+        if (error != std::errc() || end != number_.data() + number_.size()) {
+            throw ParseError("expected integer, got " + number_);
+        }
+        return value;
+    }
+
+    double ReadDouble() {
+        ReadNumberToken();
+        char *end = nullptr;
+        double value = std::strtod(number_.c_str(), &end);
+        if (end != number_.c_str() + number_.size()) {
+            throw ParseError("invalid number " + number_);
+        }
+        return value;
+    }
+
+    void ReadString(std::string &out) {
+        Expect('"');
+        out.clear();
+        while (true) {
+            int c = Next();
+            if (c == '"') {
+                return;
+            }
+            if (c == '\\') {
+                ReadEscape(out);
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                throw ParseError("control character in string");
+            } else {
+                out.push_back(static_cast<char>(c));
+            }
+        }
+    }
+
+    std::string ReadString() {
+        std::string result;
+        ReadString(result);
+        return result;
+    }
+
+    template <typename T>
+    T Read() {
+        if constexpr (std::is_same_v<T, bool>) {
+            return ReadBool();
+        } else if constexpr (std::is_integral_v<T>) {
+            return static_cast<T>(ReadInt64());
+        } else if constexpr (std::is_floating_point_v<T>) {
+            return static_cast<T>(ReadDouble());
+        } else {
+            static_assert(std::is_same_v<T, std::string>, "unsupported json value type");
+            return ReadString();
+        }
+    }
+
+    // Missing-or-null fields map to an empty optional, like GetNullableValue does
+    // for the DOM.
+    template <typename T>
+    std::optional<T> ReadOptional() {
+        if (TryNull()) {
+            return {};
+        }
+        return Read<T>();
+    }
+
+    // Skips the next value including everything nested in it.
+    void Skip() {
+        int depth = 0;
+        do {
+            int c = PeekNonSpace();
+            if (c == '{' || c == '[') {
+                Next();
+                ++depth;
+                first_in_container_ = true;
+            } else if (c == '}' || c == ']') {
+                Next();
+                --depth;
+            } else if (c == ',' || c == ':') {
+                Next();
+            } else if (c == '"') {
+                SkipString();
+            } else if (c == 't' || c == 'f') {
+                ReadBool();
+            } else if (c == 'n') {
+                ExpectLiteral("null");
+            } else {
+                ReadNumberToken();
+            }
+        } while (depth > 0);
+        first_in_container_ = false;
+    }
+
+private:
+    int Peek1() {
+        auto c = buf_->sgetc();
+        if (c == std::char_traits<char>::eof()) {
+            throw ParseError("unexpected end of input");
+        }
+        return c;
+    }
+
+    int Next() {
+        auto c = buf_->sbumpc();
+        if (c == std::char_traits<char>::eof()) {
+            throw ParseError("unexpected end of input");
+        }
+        return c;
+    }
+
+    int PeekNonSpace() {
+        while (true) {
+            int c = Peek1();
+            if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                return c;
+            }
+            buf_->sbumpc();
+        }
+    }
+
+    void Expect(char expected) {
+        int c = PeekNonSpace();
+        if (c != expected) {
+            throw ParseError(std::string("expected '") + expected + "', got '" +
+                             static_cast<char>(c) + "'");
+        }
+        buf_->sbumpc();
+    }
+
+    void ExpectLiteral(const char *literal) {
+        PeekNonSpace();
+        for (const char *p = literal; *p; ++p) {
+            if (Next() != *p) {
+                throw ParseError(std::string("expected ") + literal);
+            }
+        }
+    }
+
+    bool NextInContainer(char close) {
+        int c = PeekNonSpace();
+        if (c == close) {
+            buf_->sbumpc();
+            first_in_container_ = false;
+            return false;
+        }
+        if (!first_in_container_) {
+            Expect(',');
+        }
+        first_in_container_ = false;
+        return true;
+    }
+
+    void ReadNumberToken() {
+        PeekNonSpace();
+        number_.clear();
+        while (true) {
+            int c = buf_->sgetc();
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' ||
+                c == 'E') {
+                number_.push_back(static_cast<char>(c));
+                buf_->sbumpc();
+            } else {
+                break;
+            }
+        }
+        if (number_.empty()) {
+            throw ParseError("unexpected character");
+        }
+    }
+
+    void SkipString() {
+        Expect('"');
+        while (true) {
+            int c = Next();
+            if (c == '"') {
+                return;
+            }
+            if (c == '\\') {
+                Next();
+            }
+        }
+    }
+
+    uint32_t ReadHex4() {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) {
+            int c = Next();
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                value |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                value |= c - 'A' + 10;
+            } else {
+                throw ParseError("invalid \\u escape");
+            }
+        }
+        return value;
+    }
+
+    void ReadEscape(std::string &out) {
+        int c = Next();
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                out.push_back(static_cast<char>(c));
+                return;
+            case 'b':
+                out.push_back('\b');
+                return;
+            case 'f':
+                out.push_back('\f');
+                return;
+            case 'n':
+                out.push_back('\n');
+                return;
+            case 'r':
+                out.push_back('\r');
+                return;
+            case 't':
+                out.push_back('\t');
+                return;
+            case 'u':
+                break;
+            default:
+                throw ParseError("invalid escape");
+        }
+
+        uint32_t code_point = ReadHex4();
+        if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+            if (Next() != '\\' || Next() != 'u') {
+                throw ParseError("unpaired surrogate");
+            }
+            uint32_t low = ReadHex4();
+            if (low < 0xDC00 || low > 0xDFFF) {
+                throw ParseError("unpaired surrogate");
+            }
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+        }
+        AppendUtf8(out, code_point);
+    }
+
+    static void AppendUtf8(std::string &out, uint32_t code_point) {
+        if (code_point < 0x80) {
+            out.push_back(static_cast<char>(code_point));
+        } else if (code_point < 0x800) {
+            out.push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+        } else if (code_point < 0x10000) {
+            out.push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+        } else {
+            out.push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+            out.push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+        }
+    }
+
+private:
+    std::streambuf *buf_;
+    bool first_in_container_{false};
+    std::string number_;
+};
+
+}  // namespace json
+
+#endif  // JSON_READER_H
@@ -0,0 +1,166 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace json {
+
+namespace detail {
+
+inline bool NeedsEscape(char c) {
+    return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+}
+
+// Length of the prefix of text that goes into a string literal as is. Message texts
+// rarely hold quotes or control characters, so this usually is the whole text.
+inline size_t PlainPrefix(std::string_view text) {
+    size_t pos = 0;
+#if defined(__SSE2__)
+    const auto quote = _mm_set1_epi8('"');
+    const auto backslash = _mm_set1_epi8('\\');
+    const auto last_control = _mm_set1_epi8(0x1f);
+    for (; pos + 16 <= text.size(); pos += 16) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        // Bytes no greater than 0x1f as unsigned are the ones the minimum leaves alone.
+        auto control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, last_control), chunk);
+        auto special = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                          _mm_cmpeq_epi8(chunk, backslash)));
+        auto mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (pos < text.size() && !NeedsEscape(text[pos])) {
+        ++pos;
+    }
+    return pos;
+}
+
+inline void AppendEscape(std::string &out, char c) {
+    switch (c) {
+        case '"':
+            out.append("\\\"");
+            return;
+        case '\\':
+            out.append("\\\\");
+            return;
+        case '\b':
+            out.append("\\b");
+            return;
+        case '\f':
+            out.append("\\f");
+            return;
+        case '\n':
+            out.append("\\n");
+            return;
+        case '\r':
+            out.append("\\r");
+            return;
+        case '\t':
+            out.append("\\t");
+            return;
+        default:
+            static constexpr char kHex[] = "0123456789abcdef";
+            auto code = static_cast<unsigned char>(c);
+            out.append("\\u00");
+            out += kHex[code >> 4];
+            out += kHex[code & 0xf];
+    }
+}
+
+}  // namespace detail
+
+// Appends text as a JSON string literal. UTF-8 is copied as is, only quotes,
+// backslashes and control characters are escaped.
+inline void AppendString(std::string &out, std::string_view text) {
+    out.reserve(out.size() + text.size() + 2);
+    out += '"';
+    for (;;) {
+        auto plain = detail::PlainPrefix(text);
+        out.append(text.data(), plain);
+        if (plain == text.size()) {
+            break;
+        }
+        detail::AppendEscape(out, text[plain]);
+        text.remove_prefix(plain + 1);
+    }
+    out += '"';
+}
+
+// Writer appending a JSON document to a string, the counterpart of JsonReader for
+// the small bodies the bot sends. Nothing is built besides the output, so writing
+// into a string that is reused allocates only while it grows:
+//
+//     writer.BeginObject();
+//     writer.Key("chat_id");
+//     writer.WriteInt64(chat_id);
+//     writer.EndObject();
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string &out) : out_{out} {
+    }
+
+    void BeginObject() {
+        Separate();
+        out_ += '{';
+        first_ = true;
+    }
+
+    void EndObject() {
+        out_ += '}';
+        first_ = false;
+    }
+
+    // The key is written as is, it must not need escaping.
+    void Key(std::string_view key) {
+        Separate();
+        out_ += '"';
+        out_.append(key);
+        out_.append("\":");
+        // The value follows without a comma.
+        first_ = true;
+    }
+
+    void WriteInt64(int64_t value) {
+        Separate();
+        char digits[20];
+        auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        out_.append(digits, end - digits);
+        first_ = false;
+    }
+
+    void WriteBool(bool value) {
+        Separate();
+        out_.append(value ? "true" : "false");
+        first_ = false;
+    }
+
+    void WriteString(std::string_view value) {
+        Separate();
+        AppendString(out_, value);
+        first_ = false;
+    }
+
+private:
+    void Separate() {
+        if (!first_) {
+            out_ += ',';
+        }
+    }
+
+    std::string &out_;
+    bool first_{true};
+};
+
+}  // namespace json
+
+#endif  // JSON_WRITER_H
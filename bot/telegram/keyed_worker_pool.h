@@ -0,0 +1,226 @@
+#ifndef KEYED_WORKER_POOL_H
+#define KEYED_WORKER_POOL_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Thread pool that runs tasks sharing a key one at a time and in submission order,
+// while tasks of different keys run in parallel.
+//
+// Pending tasks of a key form a lane. A lane is queued on the run queue of its home
+// worker (key modulo the number of workers) and is run by one worker at a time. An
+// idle worker whose own run queue is empty steals a lane from the back of another
+// worker's queue, so one busy key never leaves the other workers without work.
+//
+// An optional gate paces the keys: a lane whose key the gate holds back is parked
+// until the time it names, while its worker goes on with other lanes.
+class KeyedWorkerPool {
+public:
+    using Task = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+    // Asked before each task of the key, under the lock of the pool. Returns a time
+    // not after now to let the task run, otherwise the time to ask again.
+    using Gate = std::function<Clock::time_point(int64_t key, Clock::time_point now)>;
+
+    // At most capacity tasks wait at once, Submit blocks beyond that.
+    KeyedWorkerPool(size_t threads, size_t capacity, Gate gate = {})
+        : run_queues_(std::max<size_t>(threads, 1)),
+          capacity_{std::max<size_t>(capacity, 1)},
+          gate_{std::move(gate)} {
+        for (size_t index = 0; index != run_queues_.size(); ++index) {
+            threads_.emplace_back([this, index] { WorkerLoop(index); });
+        }
+    }
+
+    KeyedWorkerPool(const KeyedWorkerPool&) = delete;
+    KeyedWorkerPool& operator=(const KeyedWorkerPool&) = delete;
+
+    ~KeyedWorkerPool() {
+        Shutdown();
+    }
+
+    // Tasks must not throw. Returns false if the pool is shutting down.
+    bool Submit(int64_t key, Task task) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        has_space_.wait(guard, [this] { return stopping_ || pending_ < capacity_; });
+        if (stopping_) {
+            return false;
+        }
+
+        auto& lane = lanes_[key];
+        lane.key = key;
+        lane.tasks.push_back(std::move(task));
+        ++pending_;
+        if (!lane.scheduled) {
+            lane.scheduled = true;
+            run_queues_[HomeWorker(key)].push_back(&lane);
+            has_work_.notify_one();
+        }
+        return true;
+    }
+
+    // Puts a task back at the head of its lane, to run before the tasks queued behind
+    // it, like a send to be retried. Only for a running task of the key, and it doesn't
+    // wait for space.
+    void Requeue(int64_t key, Task task) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        lanes_[key].tasks.push_front(std::move(task));
+        ++pending_;
+    }
+
+    // Blocks until every task submitted so far has run. Unlike Shutdown the pool
+    // stays usable.
+    void Drain() {
+        std::unique_lock<std::mutex> guard(mutex_);
+        idle_.wait(guard, [this] { return pending_ == 0; });
+    }
+
+    // Stops accepting tasks, runs the ones already submitted and joins the workers.
+    void Shutdown() {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stopping_ = true;
+            has_work_.notify_all();
+            has_space_.notify_all();
+        }
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+private:
+    struct Lane {
+        int64_t key{0};
+        std::deque<Task> tasks;
+        bool scheduled{false};
+    };
+
+    // Tasks run from one lane before it goes back to the run queue, so a chatty key
+    // cannot starve lanes queued behind it.
+    static constexpr size_t kLaneBatch = 16;
+
+    size_t HomeWorker(int64_t key) const {
+        return static_cast<uint64_t>(key) % run_queues_.size();
+    }
+
+    Lane* TakeLane(size_t index) {
+        auto& own = run_queues_[index];
+        if (!own.empty()) {
+            auto lane = own.front();
+            own.pop_front();
+            return lane;
+        }
+        for (size_t shift = 1; shift < run_queues_.size(); ++shift) {
+            auto& victim = run_queues_[(index + shift) % run_queues_.size()];
+            if (!victim.empty()) {
+                auto lane = victim.back();
+                victim.pop_back();
+                return lane;
+            }
+        }
+        return nullptr;
+    }
+
+    // Lanes whose time has come go back to the run queues of their home workers.
+    void UnparkDue(Clock::time_point now) {
+        while (!parked_.empty() && parked_.begin()->first <= now) {
+            auto lane = parked_.begin()->second;
+            parked_.erase(parked_.begin());
+            run_queues_[HomeWorker(lane->key)].push_back(lane);
+            has_work_.notify_one();
+        }
+    }
+
+    // Whether the gate holds the lane back, which is then parked.
+    bool Park(Lane* lane) {
+        if (!gate_) {
+            return false;
+        }
+        auto now = Clock::now();
+        auto at = gate_(lane->key, now);
+        if (at <= now) {
+            return false;
+        }
+        parked_.emplace(at, lane);
+        return true;
+    }
+
+    void WorkerLoop(size_t index) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        while (true) {
+            UnparkDue(Clock::now());
+            auto lane = TakeLane(index);
+            if (!lane) {
+                if (stopping_ && pending_ == 0) {
+                    return;
+                }
+                if (parked_.empty()) {
+                    has_work_.wait(guard);
+                } else {
+                    has_work_.wait_until(guard, parked_.begin()->first);
+                }
+                continue;
+            }
+
+            auto parked = false;
+            for (size_t done = 0; done != kLaneBatch && !lane->tasks.empty(); ++done) {
+                if ((parked = Park(lane))) {
+                    break;
+                }
+                auto task = std::move(lane->tasks.front());
+                lane->tasks.pop_front();
+
+                guard.unlock();
+                task();
+                guard.lock();
+
+                --pending_;
+                has_space_.notify_one();
+                if (pending_ == 0) {
+                    idle_.notify_all();
+                }
+            }
+
+            if (parked) {
+                // The worker that parked it or any other idle one wakes up for it.
+            } else if (lane->tasks.empty()) {
+                lanes_.erase(lane->key);
+            } else {
+                run_queues_[index].push_back(lane);
+                has_work_.notify_one();
+            }
+            if (stopping_ && pending_ == 0) {
+                has_work_.notify_all();
+            }
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable has_work_;
+    std::condition_variable has_space_;
+    std::condition_variable idle_;
+    // Node-based, so lanes keep their address while other keys come and go.
+    std::unordered_map<int64_t, Lane> lanes_;
+    std::vector<std::deque<Lane*>> run_queues_;
+    // Lanes held back by the gate, by the time they may run again.
+    std::multimap<Clock::time_point, Lane*> parked_;
+    std::vector<std::thread> threads_;
+    const size_t capacity_;
+    const Gate gate_;
+    size_t pending_{0};
+    bool stopping_{false};
+};
+
+#endif  // KEYED_WORKER_POOL_H
@@ -1,10 +1,21 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include "mpsc_ring_buffer.h"
+
 #include <iostream>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
 namespace logger {
 
@@ -19,25 +30,92 @@ inline std::string to_string(LogLevel level) {
     throw std::runtime_error("invalid log level");
 }
 
+namespace detail {
+
+template <typename T>
+struct IsOptional : std::false_type {};
+
+template <typename T>
+struct IsOptional<std::optional<T>> : std::true_type {};
+
+// Appends one log argument: anything std::string can append, a number, an optional
+// of those (nothing if empty) or a callable returning one of them.
+template <typename T>
+void AppendTo(std::string& out, const T& value) {
+    if constexpr (std::is_invocable_v<const T&>) {
+        AppendTo(out, value());
+    } else if constexpr (IsOptional<T>::value) {
+        if (value.has_value()) {
+            AppendTo(out, value.value());
+        }
+    } else if constexpr (std::is_same_v<T, bool>) {
+        out += value ? "true" : "false";
+    } else if constexpr (std::is_same_v<T, char>) {
+        out += value;
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        out += std::to_string(value);
+    } else {
+        out += value;
+    }
+}
+
+}  // namespace detail
+
 class Logger {
 public:
     Logger(LogLevel min_level) : min_level_{min_level} {
     }
-    void LogInfo(const std::string& message) {
-        Log(LogLevel::Info, message);
+
+    // The message is the concatenation of the arguments, built only if the level is
+    // enabled. Pass the pieces rather than a ready string, and wrap values that are
+    // expensive to get in a lambda:
+    //     logger->LogInfo("Got ", updates.size(), " updates");
+    template <typename... Args>
+    void LogInfo(Args&&... args) {
+        LogIfEnabled(LogLevel::Info, std::forward<Args>(args)...);
     }
-    void LogError(const std::string& message) {
-        Log(LogLevel::Error, message);
+    template <typename... Args>
+    void LogError(Args&&... args) {
+        LogIfEnabled(LogLevel::Error, std::forward<Args>(args)...);
+    }
+
+    bool IsEnabled(LogLevel level) const {
+        return level >= min_level_.load(std::memory_order_relaxed);
+    }
+
+    void SetMinLevel(LogLevel level) {
+        min_level_.store(level, std::memory_order_relaxed);
+    }
+
+    // Blocks until everything logged so far reached the output.
+    virtual void Flush() {
     }
 
     virtual ~Logger() {
     }
 
 protected:
-    virtual void Log(LogLevel cur_level, const std::string& message) = 0;
+    // Only called for enabled levels.
+    virtual void Log(LogLevel cur_level, std::string message) = 0;
 
-protected:
-    LogLevel min_level_;
+private:
+    template <typename... Args>
+    void LogIfEnabled(LogLevel level, Args&&... args) {
+        if (!IsEnabled(level)) {
+            return;
+        }
+        if constexpr (sizeof...(Args) == 1 &&
+                      (std::is_same_v<std::decay_t<Args>, std::string> && ...)) {
+            Log(level, std::string(std::forward<Args>(args)...));
+        } else {
+            std::string message;
+            (detail::AppendTo(message, args), ...);
+            Log(level, std::move(message));
+        }
+    }
+
+private:
+    std::atomic<LogLevel> min_level_;
 };
 
 class OstreamLogger : public Logger {
@@ -46,12 +124,10 @@ public:
     }
 
 protected:
-    void Log(LogLevel cur_level, const std::string& message) override final {
-        if (cur_level < min_level_) {
-            return;
-        }
+    void Log(LogLevel cur_level, std::string message) override final {
         auto now = std::chrono::system_clock::now();
         auto old_time = std::chrono::system_clock::to_time_t(now);
+        std::lock_guard<std::mutex> guard(mutex_);
         try {
             out_ << to_string(cur_level) << "\t" << message << "\t" << ctime(&old_time);
         } catch (...) {
@@ -59,11 +135,155 @@ protected:
         }
     }
 
+public:
+    void Flush() override {
+        std::lock_guard<std::mutex> guard(mutex_);
+        out_.flush();
+    }
+
 private:
     std::ostream& out_;
+    std::mutex mutex_;
     std::string context_;
 };
 
+// What AsyncLogger does when its buffer is full.
+enum class OverflowPolicy {
+    // Drop the record and report how many were lost with the next batch.
+    Drop,
+    // Wait until the writer thread frees a slot.
+    Block
+};
+
+// Logger that keeps formatting and I/O off the calling thread. Log() only moves the
+// message into a lock-free ring buffer, a background thread drains it and writes the
+// records in batches. The destructor writes out everything still buffered.
+class AsyncLogger : public Logger {
+public:
+    AsyncLogger(std::ostream& out, size_t capacity = 8192,
+                OverflowPolicy policy = OverflowPolicy::Drop)
+        : Logger(LogLevel::Info), out_{out}, policy_{policy}, ring_{capacity} {
+        writer_ = std::thread([this] { WriterLoop(); });
+    }
+
+    ~AsyncLogger() override {
+        stopping_ = true;
+        Wake();
+        writer_.join();
+    }
+
+    void Flush() override {
+        auto target = pushed_.load(std::memory_order_acquire);
+        Wake();
+        std::unique_lock<std::mutex> guard(mutex_);
+        flushed_.wait(guard, [&] { return written_ >= target; });
+    }
+
+protected:
+    void Log(LogLevel cur_level, std::string message) override final {
+        Record record{cur_level, std::chrono::system_clock::now(), std::move(message)};
+        while (!ring_.TryPush(record)) {
+            if (policy_ == OverflowPolicy::Drop) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                pushed_.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            Wake();
+            std::this_thread::yield();
+        }
+        pushed_.fetch_add(1, std::memory_order_release);
+        if (writer_idle_.load(std::memory_order_acquire)) {
+            Wake();
+        }
+    }
+
+private:
+    struct Record {
+        LogLevel level{LogLevel::Info};
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
+
+    // Records formatted into one write, bounds the latency of a busy logger.
+    static constexpr size_t kMaxBatch = 512;
+    // Backstop for a wakeup lost between an idle check and the wait.
+    static constexpr std::chrono::milliseconds kIdleWait{50};
+
+    void Wake() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        wake_.notify_one();
+    }
+
+    void WriterLoop() {
+        Record record;
+        std::string batch;
+        while (true) {
+            size_t count = 0;
+            while (count != kMaxBatch && ring_.TryPop(record)) {
+                Format(record.level, record.time, record.message, batch);
+                ++count;
+            }
+            if (auto dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+                Format(LogLevel::Error, std::chrono::system_clock::now(),
+                       "Logger buffer overflow, dropped " + std::to_string(dropped) + " records",
+                       batch);
+                count += dropped;
+            }
+
+            if (count != 0) {
+                try {
+                    out_.write(batch.data(), batch.size());
+                    out_.flush();
+                } catch (...) {
+                    std::cerr << "Logger error...";
+                }
+                batch.clear();
+
+                std::lock_guard<std::mutex> guard(mutex_);
+                written_ += count;
+                flushed_.notify_all();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(mutex_);
+            if (stopping_ && written_ == pushed_.load(std::memory_order_acquire)) {
+                return;
+            }
+            writer_idle_.store(true, std::memory_order_release);
+            if (written_ == pushed_.load(std::memory_order_acquire)) {
+                wake_.wait_for(guard, kIdleWait);
+            }
+            writer_idle_.store(false, std::memory_order_release);
+        }
+    }
+
+    static void Format(LogLevel level, std::chrono::system_clock::time_point time,
+                       const std::string& message, std::string& out) {
+        auto time_t = std::chrono::system_clock::to_time_t(time);
+        char time_buf[32];
+        out += to_string(level);
+        out += '\t';
+        out += message;
+        out += '\t';
+        out += ctime_r(&time_t, time_buf);
+    }
+
+private:
+    std::ostream& out_;
+    const OverflowPolicy policy_;
+    MpscRingBuffer<Record> ring_;
+    std::atomic<size_t> pushed_{0};
+    std::atomic<size_t> dropped_{0};
+    std::atomic<bool> writer_idle_{false};
+    std::atomic<bool> stopping_{false};
+    // Guards written_ and the condition variables.
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    size_t written_{0};
+    std::thread writer_;
+};
+
 class LoggerFactory {
 public:
     static std::shared_ptr<Logger> GetStdoutLogger() {
@@ -71,6 +291,37 @@ public:
             std::dynamic_pointer_cast<Logger>(std::make_shared<OstreamLogger>(std::cout));
         return logger;
     }
+
+    static std::shared_ptr<Logger> GetAsyncStdoutLogger() {
+        static std::shared_ptr<Logger> logger =
+            std::dynamic_pointer_cast<Logger>(std::make_shared<AsyncLogger>(std::cout));
+        return logger;
+    }
+
+    // The logger components pick up when they are created, stdout by default.
+    static std::shared_ptr<Logger> GetDefaultLogger() {
+        std::lock_guard<std::mutex> guard(DefaultMutex());
+        if (!DefaultLogger()) {
+            DefaultLogger() = GetStdoutLogger();
+        }
+        return DefaultLogger();
+    }
+
+    static void SetDefaultLogger(std::shared_ptr<Logger> logger) {
+        std::lock_guard<std::mutex> guard(DefaultMutex());
+        DefaultLogger() = std::move(logger);
+    }
+
+private:
+    static std::shared_ptr<Logger>& DefaultLogger() {
+        static std::shared_ptr<Logger> logger;
+        return logger;
+    }
+
+    static std::mutex& DefaultMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
 };
 
 }  // namespace logger
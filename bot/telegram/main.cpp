@@ -1,11 +1,119 @@
+#include <cctype>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <stdexcept>
+#include <random>
+#include <string>
 
 #include "bot_main.h"
+#include "supervisor.h"
+
+// Fresh for every run, so only the Telegram servers told by setWebhook can post updates.
+std::string MakeSecretToken() {
+    const std::string alphabet =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+    std::random_device random;
+    std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+    std::string token;
+    for (int i = 0; i < 32; ++i) {
+        token += alphabet[pick(random)];
+    }
+    return token;
+}
+
+// Whole value of a numeric flag, no sign, spaces or trailing characters. Throws
+// std::invalid_argument or std::out_of_range otherwise.
+uint64_t ParseFlagNumber(const std::string &value, uint64_t max) {
+    if (value.empty() || !std::isdigit(static_cast<unsigned char>(value.front()))) {
+        throw std::invalid_argument(value);
+    }
+    size_t end;
+    auto number = std::stoull(value, &end);
+    if (end != value.size()) {
+        throw std::invalid_argument(value);
+    }
+    if (number > max) {
+        throw std::out_of_range(value);
+    }
+    return number;
+}
+
+// Runs the bot until /stop. A webhook bot also stops cleanly on SIGTERM or SIGINT, a
+// polling one would wait for its long poll to end.
+int RunBot(const std::shared_ptr<BotServerConfig> &config) {
+    std::optional<ShutdownSignalWatcher> signals;
+    if (config->webhook.enabled) {
+        signals.emplace();
+    }
+    logger::LoggerFactory::SetDefaultLogger(logger::LoggerFactory::GetAsyncStdoutLogger());
+
+    BotServer server{config};
+    if (signals) {
+        signals->Watch([&server] { server.RequestShutdown(); });
+    }
+    server.Start();
+    if (signals) {
+        signals->Stop();
+    }
+    return 0;
+}
 
 int main(int argc, char **argv) {
+    // --api-url points the bot at another Bot API server, e.g. the fake one in load
+    // mode. Plain http:// URLs are served without TLS. --record writes a trace of the
+    // traffic that the fake server can replay. --epoll sends plain HTTP requests from a
+    // single non-blocking event loop, --io-uring does the same with io_uring.
+    // --webhook registers the public URL with Telegram and takes the updates it posts
+    // on --webhook-port instead of polling. --webhook-processes forks that many workers
+    // sharing the port and restarts the ones that crash.
+    std::string api_url = "https://api.telegram.org/";
+    std::string trace_path;
+    std::string webhook_url;
+    uint16_t webhook_port = 8443;
+    size_t webhook_processes = 0;
+    auto transport = tg::Transport::Sessions;
+    const std::string api_url_flag = "--api-url=";
+    const std::string record_flag = "--record=";
+    const std::string webhook_flag = "--webhook=";
+    const std::string webhook_port_flag = "--webhook-port=";
+    const std::string webhook_processes_flag = "--webhook-processes=";
+    for (; argc > 1 && std::string(argv[1]).rfind("--", 0) == 0; --argc, ++argv) {
+        std::string flag = argv[1];
+        try {
+            if (flag.rfind(api_url_flag, 0) == 0) {
+                api_url = flag.substr(api_url_flag.size());
+            } else if (flag.rfind(record_flag, 0) == 0) {
+                trace_path = flag.substr(record_flag.size());
+            } else if (flag.rfind(webhook_flag, 0) == 0) {
+                webhook_url = flag.substr(webhook_flag.size());
+            } else if (flag.rfind(webhook_port_flag, 0) == 0) {
+                webhook_port = static_cast<uint16_t>(
+                    ParseFlagNumber(flag.substr(webhook_port_flag.size()),
+                                    std::numeric_limits<uint16_t>::max()));
+            } else if (flag.rfind(webhook_processes_flag, 0) == 0) {
+                webhook_processes = ParseFlagNumber(flag.substr(webhook_processes_flag.size()),
+                                                    std::numeric_limits<size_t>::max());
+            } else if (flag == "--epoll") {
+                transport = tg::Transport::Epoll;
+            } else if (flag == "--io-uring") {
+                transport = tg::Transport::IoUring;
+            } else {
+                argc = 0;
+                break;
+            }
+        } catch (const std::logic_error &) {
+            std::cerr << "Bad value in " << flag << std::endl;
+            argc = 0;
+            break;
+        }
+    }
+
     if (argc != 3) {
-        std::cerr << "Usage: ./bot-run <token_file_path> <offset_backup_path>" << std::endl;
+        std::cerr << "Usage: ./bot-run [--api-url=<url>] [--record=<trace_path>] "
+                     "[--epoll|--io-uring] [--webhook=<url> [--webhook-port=<port>] "
+                     "[--webhook-processes=<n>]] <token_file_path> <offset_backup_path>"
+                  << std::endl;
         return -1;
     }
 
@@ -14,12 +122,39 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    auto mode = api_url.rfind("http://", 0) == 0 ? NetworkMode::HTTP : NetworkMode::HTTPS;
     auto config = std::make_shared<BotServerConfig>(
-        tg::TelegramCredentials{token.value(),
-                                "https://api.telegram.org/"},
-        argv[2], NetworkMode::HTTPS);
+        tg::TelegramCredentials{token.value(), api_url}, argv[2], mode);
+    config->dispatch.pipelined = true;
+    config->api.trace_path = trace_path;
+    config->api.flood_control.enabled = true;
+    config->api.transport = transport;
+    if (!webhook_url.empty()) {
+        config->webhook.enabled = true;
+        config->webhook.url = webhook_url;
+        config->webhook.port = webhook_port;
+        config->webhook.secret_token = MakeSecretToken();
+    }
 
-    BotServer server{config};
-    server.Start();
-    return 0;
-}
\ No newline at end of file
+    if (config->webhook.enabled && webhook_processes > 0) {
+        // Every worker listens on the port, only the first one registers the webhook.
+        // Forked before any thread is started.
+        config->webhook.reuse_port = true;
+        config->webhook.max_connections = webhook_processes * config->webhook.max_threads;
+        Supervisor supervisor(webhook_processes, [&config](size_t index) {
+            auto worker = std::make_shared<BotServerConfig>(*config);
+            auto suffix = "." + std::to_string(index);
+            if (index != 0) {
+                worker->webhook.url.clear();
+            }
+            worker->path_to_backup_file += suffix;
+            if (!worker->api.trace_path.empty()) {
+                worker->api.trace_path += suffix;
+            }
+            return RunBot(worker);
+        });
+        return supervisor.Run();
+    }
+
+    return RunBot(config);
+}
@@ -2,10 +2,24 @@
 #define MESSAGE_HANDLERS_H
 
 #include "api.h"
+#include "command_parser.h"
+#include "task.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <re2/re2.h>
+#include <re2/set.h>
 
 namespace handler_exceptions {
 
@@ -15,36 +29,110 @@ class CrashRequested : public std::exception {};
 
 }  // namespace handler_exceptions
 
+// Command the message starts with: its bot_command entity at the start or, without
+// entities, the first word if it starts with '/'. Views into message.text.
+inline std::optional<tg::BotCommand> ParseCommand(const tg::TelegramApiMessage& message) {
+    if (!message.text) {
+        return std::nullopt;
+    }
+    std::string_view text = *message.text;
+    if (message.entities.empty()) {
+        return tg::ParseBotCommand(text);
+    }
+    for (const auto& entity : message.entities) {
+        if (entity.type == "bot_command" && entity.offset == 0) {
+            auto length = tg::Utf16ToBytes(text, entity.length);
+            if (length == std::string_view::npos) {
+                return std::nullopt;
+            }
+            return tg::ParseBotCommand(text, length);
+        }
+    }
+    return std::nullopt;
+}
+
 class MessageHandler {
 public:
     MessageHandler(std::shared_ptr<tg::TelegramApi> api) : api_{api} {
     }
     virtual void handle(const tg::TelegramApiMessage& message) = 0;
     virtual bool matches(const tg::TelegramApiMessage& message) const = 0;
+    // Command the handler answers, like "/random". The factory finds such handlers by
+    // the command of the message and only asks them to confirm with matches(). Empty
+    // for handlers matched by anything else.
+    virtual std::string_view Command() const {
+        return {};
+    }
+    // Regular expressions searched for in the text of the message. The factory matches
+    // the triggers of all handlers at once and doesn't call matches() of such handlers.
+    virtual std::vector<std::string> Triggers() const {
+        return {};
+    }
     virtual ~MessageHandler() {
     }
 
 protected:
+    // The message is the Command() of the handler, with or without arguments.
+    bool IsCommand(const tg::TelegramApiMessage& message) const {
+        auto command = ParseCommand(message);
+        return command && command->name == Command();
+    }
+
+    // Queues the answer instead of waiting for it, a failed send is only logged.
+    void Reply(int64_t chat_id, const std::string& text) {
+        api_->SendMessageAsync(chat_id, text, [](std::future<tg::TelegramApiMessage> sent) {
+            try {
+                sent.get();
+            } catch (const tg::TelegramApiError& error) {
+                logger::LoggerFactory::GetDefaultLogger()->LogError("Reply failed: ", error.what());
+            }
+        });
+    }
+
     std::shared_ptr<tg::TelegramApi> api_;
 };
 
+// "/random 10" answers a number from 0 to 10, "/random" one from the full range.
 class RandomMessageHandler : public MessageHandler {
 public:
-    RandomMessageHandler(std::shared_ptr<tg::TelegramApi> api)
-        : MessageHandler(api), dist_{0, std::numeric_limits<uint64_t>::max()} {
+    RandomMessageHandler(std::shared_ptr<tg::TelegramApi> api) : MessageHandler(api) {
     }
 
     void handle(const tg::TelegramApiMessage& message) override final {
-        api_->SendMessage(message.chat->id, std::to_string(dist_(mt_)));
+        auto max = std::numeric_limits<uint64_t>::max();
+        auto command = ParseCommand(message);
+        if (!command) {
+            Reply(message.chat->id, "Usage: /random [max]");
+            return;
+        }
+        auto arguments = command->arguments;
+        if (!arguments.empty()) {
+            auto end = arguments.data() + arguments.size();
+            auto [parsed, error] = std::from_chars(arguments.data(), end, max);
+            if (error != std::errc() || parsed != end) {
+                Reply(message.chat->id, "Usage: /random [max]");
+                return;
+            }
+        }
+        uint64_t value;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            value = std::uniform_int_distribution<uint64_t>(0, max)(mt_);
+        }
+        Reply(message.chat->id, std::to_string(value));
     }
 
     bool matches(const tg::TelegramApiMessage& message) const override final {
-        return message.text && message.chat && message.text == "/random";
+        return message.chat && IsCommand(message);
+    }
+
+    std::string_view Command() const override final {
+        return "/random";
     }
 
 private:
+    std::mutex mutex_;
     std::mt19937 mt_{};
-    std::uniform_int_distribution<uint64_t> dist_;
 };
 
 class WeatherMessageHandler : public MessageHandler {
@@ -53,11 +141,15 @@ public:
     }
 
     void handle(const tg::TelegramApiMessage& message) override final {
-        api_->SendMessage(message.chat->id, "Winter Is Coming");
+        Reply(message.chat->id, "Winter Is Coming");
     }
 
     bool matches(const tg::TelegramApiMessage& message) const override final {
-        return message.text && message.chat && message.text == "/weather";
+        return message.chat && IsCommand(message);
+    }
+
+    std::string_view Command() const override final {
+        return "/weather";
     }
 };
 
@@ -67,11 +159,67 @@ public:
     }
 
     void handle(const tg::TelegramApiMessage& message) override final {
-        api_->SendMessage(message.chat->id, "A funny joke about review");
+        Reply(message.chat->id, "A funny joke about review");
     }
 
     bool matches(const tg::TelegramApiMessage& message) const override final {
-        return message.text && message.chat && message.text == "/styleguide";
+        return message.chat && IsCommand(message);
+    }
+
+    std::string_view Command() const override final {
+        return "/styleguide";
+    }
+};
+
+// Handler triggered by any of a few regular expressions in RE2 syntax, found anywhere
+// in the text unless anchored.
+class RegexMessageHandler : public MessageHandler {
+public:
+    // Throws std::invalid_argument for a malformed pattern.
+    RegexMessageHandler(std::shared_ptr<tg::TelegramApi> api, std::vector<std::string> triggers)
+        : MessageHandler(api), triggers_{std::move(triggers)} {
+        for (const auto& trigger : triggers_) {
+            regexes_.push_back(std::make_unique<RE2>(trigger, RE2::Quiet));
+            if (!regexes_.back()->ok()) {
+                throw std::invalid_argument("Invalid trigger " + trigger + ": " +
+                                            regexes_.back()->error());
+            }
+        }
+    }
+
+    // Used outside of the factory only.
+    bool matches(const tg::TelegramApiMessage& message) const override {
+        if (!message.text) {
+            return false;
+        }
+        for (const auto& regex : regexes_) {
+            if (RE2::PartialMatch(*message.text, *regex)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::string> Triggers() const override final {
+        return triggers_;
+    }
+
+private:
+    std::vector<std::string> triggers_;
+    std::vector<std::unique_ptr<RE2>> regexes_;
+};
+
+// Answers nothing, for commands addressed to another bot in a group.
+class IgnoreMessageHandler : public MessageHandler {
+public:
+    IgnoreMessageHandler(std::shared_ptr<tg::TelegramApi> api) : MessageHandler(api) {
+    }
+
+    void handle(const tg::TelegramApiMessage&) override final {
+    }
+
+    bool matches(const tg::TelegramApiMessage&) const override final {
+        return false;
     }
 };
 
@@ -81,9 +229,8 @@ public:
     }
 
     void handle(const tg::TelegramApiMessage& message) override final {
-        api_->SendMessage(message.chat->id,
-                          "Sorry, your message is not recognized: " +
-                              (message.text.has_value() ? message.text.value() : ""));
+        Reply(message.chat->id, "Sorry, your message is not recognized: " +
+                                    (message.text.has_value() ? message.text.value() : ""));
     }
 
     bool matches(const tg::TelegramApiMessage&) const override final {
@@ -101,7 +248,11 @@ public:
     }
 
     bool matches(const tg::TelegramApiMessage& message) const override final {
-        return message.text && message.text == "/stop";
+        return IsCommand(message);
+    }
+
+    std::string_view Command() const override final {
+        return "/stop";
     }
 };
 
@@ -115,39 +266,225 @@ public:
     }
 
     bool matches(const tg::TelegramApiMessage& message) const override final {
-        return message.text && message.text == "/crash";
+        return IsCommand(message);
     }
+
+    std::string_view Command() const override final {
+        return "/crash";
+    }
+};
+
+#if defined(__cpp_impl_coroutine)
+
+// Handler written as a coroutine. handle() only starts it on the event loop, so a
+// handler awaiting the API or any other lookup holds no thread meanwhile. Shutdown
+// and crash requests are not delivered from coroutine handlers.
+class CoroutineMessageHandler : public MessageHandler {
+public:
+    CoroutineMessageHandler(std::shared_ptr<tg::TelegramApi> api, std::shared_ptr<EventLoop> loop)
+        : MessageHandler(api), loop_{loop} {
+    }
+
+    void handle(const tg::TelegramApiMessage& message) override final {
+        loop_->Spawn(HandleAsync(message));
+    }
+
+protected:
+    // Takes a copy: the message outlives the handle() call that started the task.
+    virtual Task<void> HandleAsync(tg::TelegramApiMessage message) = 0;
+
+    // co_await Send(...) sends through the outbox and continues once it is sent.
+    auto Send(int64_t chat_id, std::string text) {
+        auto start = [api = api_, chat_id, text = std::move(text)](auto done) {
+            api->SendMessageAsync(chat_id, text, std::move(done));
+        };
+        return AwaitCallback<tg::TelegramApiMessage>(*loop_, std::move(start));
+    }
+
+    std::shared_ptr<EventLoop> loop_;
 };
 
+#endif  // __cpp_impl_coroutine
+
 class MessageHandlerFactory {
 public:
-    MessageHandlerFactory(std::shared_ptr<tg::TelegramApi> api) {
-        handlers_.emplace_back(std::make_shared<RandomMessageHandler>(api));
-        handlers_.emplace_back(std::make_shared<WeatherMessageHandler>(api));
-        handlers_.emplace_back(std::make_shared<ReviewJokeMessageHandler>(api));
-        handlers_.emplace_back(std::make_shared<ExitCrashComandHandler>(api));
-        handlers_.emplace_back(std::make_shared<ExitOkComandHandler>(api));
+    MessageHandlerFactory(std::shared_ptr<tg::TelegramApi> api) : api_{api} {
+        AddHandler(std::make_shared<RandomMessageHandler>(api));
+        AddHandler(std::make_shared<WeatherMessageHandler>(api));
+        AddHandler(std::make_shared<ReviewJokeMessageHandler>(api));
+        AddHandler(std::make_shared<ExitCrashComandHandler>(api));
+        AddHandler(std::make_shared<ExitOkComandHandler>(api));
 
         default_handler_ = std::make_shared<DefaultMessageHandler>(api);
+        ignore_handler_ = std::make_shared<IgnoreMessageHandler>(api);
     }
 
-    std::shared_ptr<MessageHandler> GetHandler(const tg::TelegramApiMessage& message) const {
-        for (auto& handler : handlers_) {
-            if (handler->matches(message)) {
-                return handler;
+    // One hash lookup by the command of the message, whatever the number of commands,
+    // then the handlers without a command in the order they were added. The triggers of
+    // all of them are matched in a single pass over the text, so only the handlers
+    // without triggers added before the first triggered one are asked with matches().
+    // Commands for other bots, like /random@other_bot, are ignored.
+    MessageHandler& GetHandler(const tg::TelegramApiMessage& message) const {
+        if (auto command = ParseCommand(message); command && !command->name.empty()) {
+            if (!command->bot.empty() && !IsThisBot(command->bot)) {
+                return *ignore_handler_;
+            }
+            if (auto chain = commands_.find(command->name); chain != commands_.end()) {
+                for (auto handler : chain->second) {
+                    if (handler->matches(message)) {
+                        return *handler;
+                    }
+                }
+            }
+        }
+
+        auto triggered = fallback_.size();
+        if (triggers_ && message.text) {
+            std::call_once(triggers_compiled_, [this] { CompileTriggers(); });
+            thread_local std::vector<int> matched;
+            if (triggers_->Match(*message.text, &matched)) {
+                for (auto pattern : matched) {
+                    triggered = std::min(triggered, trigger_handlers_[pattern]);
+                }
+            }
+        }
+        for (auto position : untriggered_) {
+            if (position > triggered) {
+                break;
             }
+            if (fallback_[position]->matches(message)) {
+                return *fallback_[position];
+            }
+        }
+        return triggered < fallback_.size() ? *fallback_[triggered] : *default_handler_;
+    }
+
+    // Handlers with a command are tried before the others, those of one command in the
+    // order they were added, so a later one can take what the earlier ones don't match.
+    // The rest are matched in order, before the default handler. Not thread-safe, add
+    // handlers before the bot starts. Throws std::invalid_argument for a malformed
+    // trigger.
+    void AddHandler(std::shared_ptr<MessageHandler> handler) {
+        auto command = handler->Command();
+        if (!command.empty()) {
+            commands_[command].push_back(handler.get());
+            handlers_.push_back(std::move(handler));
+            return;
+        }
+
+        auto triggers = handler->Triggers();
+        if (triggers.empty()) {
+            untriggered_.push_back(fallback_.size());
+        } else {
+            AddTriggers(triggers);
         }
-        return default_handler_;
+        fallback_.push_back(handler.get());
+        handlers_.push_back(std::move(handler));
+    }
+
+#if defined(__cpp_impl_coroutine)
+    // Loop of the coroutine handlers, started on first use.
+    std::shared_ptr<EventLoop> Loop() {
+        if (!loop_) {
+            loop_ = std::make_shared<EventLoop>(kLoopThreads);
+        }
+        return loop_;
+    }
+#endif
+
+    // Blocks until the started coroutine handlers have finished.
+    void Drain() {
+#if defined(__cpp_impl_coroutine)
+        if (loop_) {
+            loop_->Drain();
+        }
+#endif
     }
 
     ~MessageHandlerFactory() {
+        commands_.clear();
+        fallback_.clear();
+        triggers_.reset();
         handlers_.clear();
         default_handler_.reset();
+        ignore_handler_.reset();
     }
 
 private:
+    // Usernames are case-insensitive. Without a username from getMe the command is
+    // taken for ours, answering it beats dropping it.
+    bool IsThisBot(std::string_view bot) const {
+        try {
+            return EqualsIgnoreCase(bot, api_->Username());
+        } catch (const std::exception& error) {
+            logger::LoggerFactory::GetDefaultLogger()->LogError("Can't get the bot username: ",
+                                                                error.what());
+            return true;
+        }
+    }
+
+    static RE2::Options TriggerOptions() {
+        RE2::Options options;
+        options.set_log_errors(false);
+        options.set_max_mem(kTriggerMemory);
+        return options;
+    }
+
+    // The triggers are added to the set of the next handler in fallback_. They are all
+    // checked on a scratch set first, a handler with a malformed one adds none.
+    void AddTriggers(const std::vector<std::string>& triggers) {
+        if (triggers_frozen_) {
+            throw std::logic_error("Triggers added after the first message");
+        }
+        RE2::Set scratch(TriggerOptions(), RE2::UNANCHORED);
+        for (const auto& trigger : triggers) {
+            std::string error;
+            if (scratch.Add(trigger, &error) < 0) {
+                throw std::invalid_argument("Invalid trigger " + trigger + ": " + error);
+            }
+        }
+
+        if (!triggers_) {
+            triggers_ = std::make_unique<RE2::Set>(TriggerOptions(), RE2::UNANCHORED);
+        }
+        for (const auto& trigger : triggers) {
+            triggers_->Add(trigger, nullptr);
+            trigger_handlers_.push_back(fallback_.size());
+        }
+    }
+
+    void CompileTriggers() const {
+        triggers_frozen_ = true;
+        if (!triggers_->Compile()) {
+            throw std::runtime_error("Out of memory compiling the handler triggers");
+        }
+    }
+
+private:
+    // The automaton of a thousand triggers needs more than the default 8 MiB.
+    static constexpr int64_t kTriggerMemory = 64 << 20;
+
+    // Owns the handlers, the lookup structures point into it.
     std::vector<std::shared_ptr<MessageHandler>> handlers_;
+    // Keys view the Command() of handlers in handlers_. Usually one handler a command.
+    std::unordered_map<std::string_view, std::vector<MessageHandler*>> commands_;
+    // Handlers without a command, in order, and the positions of those without triggers.
+    std::vector<MessageHandler*> fallback_;
+    std::vector<size_t> untriggered_;
+    // Compiled on the first message, then only read.
+    std::unique_ptr<RE2::Set> triggers_;
+    // Position in fallback_ of the handler of each trigger.
+    std::vector<size_t> trigger_handlers_;
+    mutable std::once_flag triggers_compiled_;
+    // No triggers can be added to a compiled set.
+    mutable bool triggers_frozen_{false};
     std::shared_ptr<MessageHandler> default_handler_;
+    std::shared_ptr<MessageHandler> ignore_handler_;
+    std::shared_ptr<tg::TelegramApi> api_;
+#if defined(__cpp_impl_coroutine)
+    static constexpr size_t kLoopThreads = 2;
+    std::shared_ptr<EventLoop> loop_;
+#endif
 };
 
 #endif  // MESSAGE_HANDLERS_H
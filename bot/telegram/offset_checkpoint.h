@@ -0,0 +1,211 @@
+#ifndef OFFSET_CHECKPOINT_H
+#define OFFSET_CHECKPOINT_H
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+enum class CheckpointMode {
+    // Commit after every update, the most durable and the slowest.
+    EveryUpdate,
+    // Commit once per getUpdates batch.
+    EveryBatch,
+    // Commit at the next update or batch boundary after interval has passed since the
+    // last commit.
+    Interval
+};
+
+struct CheckpointConfig {
+    CheckpointMode mode{CheckpointMode::EveryBatch};
+    // Shortest time between commits in Interval mode. A new offset reaches the disk at
+    // the next batch boundary after interval, or on Flush if the bot goes idle.
+    std::chrono::milliseconds interval{1000};
+    // fsync every commit. Without it a commit survives a crash of the bot but not
+    // necessarily a power loss.
+    bool sync{true};
+};
+
+// Persists the id of the last acknowledged update. Commits are grouped according to
+// CheckpointMode and are atomic: the new value goes to a temporary file that is
+// renamed over the old one, so a crash mid-write never leaves a torn file. Safe to
+// use from several threads.
+class OffsetCheckpoint {
+public:
+    OffsetCheckpoint(const std::string& path, const CheckpointConfig& config)
+        : path_{path}, config_{config} {
+        std::ifstream in(path_, std::ios::in);
+        int64_t current;
+        if (in.is_open() && in >> current) {
+            last_update_id_ = committed_ = current;
+        }
+    }
+
+    std::optional<int64_t> LastUpdateId() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return last_update_id_;
+    }
+
+    // Marks update_id and everything before it as acknowledged. Throws
+    // std::system_error if a commit is due and fails.
+    void Advance(int64_t update_id) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (last_update_id_ && last_update_id_.value() >= update_id) {
+            return;
+        }
+        last_update_id_ = update_id;
+        if (config_.mode == CheckpointMode::EveryUpdate || IntervalElapsed()) {
+            Commit();
+        }
+    }
+
+    void EndBatch() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (config_.mode == CheckpointMode::EveryBatch || IntervalElapsed()) {
+            Commit();
+        }
+    }
+
+    // Commits whatever is pending regardless of the mode.
+    void Flush() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        Commit();
+    }
+
+private:
+    bool IntervalElapsed() const {
+        return config_.mode == CheckpointMode::Interval &&
+               std::chrono::steady_clock::now() - last_commit_ >= config_.interval;
+    }
+
+    void Commit() {
+        if (!last_update_id_ || last_update_id_ == committed_) {
+            return;
+        }
+        auto tmp_path = path_ + ".tmp";
+        auto data = std::to_string(last_update_id_.value()) + "\n";
+
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + tmp_path);
+        }
+        auto written = ::write(fd, data.data(), data.size());
+        // A short write sets no errno.
+        int saved_errno = written < 0 ? errno : EIO;
+        bool ok = written == static_cast<ssize_t>(data.size());
+        if (ok && config_.sync && ::fsync(fd) != 0) {
+            ok = false;
+            saved_errno = errno;
+        }
+        ::close(fd);
+        if (!ok) {
+            throw std::system_error(saved_errno, std::generic_category(), "write " + tmp_path);
+        }
+        if (std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "rename " + tmp_path);
+        }
+        if (config_.sync) {
+            SyncDirectory();
+        }
+
+        committed_ = last_update_id_;
+        last_commit_ = std::chrono::steady_clock::now();
+    }
+
+    // Makes the rename itself durable.
+    void SyncDirectory() const {
+        auto slash = path_.find_last_of('/');
+        auto dir = slash == std::string::npos ? std::string(".") : path_.substr(0, slash + 1);
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+private:
+    const std::string path_;
+    const CheckpointConfig config_;
+    mutable std::mutex mutex_;
+    std::optional<int64_t> last_update_id_;
+    std::optional<int64_t> committed_;
+    std::chrono::steady_clock::time_point last_commit_{};
+};
+
+// Updates taken for handling on other threads and not handled yet. They may finish in
+// any order, the tracker tells the last id up to which all are handled: the offset
+// that can be committed without skipping an update a crash would leave unhandled.
+// Safe to use from several threads.
+class UpdateTracker {
+public:
+    // Everything up to last_handled was handled before, like a committed offset.
+    explicit UpdateTracker(std::optional<int64_t> last_handled = {})
+        : handled_{last_handled}, highest_{last_handled} {
+    }
+
+    // Returns false for an update taken before, which a poll from the handled prefix
+    // returns again.
+    bool Take(int64_t update_id) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (highest_ && update_id <= highest_.value()) {
+            return false;
+        }
+        highest_ = update_id;
+        taken_.insert(update_id);
+        return true;
+    }
+
+    // Marks a taken update handled. Returns the last id up to which all are handled
+    // if that moved.
+    std::optional<int64_t> Done(int64_t update_id) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        taken_.erase(update_id);
+        auto handled = taken_.empty() ? highest_ : *taken_.begin() - 1;
+        if (handled == handled_) {
+            return std::nullopt;
+        }
+        handled_ = handled;
+        progress_.notify_all();
+        return handled;
+    }
+
+    std::optional<int64_t> LastHandled() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return handled_;
+    }
+
+    // Blocks until update_id and everything before it is handled, or until Interrupt.
+    void WaitUntilHandled(int64_t update_id) {
+        std::unique_lock<std::mutex> guard(mutex_);
+        progress_.wait(guard, [&] {
+            return interrupted_ || (handled_ && handled_.value() >= update_id);
+        });
+    }
+
+    // Ends the waits for good, for a shutdown.
+    void Interrupt() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        interrupted_ = true;
+        progress_.notify_all();
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable progress_;
+    std::set<int64_t> taken_;
+    std::optional<int64_t> handled_;
+    std::optional<int64_t> highest_;
+    bool interrupted_{false};
+};
+
+#endif  // OFFSET_CHECKPOINT_H
@@ -0,0 +1,345 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// epoll is Linux only, elsewhere the bot keeps to the blocking transport.
+#if defined(__linux__)
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Single-threaded event loop: runs the completions of socket operations, due timers
+// and callbacks posted from other threads, all on the thread in Run(). Only Post and
+// Stop may be called from other threads. The I/O engine behind it is a subclass.
+class IoLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+    using TimerId = uint64_t;
+    // Result of the system call: bytes transferred or 0, or -errno.
+    using Completion = std::function<void(int)>;
+    // Also gets the received bytes, in a buffer of the loop valid during the call.
+    using ReceiveCompletion = std::function<void(int, const char*)>;
+
+    IoLoop() = default;
+    IoLoop(const IoLoop&) = delete;
+    IoLoop& operator=(const IoLoop&) = delete;
+    virtual ~IoLoop() = default;
+
+    // Socket operations on non-blocking descriptors, which stay owned by the caller. A
+    // descriptor has at most one connect or send and one receive pending. Completions
+    // never run inside the call that starts the operation. Memory passed in must stay
+    // valid until the completion runs or the descriptor is closed.
+    virtual void Connect(int fd, const sockaddr* address, socklen_t length, Completion done) = 0;
+    // May send only a part of data, like send(2).
+    virtual void Send(int fd, const char* data, size_t size, Completion done) = 0;
+    virtual void Receive(int fd, ReceiveCompletion done) = 0;
+    // Closes fd. Completions of its pending operations are not run.
+    virtual void Close(int fd) = 0;
+
+    TimerId RunAt(Clock::time_point at, Callback callback) {
+        auto id = ++last_timer_;
+        timers_.emplace(std::make_pair(at, id), std::move(callback));
+        timer_deadlines_.emplace(id, at);
+        return id;
+    }
+
+    TimerId RunAfter(Clock::duration delay, Callback callback) {
+        return RunAt(Clock::now() + delay, std::move(callback));
+    }
+
+    // Does nothing if the timer already ran.
+    void Cancel(TimerId id) {
+        auto it = timer_deadlines_.find(id);
+        if (it != timer_deadlines_.end()) {
+            timers_.erase(std::make_pair(it->second, id));
+            timer_deadlines_.erase(it);
+        }
+    }
+
+    // Runs callback on the loop thread. Safe to call from any thread.
+    void Post(Callback callback) {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            posted_.push_back(std::move(callback));
+        }
+        Wake();
+    }
+
+    // Returns after Stop, callbacks posted before it have run.
+    void Run() {
+        loop_thread_ = std::this_thread::get_id();
+        while (!stopping_) {
+            Wait(WaitTimeout());
+            RunTimers();
+            RunPosted();
+        }
+        RunPosted();
+    }
+
+    // Safe to call from any thread.
+    void Stop() {
+        stopping_ = true;
+        Wake();
+    }
+
+    bool InLoopThread() const {
+        return std::this_thread::get_id() == loop_thread_;
+    }
+
+protected:
+    // Waits up to timeout_ms, -1 for no limit, for I/O or a wakeup and runs the
+    // completions.
+    virtual void Wait(int timeout_ms) = 0;
+    // Makes a running Wait return. Safe to call from any thread.
+    virtual void Wake() = 0;
+
+private:
+    // Milliseconds until the next timer, rounded up so that it is due on wakeup.
+    int WaitTimeout() {
+        if (timers_.empty()) {
+            return -1;
+        }
+        auto left = timers_.begin()->first.first - Clock::now();
+        if (left <= Clock::duration::zero()) {
+            return 0;
+        }
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+
+    void RunTimers() {
+        auto now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first.first <= now) {
+            auto callback = std::move(timers_.begin()->second);
+            timer_deadlines_.erase(timers_.begin()->first.second);
+            timers_.erase(timers_.begin());
+            callback();
+        }
+    }
+
+    void RunPosted() {
+        std::vector<Callback> posted;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            posted.swap(posted_);
+        }
+        for (auto& callback : posted) {
+            callback();
+        }
+    }
+
+private:
+    std::atomic<bool> stopping_{false};
+    std::atomic<std::thread::id> loop_thread_;
+    TimerId last_timer_{0};
+    std::map<std::pair<Clock::time_point, TimerId>, Callback> timers_;
+    std::unordered_map<TimerId, Clock::time_point> timer_deadlines_;
+    std::mutex mutex_;
+    std::vector<Callback> posted_;
+};
+
+// IoLoop over epoll: operations wait for readiness and then make the system call.
+class Reactor : public IoLoop {
+public:
+    Reactor()
+        : epoll_{epoll_create1(EPOLL_CLOEXEC)}, wakeup_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+        if (epoll_ < 0 || wakeup_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "can't create reactor");
+        }
+        Control(EPOLL_CTL_ADD, wakeup_, EPOLLIN);
+    }
+
+    ~Reactor() override {
+        close(wakeup_);
+        close(epoll_);
+    }
+
+    void Connect(int fd, const sockaddr* address, socklen_t length, Completion done) override {
+        auto& descriptor = descriptors_[fd];
+        // The result, or EINPROGRESS, is picked up once the socket turns writable.
+        descriptor.connect_error = connect(fd, address, length) < 0 ? errno : 0;
+        descriptor.connect = std::move(done);
+        Update(fd, descriptor);
+    }
+
+    void Send(int fd, const char* data, size_t size, Completion done) override {
+        auto& descriptor = descriptors_[fd];
+        descriptor.send = std::move(done);
+        descriptor.send_data = data;
+        descriptor.send_size = size;
+        Update(fd, descriptor);
+    }
+
+    void Receive(int fd, ReceiveCompletion done) override {
+        auto& descriptor = descriptors_[fd];
+        descriptor.receive = std::move(done);
+        Update(fd, descriptor);
+    }
+
+    void Close(int fd) override {
+        if (descriptors_.erase(fd)) {
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        close(fd);
+    }
+
+protected:
+    void Wait(int timeout_ms) override {
+        epoll_event events[kMaxEvents];
+        auto count = epoll_wait(epoll_, events, kMaxEvents, timeout_ms);
+        if (count < 0 && errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+        }
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == wakeup_) {
+                uint64_t value;
+                while (read(wakeup_, &value, sizeof(value)) > 0) {
+                }
+            } else {
+                Dispatch(events[i].data.fd, events[i].events);
+            }
+        }
+    }
+
+    void Wake() override {
+        uint64_t one = 1;
+        [[maybe_unused]] auto written = write(wakeup_, &one, sizeof(one));
+    }
+
+private:
+    static constexpr int kMaxEvents = 256;
+    static constexpr size_t kReceiveBuffer = 64 * 1024;
+
+    struct Descriptor {
+        bool registered{false};
+        uint32_t events{0};
+        Completion connect;
+        int connect_error{0};
+        Completion send;
+        const char* send_data{nullptr};
+        size_t send_size{0};
+        ReceiveCompletion receive;
+    };
+
+    // Waits for exactly the readiness the pending operations need.
+    void Update(int fd, Descriptor& descriptor) {
+        uint32_t events = 0;
+        if (descriptor.connect || descriptor.send) {
+            events |= EPOLLOUT;
+        }
+        if (descriptor.receive) {
+            events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (descriptor.registered && events == descriptor.events) {
+            return;
+        }
+        Control(descriptor.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, events);
+        descriptor.registered = true;
+        descriptor.events = events;
+    }
+
+    // Completions may close fd or start new operations on it, so the descriptor is
+    // looked up again after each one.
+    void Dispatch(int fd, uint32_t events) {
+        auto failed = (events & (EPOLLERR | EPOLLHUP)) != 0;
+        auto descriptor = Find(fd);
+        if (descriptor && descriptor->connect && (failed || (events & EPOLLOUT))) {
+            auto error = descriptor->connect_error;
+            if (error == EINPROGRESS) {
+                socklen_t length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            }
+            auto done = std::move(descriptor->connect);
+            descriptor->connect = nullptr;
+            done(-error);
+            descriptor = Find(fd);
+        }
+        if (descriptor && descriptor->send && (failed || (events & EPOLLOUT))) {
+            auto sent = send(fd, descriptor->send_data, descriptor->send_size, MSG_NOSIGNAL);
+            if (sent >= 0 || (errno != EAGAIN && errno != EINTR)) {
+                auto done = std::move(descriptor->send);
+                descriptor->send = nullptr;
+                done(sent < 0 ? -errno : static_cast<int>(sent));
+                descriptor = Find(fd);
+            }
+        }
+        if (descriptor && descriptor->receive && (failed || (events & (EPOLLIN | EPOLLRDHUP)))) {
+            auto received = recv(fd, buffer_, sizeof(buffer_), 0);
+            if (received >= 0 || (errno != EAGAIN && errno != EINTR)) {
+                auto done = std::move(descriptor->receive);
+                descriptor->receive = nullptr;
+                done(received < 0 ? -errno : static_cast<int>(received), buffer_);
+                descriptor = Find(fd);
+            }
+        }
+        if (descriptor) {
+            Update(fd, *descriptor);
+        }
+    }
+
+    Descriptor* Find(int fd) {
+        auto it = descriptors_.find(fd);
+        return it == descriptors_.end() ? nullptr : &it->second;
+    }
+
+    void Control(int operation, int fd, uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_, operation, fd, &event) < 0) {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        }
+    }
+
+private:
+    const int epoll_;
+    const int wakeup_;
+    std::unordered_map<int, Descriptor> descriptors_;
+    char buffer_[kReceiveBuffer];
+};
+
+// Runs a loop on a thread of its own.
+class IoThread {
+public:
+    explicit IoThread(std::unique_ptr<IoLoop> loop)
+        : loop_{std::move(loop)}, thread_{[this] { loop_->Run(); }} {
+    }
+
+    ~IoThread() {
+        Stop();
+    }
+
+    IoLoop& Get() {
+        return *loop_;
+    }
+
+    void Stop() {
+        loop_->Stop();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+private:
+    std::unique_ptr<IoLoop> loop_;
+    std::thread thread_;
+};
+
+#endif  // __linux__
+
+#endif  // REACTOR_H
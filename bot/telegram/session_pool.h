@@ -0,0 +1,258 @@
+#ifndef SESSION_POOL_H
+#define SESSION_POOL_H
+
+#include "network_mode.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Poco/Net/HTTPClientSession.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/Timespan.h>
+#include <Poco/URI.h>
+
+namespace tg {
+
+struct SessionPoolConfig {
+    // Idle keep-alive sessions kept per host, extra ones are closed on release.
+    size_t max_idle_per_host{8};
+    // Sessions that were idle for longer are closed instead of being reused.
+    std::chrono::seconds max_idle_time{30};
+    // Socket send/receive timeout of a single request.
+    std::chrono::seconds request_timeout{60};
+};
+
+// Keeps persistent HTTP/1.1 sessions per host so that consecutive requests skip
+// the TCP connect and TLS handshake. Safe to use from several threads.
+class SessionPool {
+public:
+    using Clock = std::chrono::steady_clock;
+    using SessionPtr = std::unique_ptr<Poco::Net::HTTPClientSession>;
+
+    // Exclusive ownership of one session for the duration of a request. The session
+    // goes back to the pool only after Release(), otherwise it is closed: a request
+    // that failed halfway leaves the connection in an unknown state.
+    class Lease {
+    public:
+        Lease(SessionPool *pool, std::string key, SessionPtr session, bool reused)
+            : pool_{pool}, key_{std::move(key)}, session_{std::move(session)}, reused_{reused} {
+        }
+
+        Lease(Lease &&other) = default;
+        Lease &operator=(Lease &&other) = default;
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        Poco::Net::HTTPClientSession *operator->() const {
+            return session_.get();
+        }
+
+        Poco::Net::HTTPClientSession &operator*() const {
+            return *session_;
+        }
+
+        // True if the session already served requests before, so its connection may
+        // have been closed by the server in the meantime.
+        bool IsReused() const {
+            return reused_;
+        }
+
+        // Call only after the response body was read to the end.
+        void Release() {
+            if (session_) {
+                pool_->Return(key_, std::move(session_));
+            }
+        }
+
+    private:
+        SessionPool *pool_;
+        std::string key_;
+        SessionPtr session_;
+        bool reused_;
+    };
+
+    SessionPool(NetworkMode mode, const SessionPoolConfig &config = {})
+        : mode_{mode}, config_{config} {
+    }
+
+    // server_wait is how long the server may legitimately hold the request before
+    // answering (long polling), it is added to the socket timeout.
+    Lease Acquire(const Poco::URI &uri, std::chrono::seconds server_wait = {}) {
+        auto key = uri.getHost() + ":" + std::to_string(uri.getPort());
+        auto timeout = Poco::Timespan((config_.request_timeout + server_wait).count(), 0);
+        auto now = Clock::now();
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            auto &idle = idle_[key];
+            while (!idle.empty()) {
+                auto entry = std::move(idle.back());
+                idle.pop_back();
+                if (now - entry.released_at <= config_.max_idle_time) {
+                    entry.session->setTimeout(timeout);
+                    return Lease(this, std::move(key), std::move(entry.session), true);
+                }
+            }
+        }
+        auto session = MakeSession(uri);
+        session->setTimeout(timeout);
+        return Lease(this, std::move(key), std::move(session), false);
+    }
+
+    size_t IdleCount() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        size_t count = 0;
+        for (const auto &[key, idle] : idle_) {
+            count += idle.size();
+        }
+        return count;
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        idle_.clear();
+    }
+
+private:
+    struct IdleSession {
+        SessionPtr session;
+        Clock::time_point released_at;
+    };
+
+    void Return(const std::string &key, SessionPtr session) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto &idle = idle_[key];
+        // Oldest sessions sit at the front and are the first to expire.
+        while (!idle.empty() && now - idle.front().released_at > config_.max_idle_time) {
+            idle.erase(idle.begin());
+        }
+        if (idle.size() < config_.max_idle_per_host) {
+            idle.push_back(IdleSession{std::move(session), now});
+        }
+    }
+
+    SessionPtr MakeSession(const Poco::URI &uri) const {
+        SessionPtr session;
+        if (mode_ == NetworkMode::HTTP) {
+            session = std::make_unique<Poco::Net::HTTPClientSession>(uri.getHost(), uri.getPort());
+        } else {
+            session = std::make_unique<Poco::Net::HTTPSClientSession>(uri.getHost(), uri.getPort());
+        }
+        session->setKeepAlive(true);
+        session->setKeepAliveTimeout(Poco::Timespan(config_.max_idle_time.count(), 0));
+        return session;
+    }
+
+private:
+    const NetworkMode mode_;
+    const SessionPoolConfig config_;
+    mutable std::mutex mutex_;
+    std::map<std::string, std::vector<IdleSession>> idle_;
+};
+
+// Poco requests of one method with the request line and headers already set, for the
+// requests over pooled sessions. A request serves one exchange at a time and is kept
+// for the next, so only its target and content length change per request. Safe to use
+// from several threads.
+class RequestPool {
+public:
+    using RequestPtr = std::unique_ptr<Poco::Net::HTTPRequest>;
+
+    // A request of the pool, which gets it back when the lease ends.
+    class Lease {
+    public:
+        Lease(RequestPool *pool, RequestPtr request)
+            : pool_{pool}, request_{std::move(request)} {
+        }
+
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        ~Lease() {
+            pool_->Return(std::move(request_));
+        }
+
+        Poco::Net::HTTPRequest &operator*() const {
+            return *request_;
+        }
+
+        Poco::Net::HTTPRequest *operator->() const {
+            return request_.get();
+        }
+
+    private:
+        RequestPool *pool_;
+        RequestPtr request_;
+    };
+
+    RequestPool(std::string method, std::string path, std::string content_type = {})
+        : method_{std::move(method)},
+          path_{std::move(path)},
+          content_type_{std::move(content_type)} {
+    }
+
+    // The request for target, with the content length of a body of body_size if it
+    // has one. POSTs always have.
+    Lease Acquire(const std::string &target, size_t body_size) {
+        RequestPtr request;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (!idle_.empty()) {
+                request = std::move(idle_.back());
+                idle_.pop_back();
+            }
+        }
+        if (!request) {
+            request = Make();
+        }
+        if (request->getURI() != target) {
+            request->setURI(target);
+        }
+        if (body_size != 0 || method_ == Poco::Net::HTTPRequest::HTTP_POST) {
+            request->setContentLength(body_size);
+        }
+        return Lease(this, std::move(request));
+    }
+
+    const std::string &Path() const {
+        return path_;
+    }
+
+private:
+    // More than the threads that send at once, extra requests are dropped on return.
+    static constexpr size_t kMaxIdle = 16;
+
+    RequestPtr Make() const {
+        auto request = std::make_unique<Poco::Net::HTTPRequest>(method_, path_,
+                                                                Poco::Net::HTTPMessage::HTTP_1_1);
+        if (!content_type_.empty()) {
+            request->setContentType(content_type_);
+        }
+        request->setKeepAlive(true);
+        return request;
+    }
+
+    void Return(RequestPtr request) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (idle_.size() < kMaxIdle) {
+            idle_.push_back(std::move(request));
+        }
+    }
+
+private:
+    const std::string method_;
+    const std::string path_;
+    const std::string content_type_;
+    std::mutex mutex_;
+    std::vector<RequestPtr> idle_;
+};
+
+}  // namespace tg
+
+#endif  // SESSION_POOL_H
@@ -0,0 +1,281 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Signals asking a process to shut down cleanly.
+inline sigset_t ShutdownSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    return signals;
+}
+
+// Turns SIGTERM and SIGINT into a call from a thread of its own, so that the process
+// can finish what it has taken before exiting.
+class ShutdownSignalWatcher {
+public:
+    // Blocks the signals in the calling thread and the threads it starts later, so
+    // create the watcher before starting any.
+    ShutdownSignalWatcher() {
+        auto signals = ShutdownSignals();
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    ShutdownSignalWatcher(const ShutdownSignalWatcher&) = delete;
+    ShutdownSignalWatcher& operator=(const ShutdownSignalWatcher&) = delete;
+
+    ~ShutdownSignalWatcher() {
+        Stop();
+    }
+
+    // Calls on_signal for every signal until Stop.
+    void Watch(std::function<void()> on_signal) {
+        thread_ = std::thread([this, on_signal = std::move(on_signal)] {
+            auto signals = ShutdownSignals();
+            int number = 0;
+            while (sigwait(&signals, &number) == 0 && !done_) {
+                on_signal();
+            }
+        });
+    }
+
+    // Returns once on_signal can no longer be called.
+    void Stop() {
+        if (thread_.joinable()) {
+            done_ = true;
+            pthread_kill(thread_.native_handle(), SIGTERM);
+            thread_.join();
+        }
+    }
+
+private:
+    std::atomic<bool> done_{false};
+    std::thread thread_;
+};
+
+struct RestartPolicy {
+    // Wait before the first restart of a worker, doubled for each failure in a row up
+    // to max_delay.
+    std::chrono::milliseconds delay{std::chrono::seconds(1)};
+    std::chrono::milliseconds max_delay{std::chrono::minutes(1)};
+    // A worker that ran at least this long before failing starts a new row.
+    std::chrono::milliseconds stable_run{std::chrono::minutes(1)};
+    // Failures in a row, each before stable_run, after which the supervisor gives up.
+    int max_failures{5};
+    // Exit status of a crash on request, the -1 BotServer exits with on /crash. Any
+    // user may send that, so it is restarted after delay and not counted.
+    int requested_crash_status{255};
+};
+
+// Keeps a number of worker processes running, each forked from the calling process to
+// run run_worker(index) and exit with its result. A worker that exits with a non-zero
+// status or is killed by a signal is replaced after a delay growing with its failures
+// in a row, one that crashed on request, like on /crash, after the base delay. One
+// that keeps failing soon after it starts, like with a bad token or a port in use,
+// won't do better: the supervisor stops the others and Run returns EXIT_FAILURE. A
+// worker that exits with zero asked the bot to stop: the others get SIGTERM, as they
+// do when the supervisor gets SIGTERM or SIGINT, and Run returns once all have exited.
+// Fork before starting any thread, a child only gets the forking one.
+class Supervisor {
+public:
+    using Worker = std::function<int(size_t index)>;
+
+    Supervisor(size_t workers, Worker run_worker, RestartPolicy policy = {})
+        : workers_{workers},
+          run_worker_{std::move(run_worker)},
+          policy_{policy},
+          failures_(workers),
+          logger_{logger::LoggerFactory::GetDefaultLogger()} {
+    }
+
+    // Returns the exit status for the supervisor process.
+    int Run() {
+        // Delivered through sigtimedwait instead of handlers.
+        auto signals = ShutdownSignals();
+        sigaddset(&signals, SIGCHLD);
+        sigset_t previous;
+        pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+        for (size_t index = 0; index < workers_; ++index) {
+            Spawn(index, previous);
+        }
+        while (!running_.empty() || (!stopping_ && !restarts_.empty())) {
+            auto number = WaitForSignal(signals);
+            if (number == SIGCHLD) {
+                Reap();
+            } else if (number == SIGTERM || number == SIGINT) {
+                logger_->LogInfo("Supervisor got signal ", number, ", stopping workers");
+                StopAll();
+            }
+            if (!stopping_) {
+                RestartDue(previous);
+            }
+        }
+
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+        return gave_up_ ? EXIT_FAILURE : 0;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Running {
+        size_t index;
+        Clock::time_point started;
+    };
+
+    void Spawn(size_t index, const sigset_t& mask) {
+        // Buffered output would otherwise be written by both processes.
+        logger_->Flush();
+        auto pid = fork();
+        if (pid < 0) {
+            throw std::system_error(errno, std::generic_category(), "fork");
+        }
+        if (pid == 0) {
+            pthread_sigmask(SIG_SETMASK, &mask, nullptr);
+            int status = EXIT_FAILURE;
+            try {
+                status = run_worker_(index);
+            } catch (const std::exception& error) {
+                logger_->LogError("Worker ", index, " failed: ", error.what());
+            }
+            // Skips the destructors of the state copied from the supervisor.
+            logger_->Flush();
+            _exit(status);
+        }
+        logger_->LogInfo("Started worker ", index, " as process ", pid);
+        running_.emplace(pid, Running{index, Clock::now()});
+    }
+
+    // The next shutdown signal or SIGCHLD, 0 once a restart is due.
+    int WaitForSignal(const sigset_t& signals) {
+        timespec timeout{};
+        timespec* wait_for = nullptr;
+        if (!stopping_ && !restarts_.empty()) {
+            auto left =
+                std::max(restarts_.begin()->first - Clock::now(), Clock::duration::zero());
+            auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+            timeout.tv_sec = nanoseconds / 1000000000;
+            timeout.tv_nsec = nanoseconds % 1000000000;
+            wait_for = &timeout;
+        }
+        auto number = sigtimedwait(&signals, nullptr, wait_for);
+        if (number < 0 && errno != EAGAIN && errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "sigtimedwait");
+        }
+        return number < 0 ? 0 : number;
+    }
+
+    // SIGCHLD is not queued, one may stand for several exits.
+    void Reap() {
+        int status = 0;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto worker = running_.find(pid);
+            if (worker == running_.end()) {
+                continue;
+            }
+            auto [index, started] = worker->second;
+            running_.erase(worker);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                logger_->LogInfo("Worker ", index, " stopped");
+                StopAll();
+            } else if (stopping_) {
+                continue;
+            } else if (WIFEXITED(status) &&
+                       WEXITSTATUS(status) == policy_.requested_crash_status) {
+                logger_->LogInfo("Worker ", index, " crashed on request, restarting in ",
+                                 policy_.delay.count(), " ms");
+                restarts_.emplace(Clock::now() + policy_.delay, index);
+            } else {
+                OnFailure(index, started, status);
+            }
+        }
+    }
+
+    void OnFailure(size_t index, Clock::time_point started, int status) {
+        auto now = Clock::now();
+        auto& failures = failures_[index];
+        failures = now - started >= policy_.stable_run ? 1 : failures + 1;
+        if (failures >= policy_.max_failures) {
+            logger_->LogError("Worker ", index, " died with ", Describe(status), ", ",
+                              failures, " times in a row, giving up");
+            gave_up_ = true;
+            StopAll();
+            return;
+        }
+
+        auto delay = policy_.delay;
+        for (int doubled = 1; doubled < failures && delay < policy_.max_delay; ++doubled) {
+            delay *= 2;
+        }
+        delay = std::min(delay, policy_.max_delay);
+        logger_->LogError("Worker ", index, " died with ", Describe(status), ", restarting in ",
+                          delay.count(), " ms");
+        restarts_.emplace(now + delay, index);
+    }
+
+    void RestartDue(const sigset_t& mask) {
+        auto now = Clock::now();
+        while (!restarts_.empty() && restarts_.begin()->first <= now) {
+            auto index = restarts_.begin()->second;
+            restarts_.erase(restarts_.begin());
+            Spawn(index, mask);
+        }
+    }
+
+    void StopAll() {
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+        restarts_.clear();
+        for (const auto& worker : running_) {
+            kill(worker.first, SIGTERM);
+        }
+    }
+
+    static std::string Describe(int status) {
+        if (WIFSIGNALED(status)) {
+            return "signal " + std::to_string(WTERMSIG(status));
+        }
+        return "status " + std::to_string(WEXITSTATUS(status));
+    }
+
+private:
+    const size_t workers_;
+    const Worker run_worker_;
+    const RestartPolicy policy_;
+    // Failures in a row of each worker.
+    std::vector<int> failures_;
+    std::shared_ptr<logger::Logger> logger_;
+    bool stopping_{false};
+    bool gave_up_{false};
+    std::map<pid_t, Running> running_;
+    std::multimap<Clock::time_point, size_t> restarts_;
+};
+
+#endif  // SUPERVISOR_H
@@ -0,0 +1,343 @@
+#ifndef TASK_H
+#define TASK_H
+
+// Coroutine handlers need C++20, the rest of the bot builds without them.
+#if defined(__cpp_impl_coroutine)
+
+#include "logger.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+    // Resumes whoever awaits the task once it is done.
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept {
+            auto continuation = self.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        error = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object();
+
+    template <typename U>
+    void return_value(U&& result) {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T Result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    void return_void() {
+    }
+
+    void Result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+}  // namespace detail
+
+// Lazily started coroutine: it runs when awaited, on the awaiting thread, and
+// resumes the awaiting coroutine when it returns. Exceptions reach the awaiter.
+template <typename T>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Task(Handle handle) : handle_{handle} {
+    }
+
+    Task(Task&& other) noexcept : handle_{std::exchange(other.handle_, {})} {
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    ~Task() {
+        Reset();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() {
+        return handle_.promise().Result();
+    }
+
+private:
+    void Reset() {
+        if (handle_) {
+            handle_.destroy();
+            handle_ = {};
+        }
+    }
+
+private:
+    Handle handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>{std::coroutine_handle<TaskPromise<T>>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>{std::coroutine_handle<TaskPromise<void>>::from_promise(*this)};
+}
+
+// Coroutine nobody awaits, it frees itself when done.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+}  // namespace detail
+
+// A few threads resuming coroutines. A coroutine waiting for an API call or any
+// other callback holds no thread, so many conversations can share the loop.
+class EventLoop {
+public:
+    explicit EventLoop(size_t threads) : logger_{logger::LoggerFactory::GetDefaultLogger()} {
+        for (size_t index = 0; index < std::max<size_t>(threads, 1); ++index) {
+            threads_.emplace_back([this] { Run(); });
+        }
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        Shutdown();
+    }
+
+    // co_await loop.Schedule() continues the coroutine on a loop thread.
+    auto Schedule() {
+        struct Awaiter {
+            EventLoop* loop;
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                loop->Post(handle);
+            }
+
+            void await_resume() const noexcept {
+            }
+        };
+        return Awaiter{this};
+    }
+
+    // Resumes the coroutine on a loop thread. Safe to call from any thread.
+    void Post(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        ready_.push_back(handle);
+        has_work_.notify_one();
+    }
+
+    // Runs the task on the loop without waiting for it. Its exceptions are logged.
+    void Spawn(Task<void> task) {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            ++running_;
+        }
+        RunDetached(std::move(task));
+    }
+
+    // Blocks until every spawned task has finished.
+    void Drain() {
+        std::unique_lock<std::mutex> guard(mutex_);
+        idle_.wait(guard, [this] { return running_ == 0; });
+    }
+
+    // Waits for the spawned tasks and joins the threads. A task that never
+    // completes blocks the shutdown.
+    void Shutdown() {
+        Drain();
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stopping_ = true;
+            has_work_.notify_all();
+        }
+        for (auto& thread : threads_) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+private:
+    detail::Detached RunDetached(Task<void> task) {
+        co_await Schedule();
+        try {
+            // Freed before the task counts as finished.
+            auto body = std::move(task);
+            co_await body;
+        } catch (const std::exception& error) {
+            logger_->LogError("Coroutine failed: ", error.what());
+        } catch (...) {
+            logger_->LogError("Coroutine failed");
+        }
+
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (--running_ == 0) {
+            idle_.notify_all();
+        }
+    }
+
+    void Run() {
+        while (true) {
+            std::coroutine_handle<> handle;
+            {
+                std::unique_lock<std::mutex> guard(mutex_);
+                has_work_.wait(guard, [this] { return stopping_ || !ready_.empty(); });
+                if (ready_.empty()) {
+                    return;
+                }
+                handle = ready_.front();
+                ready_.pop_front();
+            }
+            handle.resume();
+        }
+    }
+
+private:
+    std::shared_ptr<logger::Logger> logger_;
+    std::mutex mutex_;
+    std::condition_variable has_work_;
+    std::condition_variable idle_;
+    std::deque<std::coroutine_handle<>> ready_;
+    size_t running_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Awaits an operation that reports its result by passing a std::future to a
+// callback, like TelegramApi::SendMessageAsync, and continues on the loop.
+// start is called with the callback.
+template <typename T, typename Start>
+class CallbackAwaiter {
+public:
+    CallbackAwaiter(EventLoop& loop, Start start) : loop_{loop}, start_{std::move(start)} {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        // The callback may resume the coroutine, and so destroy this awaiter, before
+        // start returns.
+        auto start = std::move(start_);
+        start([this, handle](std::future<T> result) {
+            result_ = std::move(result);
+            loop_.Post(handle);
+        });
+    }
+
+    T await_resume() {
+        return result_.get();
+    }
+
+private:
+    EventLoop& loop_;
+    Start start_;
+    std::future<T> result_;
+};
+
+template <typename T, typename Start>
+CallbackAwaiter<T, Start> AwaitCallback(EventLoop& loop, Start start) {
+    return CallbackAwaiter<T, Start>(loop, std::move(start));
+}
+
+#endif  // __cpp_impl_coroutine
+
+#endif  // TASK_H
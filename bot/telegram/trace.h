@@ -0,0 +1,141 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Traffic trace of a bot: raw getUpdates replies and sendMessage bodies with the time
+// they were seen, for replaying real traffic against the fake server.
+//
+// File layout: the magic "TGTRACE1", then one record after another. A record is a
+// kind byte, the time since the previous record in microseconds and the payload
+// length, both as LEB128 varints, and the payload bytes.
+
+enum class TraceRecordKind : uint8_t { GetUpdatesReply = 1, SendMessageRequest = 2 };
+
+struct TraceRecord {
+    TraceRecordKind kind{TraceRecordKind::GetUpdatesReply};
+    // Since the first record.
+    std::chrono::microseconds time{0};
+    std::string payload;
+};
+
+class TraceError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+namespace trace_format {
+
+inline const std::string kMagic = "TGTRACE1";
+
+}  // namespace trace_format
+
+// Appends records to a trace file. Safe to use from several threads.
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path)
+        : out_{path, std::ios::out | std::ios::binary | std::ios::trunc} {
+        if (!out_.is_open()) {
+            throw TraceError("can't open trace file " + path);
+        }
+        out_ << trace_format::kMagic;
+    }
+
+    void Write(TraceRecordKind kind, std::string_view payload) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!last_) {
+            last_ = now;
+        }
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - *last_);
+        last_ = now;
+
+        out_.put(static_cast<char>(kind));
+        WriteVarint(delta.count());
+        WriteVarint(payload.size());
+        out_.write(payload.data(), payload.size());
+    }
+
+    void Flush() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        out_.flush();
+    }
+
+private:
+    void WriteVarint(uint64_t value) {
+        while (value >= 0x80) {
+            out_.put(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out_.put(static_cast<char>(value));
+    }
+
+private:
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::optional<std::chrono::steady_clock::time_point> last_;
+};
+
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path) : in_{path, std::ios::in | std::ios::binary} {
+        if (!in_.is_open()) {
+            throw TraceError("can't open trace file " + path);
+        }
+        std::string magic(trace_format::kMagic.size(), '\0');
+        if (!in_.read(magic.data(), magic.size()) || magic != trace_format::kMagic) {
+            throw TraceError(path + " is not a trace file");
+        }
+    }
+
+    // Returns nothing at the end of the trace, throws TraceError on a truncated one.
+    std::optional<TraceRecord> Next() {
+        auto kind = in_.get();
+        if (kind == std::char_traits<char>::eof()) {
+            return std::nullopt;
+        }
+        if (kind != static_cast<int>(TraceRecordKind::GetUpdatesReply) &&
+            kind != static_cast<int>(TraceRecordKind::SendMessageRequest)) {
+            throw TraceError("unknown trace record kind " + std::to_string(kind));
+        }
+
+        TraceRecord record;
+        record.kind = static_cast<TraceRecordKind>(kind);
+        time_ += std::chrono::microseconds(ReadVarint());
+        record.time = time_;
+        record.payload.resize(ReadVarint());
+        if (!in_.read(record.payload.data(), record.payload.size())) {
+            throw TraceError("truncated trace record");
+        }
+        return record;
+    }
+
+private:
+    uint64_t ReadVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = in_.get();
+            if (byte == std::char_traits<char>::eof()) {
+                throw TraceError("truncated trace record");
+            }
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw TraceError("malformed varint in trace");
+    }
+
+private:
+    std::ifstream in_;
+    std::chrono::microseconds time_{0};
+};
+
+#endif  // TRACE_H
@@ -0,0 +1,423 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "reactor.h"
+
+// Raw system calls instead of liburing, the kernel headers are all it needs. They
+// must be from Linux 5.11 or later: the wait timeout comes with IORING_ENTER_EXT_ARG,
+// after the send, recv and read operations. Older headers, like the 5.4 ones of
+// Ubuntu 20.04, leave only the epoll loop.
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_ENTER_EXT_ARG)
+#define HAVE_IO_URING 1
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// IoLoop over io_uring: operations are queued as submission entries and everything
+// started during an iteration goes to the kernel with the wait for completions, in a
+// single io_uring_enter. Receives land in buffers registered with the ring once, so
+// the kernel doesn't map them again on every read. Needs Linux 5.11 for the wait
+// timeout, the constructor throws std::system_error where io_uring is unavailable.
+class UringLoop : public IoLoop {
+public:
+    explicit UringLoop(unsigned entries = 256) {
+        try {
+            Setup(entries);
+        } catch (...) {
+            Release();
+            throw;
+        }
+    }
+
+    ~UringLoop() override {
+        Release();
+    }
+
+    void Connect(int fd, const sockaddr* address, socklen_t length, Completion done) override {
+        // A non-blocking connect(2) is as cheap as the ring, only its end is waited for.
+        auto& op = Start(Op::Kind::Connect, fd);
+        op.done = std::move(done);
+        op.connect_error = connect(fd, address, length) < 0 ? errno : 0;
+        Poll(op, POLLOUT);
+    }
+
+    void Send(int fd, const char* data, size_t size, Completion done) override {
+        auto& op = Start(Op::Kind::Send, fd);
+        op.done = std::move(done);
+        op.data = data;
+        op.size = size;
+        Issue(op);
+    }
+
+    void Receive(int fd, ReceiveCompletion done) override {
+        auto& op = Start(Op::Kind::Receive, fd);
+        op.receive = std::move(done);
+        if (!free_buffers_.empty()) {
+            op.buffer = free_buffers_.back();
+            free_buffers_.pop_back();
+        } else {
+            op.heap_buffer = std::make_unique<char[]>(kBufferSize);
+        }
+        Issue(op);
+    }
+
+    void Close(int fd) override {
+        auto pending = false;
+        for (auto& [id, op] : ops_) {
+            if (op.fd == fd && !op.cancelled) {
+                op.cancelled = pending = true;
+                auto sqe = NextSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = id;
+                sqe->user_data = kIgnoredId;
+            }
+        }
+        if (pending) {
+            // Queued entries name the descriptor by number, which a new socket may get
+            // right after the close.
+            Enter(Unsubmitted(), 0, 0, nullptr, 0);
+            // The ring holds its own reference to the socket: shutdown ends operations
+            // that are already running, so none of them touches caller memory after this.
+            shutdown(fd, SHUT_RDWR);
+        }
+        close(fd);
+    }
+
+protected:
+    void Wait(int timeout_ms) override {
+        __kernel_timespec timeout{};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        if (timeout_ms >= 0) {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        }
+        auto result = Enter(Unsubmitted(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                            &arg, sizeof(arg));
+        if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+        }
+        Reap();
+    }
+
+    void Wake() override {
+        uint64_t one = 1;
+        [[maybe_unused]] auto written = write(wakeup_, &one, sizeof(one));
+    }
+
+private:
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr unsigned kRegisteredBuffers = 32;
+    // user_data of the wakeup read and of entries whose completions don't matter.
+    static constexpr uint64_t kWakeupId = 0;
+    static constexpr uint64_t kIgnoredId = 1;
+
+    struct Op {
+        enum class Kind { Connect, Send, Receive };
+
+        uint64_t id{0};
+        Kind kind;
+        int fd{-1};
+        // Waiting for readiness before the operation is issued again.
+        bool polling{false};
+        bool cancelled{false};
+        int connect_error{0};
+        const char* data{nullptr};
+        size_t size{0};
+        // Index of the registered buffer, or -1 for heap_buffer.
+        int buffer{-1};
+        std::unique_ptr<char[]> heap_buffer;
+        Completion done;
+        ReceiveCompletion receive;
+    };
+
+    void Setup(unsigned entries) {
+        io_uring_params params{};
+        ring_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG)) {
+            throw std::system_error(ENOSYS, std::generic_category(), "io_uring wait timeouts");
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+
+        auto sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sq_local_tail_ = *sq_tail_;
+
+        RegisterBuffers();
+
+        wakeup_ = eventfd(0, EFD_CLOEXEC);
+        if (wakeup_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+        }
+        ReadWakeup();
+    }
+
+    void* Map(size_t size, off_t offset) {
+        auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_, offset);
+        if (address == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+        }
+        return address;
+    }
+
+    // Locked memory may be limited, receives then go to heap buffers of their own.
+    void RegisterBuffers() {
+        buffers_.resize(kRegisteredBuffers * kBufferSize);
+        std::vector<iovec> vectors(kRegisteredBuffers);
+        for (unsigned i = 0; i < kRegisteredBuffers; ++i) {
+            vectors[i].iov_base = buffers_.data() + i * kBufferSize;
+            vectors[i].iov_len = kBufferSize;
+        }
+        if (syscall(__NR_io_uring_register, ring_, IORING_REGISTER_BUFFERS, vectors.data(),
+                    kRegisteredBuffers) < 0) {
+            buffers_.clear();
+            return;
+        }
+        for (int i = kRegisteredBuffers - 1; i >= 0; --i) {
+            free_buffers_.push_back(i);
+        }
+    }
+
+    void Release() {
+        if (wakeup_ >= 0) {
+            close(wakeup_);
+        }
+        if (sqes_) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sq_ring_) {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        // Closing the ring cancels what is still in flight.
+        if (ring_ >= 0) {
+            close(ring_);
+        }
+    }
+
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg,
+              size_t arg_size) {
+        return static_cast<int>(
+            syscall(__NR_io_uring_enter, ring_, to_submit, min_complete, flags, arg, arg_size));
+    }
+
+    // Entries queued but not yet consumed by the kernel.
+    unsigned Unsubmitted() const {
+        return sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    // Zeroed entry at the tail of the submission queue, which is flushed first if full.
+    io_uring_sqe* NextSqe() {
+        while (Unsubmitted() == sq_entries_) {
+            if (Enter(Unsubmitted(), 0, 0, nullptr, 0) < 0 && errno != EINTR && errno != EBUSY) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+            if (Unsubmitted() == sq_entries_) {
+                // The completion queue is full, the kernel takes more once it's drained.
+                // The completions run later, not inside the call starting an operation.
+                Stash();
+            }
+        }
+        auto index = sq_local_tail_ & sq_mask_;
+        auto sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, ++sq_local_tail_, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    Op& Start(Op::Kind kind, int fd) {
+        auto id = ++last_op_;
+        auto& op = ops_[id];
+        op.id = id;
+        op.kind = kind;
+        op.fd = fd;
+        return op;
+    }
+
+    void Issue(Op& op) {
+        auto sqe = NextSqe();
+        sqe->fd = op.fd;
+        sqe->user_data = op.id;
+        if (op.kind == Op::Kind::Send) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = reinterpret_cast<uint64_t>(op.data);
+            sqe->len = static_cast<uint32_t>(op.size);
+            sqe->msg_flags = MSG_NOSIGNAL;
+        } else if (op.buffer >= 0) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = reinterpret_cast<uint64_t>(BufferOf(op));
+            sqe->len = kBufferSize;
+            sqe->buf_index = static_cast<uint16_t>(op.buffer);
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = reinterpret_cast<uint64_t>(BufferOf(op));
+            sqe->len = kBufferSize;
+        }
+    }
+
+    void Poll(Op& op, unsigned events) {
+        op.polling = true;
+        auto sqe = NextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = op.fd;
+        sqe->poll32_events = events;
+        sqe->user_data = op.id;
+    }
+
+    char* BufferOf(Op& op) {
+        return op.buffer >= 0 ? buffers_.data() + op.buffer * kBufferSize : op.heap_buffer.get();
+    }
+
+    // The eventfd is read through the ring too, so a wakeup completes the wait.
+    void ReadWakeup() {
+        auto sqe = NextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeup_;
+        sqe->addr = reinterpret_cast<uint64_t>(&wakeup_value_);
+        sqe->len = sizeof(wakeup_value_);
+        sqe->user_data = kWakeupId;
+    }
+
+    void Stash() {
+        auto head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            stashed_.push_back(cqes_[head & cq_mask_]);
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+        }
+    }
+
+    void Reap() {
+        for (size_t i = 0; i < stashed_.size(); ++i) {
+            OnCompletion(stashed_[i].user_data, stashed_[i].res);
+        }
+        stashed_.clear();
+        auto head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            auto cqe = cqes_[head & cq_mask_];
+            // Released first: completions may queue entries and the kernel may post more.
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            OnCompletion(cqe.user_data, cqe.res);
+        }
+    }
+
+    void OnCompletion(uint64_t id, int result) {
+        if (id == kWakeupId) {
+            ReadWakeup();
+            return;
+        }
+        auto it = ops_.find(id);
+        if (it == ops_.end()) {
+            return;
+        }
+        auto& op = it->second;
+        if (!op.cancelled) {
+            if (op.polling && op.kind != Op::Kind::Connect) {
+                op.polling = false;
+                Issue(op);
+                return;
+            }
+            // Older kernels hand EAGAIN of non-blocking sockets back instead of waiting.
+            if (!op.polling && (result == -EAGAIN || result == -EINTR)) {
+                Poll(op, op.kind == Op::Kind::Send ? POLLOUT : POLLIN);
+                return;
+            }
+        }
+        // The completion may start new operations, so it runs on a moved out op.
+        auto finished = std::move(op);
+        ops_.erase(it);
+        if (!finished.cancelled) {
+            if (finished.kind == Op::Kind::Connect) {
+                auto error = finished.connect_error;
+                if (error == EINPROGRESS) {
+                    socklen_t length = sizeof(error);
+                    getsockopt(finished.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                }
+                finished.done(-error);
+            } else if (finished.kind == Op::Kind::Send) {
+                finished.done(result);
+            } else {
+                finished.receive(result, BufferOf(finished));
+            }
+        }
+        if (finished.buffer >= 0) {
+            free_buffers_.push_back(finished.buffer);
+        }
+    }
+
+private:
+    int ring_{-1};
+    int wakeup_{-1};
+    uint64_t wakeup_value_{0};
+    void* sq_ring_{nullptr};
+    void* cq_ring_{nullptr};
+    io_uring_sqe* sqes_{nullptr};
+    size_t sq_ring_size_{0};
+    size_t cq_ring_size_{0};
+    size_t sqes_size_{0};
+    unsigned* sq_head_{nullptr};
+    unsigned* sq_tail_{nullptr};
+    unsigned* sq_array_{nullptr};
+    unsigned sq_mask_{0};
+    unsigned sq_entries_{0};
+    unsigned sq_local_tail_{0};
+    unsigned* cq_head_{nullptr};
+    unsigned* cq_tail_{nullptr};
+    unsigned cq_mask_{0};
+    io_uring_cqe* cqes_{nullptr};
+    std::vector<io_uring_cqe> stashed_;
+    std::vector<char> buffers_;
+    std::vector<int> free_buffers_;
+    uint64_t last_op_{kIgnoredId};
+    std::unordered_map<uint64_t, Op> ops_;
+};
+
+#endif  // __linux__ && IORING_ENTER_EXT_ARG
+
+#endif  // URING_LOOP_H
@@ -1,8 +1,12 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <algorithm>
+#include <cctype>
 #include <optional>
 #include <fstream>
+#include <string>
+#include <string_view>
 
 template <typename T>
 std::string GetString(const std::optional<T>& from) {
@@ -12,7 +16,16 @@ std::string GetString(const std::optional<T>& from) {
     return {};
 }
 
-std::optional<std::string> GetToken(char *path) {
+// ASCII case-insensitive comparison, for header names and usernames.
+inline bool EqualsIgnoreCase(std::string_view lhs, std::string_view rhs) {
+    return lhs.size() == rhs.size() &&
+           std::equal(lhs.begin(), lhs.end(), rhs.begin(), [](char a, char b) {
+               return std::tolower(static_cast<unsigned char>(a)) ==
+                      std::tolower(static_cast<unsigned char>(b));
+           });
+}
+
+inline std::optional<std::string> GetToken(char *path) {
     std::ifstream input_file;
     input_file.open(path, std::ios::in);
     std::string token;
@@ -0,0 +1,225 @@
+#ifndef WEBHOOK_SERVER_H
+#define WEBHOOK_SERVER_H
+
+#include "api.h"
+#include "json_reader.h"
+#include "logger.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <Poco/ThreadPool.h>
+#include <Poco/URI.h>
+#include <Poco/Net/HTTPRequestHandler.h>
+#include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPServer.h>
+#include <Poco/Net/HTTPServerParams.h>
+#include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerResponse.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/SocketAddress.h>
+
+struct WebhookConfig {
+    // Receive updates pushed by Telegram instead of polling getUpdates.
+    bool enabled{false};
+    // Public HTTPS address passed to setWebhook on startup, usually a TLS terminating
+    // proxy in front of the server. Empty skips setWebhook, for a webhook set elsewhere.
+    std::string url;
+    // Address the server listens on.
+    std::string host{"0.0.0.0"};
+    uint16_t port{8443};
+    // Bind with SO_REUSEPORT, so that several processes can listen on the port and the
+    // kernel spreads the connections over them.
+    bool reuse_port{false};
+    // Path the updates are posted to, requests for other paths get 404.
+    std::string path{"/"};
+    // Echoed by Telegram in the X-Telegram-Bot-Api-Secret-Token header of every
+    // delivery, requests without it get 401. Empty accepts any request.
+    std::string secret_token;
+    // Threads reading deliveries.
+    int max_threads{4};
+    // Accepted connections waiting for a free thread, further ones are refused.
+    int max_queued{64};
+    // Connections Telegram may open at once, max_threads if empty. Raise it when
+    // several processes share the port.
+    std::optional<int64_t> max_connections;
+    // Update types to receive, empty keeps the previous server-side setting.
+    std::vector<std::string> allowed_updates{"message"};
+};
+
+// Embedded HTTP server taking the updates Telegram posts to the webhook, one per
+// request. Each update goes to the sink on the thread that read it. Telegram retries
+// a delivery until it gets a 2xx reply, so the reply is sent only once the sink has
+// taken the update, and a sink that blocks holds further deliveries back.
+class WebhookServer {
+public:
+    // Returns false if the update can't be taken now, Telegram delivers it again later.
+    using Sink = std::function<bool(tg::TelegramUpdate&)>;
+
+    WebhookServer(const WebhookConfig& config, Sink sink)
+        : config_{config},
+          sink_{std::move(sink)},
+          logger_{logger::LoggerFactory::GetDefaultLogger()},
+          threads_{1, config.max_threads} {
+    }
+
+    WebhookServer(const WebhookServer&) = delete;
+    WebhookServer& operator=(const WebhookServer&) = delete;
+
+    ~WebhookServer() {
+        Stop();
+    }
+
+    // Binds the socket and starts serving. Throws Poco::Net::NetException if the
+    // address is taken.
+    void Start() {
+        // The listen backlog and the queue in front of the threads share the bound.
+        socket_ = std::make_unique<Poco::Net::ServerSocket>();
+        socket_->bind(Poco::Net::SocketAddress(config_.host, config_.port), true,
+                      config_.reuse_port);
+        socket_->listen(config_.max_queued);
+
+        auto params = new Poco::Net::HTTPServerParams();
+        params->setMaxThreads(config_.max_threads);
+        params->setMaxQueued(config_.max_queued);
+        params->setKeepAlive(true);
+
+        server_ = std::make_unique<Poco::Net::HTTPServer>(new HandlerFactory(this), threads_,
+                                                          *socket_, params);
+        server_->start();
+        logger_->LogInfo("Webhook server listening on ", config_.host, ":", config_.port);
+    }
+
+    // Lets the deliveries in progress reach the sink and reply, answers 503 to the
+    // rest and returns once no thread of the server is running.
+    void Stop() {
+        if (!server_) {
+            return;
+        }
+        server_->stop();
+        {
+            std::unique_lock<std::mutex> guard(mutex_);
+            stopping_ = true;
+            idle_.wait(guard, [this] { return in_flight_ == 0; });
+        }
+        // Idle keep-alive connections would otherwise hold their threads until timeout.
+        server_->stopAll(true);
+        threads_.joinAll();
+        server_.reset();
+        socket_.reset();
+    }
+
+private:
+    class Handler : public Poco::Net::HTTPRequestHandler {
+    public:
+        explicit Handler(WebhookServer* server) : server_(server) {
+        }
+
+        void handleRequest(Poco::Net::HTTPServerRequest& request,
+                           Poco::Net::HTTPServerResponse& response) override {
+            auto status = server_->Deliver(request);
+            // The rest of the body would be read as the next request on the connection.
+            request.stream().ignore(std::numeric_limits<std::streamsize>::max());
+            response.setStatusAndReason(status);
+            response.setContentLength(0);
+            response.send();
+        }
+
+    private:
+        WebhookServer* server_;
+    };
+
+    class HandlerFactory : public Poco::Net::HTTPRequestHandlerFactory {
+    public:
+        explicit HandlerFactory(WebhookServer* server) : server_(server) {
+        }
+
+        Poco::Net::HTTPRequestHandler* createRequestHandler(
+            const Poco::Net::HTTPServerRequest&) override {
+            return new Handler(server_);
+        }
+
+    private:
+        WebhookServer* server_;
+    };
+
+    using Status = Poco::Net::HTTPResponse::HTTPStatus;
+
+    Status Deliver(Poco::Net::HTTPServerRequest& request) {
+        if (request.getMethod() != Poco::Net::HTTPRequest::HTTP_POST) {
+            return Status::HTTP_METHOD_NOT_ALLOWED;
+        }
+        if (Poco::URI(request.getURI()).getPath() != config_.path) {
+            return Status::HTTP_NOT_FOUND;
+        }
+        if (!config_.secret_token.empty() &&
+            !TokenEquals(request.get(kSecretTokenHeader, ""), config_.secret_token)) {
+            logger_->LogError("Webhook request without the secret token from ",
+                              request.clientAddress().toString());
+            return Status::HTTP_UNAUTHORIZED;
+        }
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (stopping_) {
+                return Status::HTTP_SERVICE_UNAVAILABLE;
+            }
+            ++in_flight_;
+        }
+        auto status = Status::HTTP_OK;
+        try {
+            json::JsonReader reader(request.stream());
+            tg::TelegramUpdate update(reader);
+            if (!sink_(update)) {
+                status = Status::HTTP_SERVICE_UNAVAILABLE;
+            }
+        } catch (const json::ParseError& error) {
+            logger_->LogError("Malformed webhook update: ", error.what());
+            status = Status::HTTP_BAD_REQUEST;
+        } catch (const std::exception& error) {
+            logger_->LogError("Webhook update not taken: ", error.what());
+            status = Status::HTTP_INTERNAL_SERVER_ERROR;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (--in_flight_ == 0) {
+            idle_.notify_all();
+        }
+        return status;
+    }
+
+private:
+    static constexpr const char* kSecretTokenHeader = "X-Telegram-Bot-Api-Secret-Token";
+
+    // Takes the same time wherever the first mismatch is, so that the token can't be
+    // guessed byte by byte from reply timings. Only the length leaks.
+    static bool TokenEquals(const std::string& given, const std::string& expected) {
+        if (given.size() != expected.size()) {
+            return false;
+        }
+        unsigned char diff = 0;
+        for (size_t i = 0; i < given.size(); ++i) {
+            diff |= static_cast<unsigned char>(given[i] ^ expected[i]);
+        }
+        return diff == 0;
+    }
+
+    const WebhookConfig config_;
+    const Sink sink_;
+    std::shared_ptr<logger::Logger> logger_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    bool stopping_{false};
+    int in_flight_{0};
+    // Declared before the server, which runs on it.
+    Poco::ThreadPool threads_;
+    std::unique_ptr<Poco::Net::ServerSocket> socket_;
+    std::unique_ptr<Poco::Net::HTTPServer> server_;
+};
+
+#endif  // WEBHOOK_SERVER_H
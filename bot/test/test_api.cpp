@@ -1,7 +1,13 @@
 #include <catch.hpp>
 
 #include "../telegram/api.h"
+#include "../telegram/bot_main.h"
 #include "../telegram/fake.h"
+#include "../telegram/fake_data.h"
+
+#include <atomic>
+#include <cstdio>
+#include <sstream>
 
 tg::TelegramCredentials GetTestCredentials(const std::string &url) {
     return tg::TelegramCredentials{"123", url};
@@ -33,6 +39,21 @@ TEST_CASE("getMe error handling") {
     fake.StopAndCheckExpectations();
 }
 
+TEST_CASE("getMe unexpected reply") {
+    telegram::FakeServer fake("getMe unexpected reply");
+    fake.Start();
+
+    // The blocking sessions and the non-blocking transport read replies apart.
+    for (auto transport : {tg::Transport::Sessions, tg::Transport::Epoll}) {
+        tg::TelegramApiConfig config;
+        config.transport = transport;
+        auto api = tg::TelegramApi(GetTestCredentials(fake.GetUrl()), NetworkMode::HTTP, config);
+        REQUIRE_THROWS_AS(api.GetMe(), tg::TelegramApiError);
+    }
+
+    fake.StopAndCheckExpectations();
+}
+
 TEST_CASE("Single getUpdates and send messages") {
     telegram::FakeServer fake("Single getUpdates and send messages");
     fake.Start();
@@ -73,3 +94,641 @@ TEST_CASE("Handle getUpdates offset") {
     updates = api.GetUpdates(max_update_id, 5);
     REQUIRE(updates.size() == 1);
 }
+
+TEST_CASE("Reuse keep-alive connection") {
+    telegram::FakeServer fake("Reuse keep-alive connection");
+    fake.Start();
+
+    auto credentials = GetTestCredentials(fake.GetUrl());
+    auto api = tg::TelegramApi(credentials);
+
+    api.GetMe();
+    api.GetMe();
+
+    fake.StopAndCheckExpectations();
+}
+
+TEST_CASE("Pooled session requests are reused") {
+    tg::RequestPool requests("POST", "/bot123/sendMessage", "application/json");
+    Poco::Net::HTTPRequest *first = nullptr;
+    {
+        auto request = requests.Acquire("/bot123/sendMessage?x=1", 10);
+        first = &*request;
+        REQUIRE(request->getURI() == "/bot123/sendMessage?x=1");
+        REQUIRE(request->getContentLength() == 10);
+        REQUIRE(request->getContentType() == "application/json");
+        REQUIRE(request->getKeepAlive());
+    }
+    auto request = requests.Acquire(requests.Path(), 3);
+    REQUIRE(&*request == first);
+    REQUIRE(request->getURI() == "/bot123/sendMessage");
+    REQUIRE(request->getContentLength() == 3);
+}
+
+TEST_CASE("Reply reset after the status line") {
+    telegram::FakeServer fake("Reply reset after the status line");
+    fake.Start();
+
+    auto credentials = GetTestCredentials(fake.GetUrl());
+    auto api = tg::TelegramApi(credentials);
+
+    api.SendMessage(104519755, "Hi!");
+    // Telegram has sent the message, sending it again would deliver it twice.
+    REQUIRE_THROWS_AS(api.SendMessage(104519755, "Hi!"), tg::TelegramApiError);
+
+    fake.StopAndCheckExpectations();
+}
+
+TEST_CASE("Flood control retries rejected messages") {
+    telegram::FakeServer fake("Flood control retries rejected messages");
+    fake.Start();
+
+    auto credentials = GetTestCredentials(fake.GetUrl());
+    auto plain = tg::TelegramApi(credentials);
+    try {
+        plain.SendMessage(104519755, "Hi!");
+        FAIL("429 was not reported");
+    } catch (const tg::TelegramApiError &error) {
+        REQUIRE(error.HttpCode() == 429);
+        REQUIRE(error.RetryAfter() == 1);
+        REQUIRE(error.Description() == "Too Many Requests: retry after 1");
+    }
+
+    tg::TelegramApiConfig config;
+    config.flood_control.enabled = true;
+    auto api = tg::TelegramApi(credentials, NetworkMode::HTTP, config);
+    auto message = api.SendMessage(104519755, "Hi!");
+    REQUIRE(message.text == "Hi!");
+
+    fake.StopAndCheckExpectations();
+}
+
+TEST_CASE("Async send messages") {
+    telegram::FakeServer fake("Async send messages");
+    fake.Start();
+
+    auto api = tg::TelegramApi(GetTestCredentials(fake.GetUrl()));
+
+    std::atomic<int> callbacks{0};
+    auto on_sent = [&](std::future<tg::TelegramApiMessage> sent) {
+        // Runs on a sender thread, so no assertions here.
+        if (sent.get().text == "Hi!") {
+            ++callbacks;
+        }
+    };
+    std::vector<std::future<tg::TelegramApiMessage>> sent;
+    for (int i = 1; i <= 10; ++i) {
+        sent.push_back(api.SendMessageAsync(1, std::to_string(i)));
+        if (i < 10) {
+            api.SendMessageAsync(2, std::to_string(i), on_sent);
+        } else {
+            api.SendMessageAsync(2, std::to_string(i), 2, on_sent);
+        }
+    }
+    auto failed = api.SendMessageAsync(3, "fail");
+
+    for (auto &message : sent) {
+        REQUIRE(message.get().text == "Hi!");
+    }
+    REQUIRE_THROWS_AS(failed.get(), tg::TelegramApiError);
+    api.FlushOutbox();
+    REQUIRE(callbacks == 10);
+
+    fake.StopAndCheckExpectations();
+}
+
+// Same exchange as "Async send messages", over one of the non-blocking transports.
+void CheckAsyncSendOver(tg::Transport transport) {
+    telegram::FakeServer fake("Async send messages");
+    fake.Start();
+
+    tg::TelegramApiConfig config;
+    config.transport = transport;
+    auto api = tg::TelegramApi(GetTestCredentials(fake.GetUrl()), NetworkMode::HTTP, config);
+
+    std::vector<std::future<tg::TelegramApiMessage>> sent;
+    for (int i = 1; i <= 10; ++i) {
+        sent.push_back(api.SendMessageAsync(1, std::to_string(i)));
+        sent.push_back(i < 10 ? api.SendMessageAsync(2, std::to_string(i))
+                              : api.SendMessageAsync(2, std::to_string(i), 2));
+    }
+    auto failed = api.SendMessageAsync(3, "fail");
+
+    for (auto &message : sent) {
+        REQUIRE(message.get().text == "Hi!");
+    }
+    try {
+        failed.get();
+        FAIL("sendMessage error was not reported");
+    } catch (const tg::TelegramApiError &error) {
+        REQUIRE(error.HttpCode() == 400);
+        REQUIRE(error.Description() == "Bad Request: chat not found");
+    }
+
+    fake.StopAndCheckExpectations();
+}
+
+TEST_CASE("Async send messages over epoll") {
+    CheckAsyncSendOver(tg::Transport::Epoll);
+}
+
+// Falls back to epoll where io_uring is unavailable.
+TEST_CASE("Async send messages over io_uring") {
+    CheckAsyncSendOver(tg::Transport::IoUring);
+}
+
+TEST_CASE("Bot long polling") {
+    telegram::FakeServer fake("Bot long polling");
+    fake.Start();
+
+    const std::string offset_file = "test_long_polling_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    config->polling.limit = 2;
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Bot pipelined dispatch") {
+    telegram::FakeServer fake("Bot pipelined dispatch");
+    fake.Start();
+
+    const std::string offset_file = "test_pipelined_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    config->polling.limit = 2;
+    config->dispatch.pipelined = true;
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Bot long polling over epoll") {
+    telegram::FakeServer fake("Bot long polling");
+    fake.Start();
+
+    const std::string offset_file = "test_long_polling_epoll_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    config->polling.limit = 2;
+    config->api.transport = tg::Transport::Epoll;
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Bot webhook") {
+    telegram::FakeServer fake("Bot webhook");
+    fake.Start();
+
+    const std::string offset_file = "test_webhook_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->webhook.enabled = true;
+    config->webhook.url = "http://localhost:8081/telegram";
+    config->webhook.host = "localhost";
+    config->webhook.port = 8081;
+    config->webhook.path = "/telegram";
+    config->webhook.secret_token = "secret";
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Streaming getUpdates decoder") {
+    std::istringstream reply(FakeData::GetUpdatesFourMessagesJson);
+    auto updates = tg::ParseUpdates(reply);
+
+    Poco::JSON::Parser parser;
+    auto dom = parser.parse(FakeData::GetUpdatesFourMessagesJson)
+                   .extract<Poco::JSON::Object::Ptr>()
+                   ->getArray("result");
+
+    REQUIRE(updates.size() == dom->size());
+    for (size_t i = 0; i != updates.size(); ++i) {
+        tg::TelegramUpdate expected(*dom->getObject(i));
+        const auto &actual = updates[i];
+
+        REQUIRE(actual.update_id == expected.update_id);
+        REQUIRE(actual.message->message_id == expected.message->message_id);
+        REQUIRE(actual.message->date == expected.message->date);
+        REQUIRE(actual.message->text == expected.message->text);
+        REQUIRE(actual.message->chat->id == expected.message->chat->id);
+        REQUIRE(actual.message->chat->type == expected.message->chat->type);
+        REQUIRE(actual.message->from->username == expected.message->from->username);
+        REQUIRE(actual.message->entities.size() == expected.message->entities.size());
+    }
+
+    std::istringstream escaped(R"({"ok":true,"result":[{"update_id":1,"edited_message":{"a":[{}]}},
+        {"message":{"message_id":3,"date":4,"photo":[{"file_id":"x","sizes":[1,2]}],
+        "chat":{"id":-5,"type":"group","title":"t"},"text":"\"hi\"\n\u00e9\ud83d\ude00"},
+        "update_id":2}]})");
+    updates = tg::ParseUpdates(escaped);
+
+    REQUIRE(updates.size() == 2);
+    REQUIRE_FALSE(updates[0].message.has_value());
+    REQUIRE(updates[1].update_id == 2);
+    REQUIRE(updates[1].message->chat->id == -5);
+    REQUIRE(updates[1].message->text == "\"hi\"\n\xC3\xA9\xF0\x9F\x98\x80");
+
+    std::istringstream truncated(R"({"ok":true,"result":[{"update_id":1)");
+    REQUIRE_THROWS_AS(tg::ParseUpdates(truncated), json::ParseError);
+}
+
+TEST_CASE("Lazy update views") {
+    auto views = tg::ParseUpdateViews(FakeData::GetUpdatesFourMessagesJson);
+    std::istringstream in(FakeData::GetUpdatesFourMessagesJson);
+    auto updates = tg::ParseUpdates(in);
+
+    REQUIRE(views.size() == updates.size());
+    for (size_t i = 0; i != views.size(); ++i) {
+        const auto &view = views[i];
+        const auto &expected = updates[i];
+        REQUIRE(view.UpdateId() == expected.update_id);
+        REQUIRE(view.HasMessage());
+        REQUIRE(view.MessageId() == expected.message->message_id);
+        REQUIRE(view.ChatId() == expected.message->chat->id);
+        REQUIRE(std::string(view.Text().value_or("")) == expected.GetMessageTextOrEmpty());
+        // The text points into the reply unless it has escapes.
+        if (auto text = view.Text()) {
+            REQUIRE(text->data() > view.Raw().data());
+            REQUIRE(text->data() < view.Raw().data() + view.Raw().size());
+        }
+
+        tg::TelegramUpdate decoded(view);
+        REQUIRE(decoded.update_id == expected.update_id);
+        REQUIRE(decoded.message->text == expected.message->text);
+        REQUIRE(decoded.message->entities.size() == expected.message->entities.size());
+    }
+
+    // Copies share the reply.
+    auto last = views.back();
+    views.clear();
+    REQUIRE(last.UpdateId() == updates.back().update_id);
+
+    views = tg::ParseUpdateViews(
+        R"({"ok":true,"result":[{"update_id":1,"edited_message":{"a":[{}]}},
+        {"message":{"message_id":3,"date":4,"photo":[{"file_id":"x","sizes":[1,2]}],
+        "chat":{"id":-5,"type":"group","title":"t"},"text":"\"hi\"\n\u00e9\ud83d\ude00"},
+        "update_id":2}]})");
+    REQUIRE(views.size() == 2);
+    REQUIRE(views[0].UpdateId() == 1);
+    REQUIRE_FALSE(views[0].HasMessage());
+    REQUIRE(views[0].ChatId() == 0);
+    REQUIRE_FALSE(views[0].Text());
+    REQUIRE(views[1].UpdateId() == 2);
+    REQUIRE(views[1].ChatId() == -5);
+    REQUIRE(views[1].Text() == "\"hi\"\n\xC3\xA9\xF0\x9F\x98\x80");
+
+    REQUIRE(tg::ParseUpdateViews(R"({"ok":true})").empty());
+    REQUIRE_THROWS_AS(tg::ParseUpdateViews(R"({"ok":true,"result":[{"update_id":1)"),
+                      json::ParseError);
+}
+
+TEST_CASE("Bot under synthetic load") {
+    telegram::LoadConfig load;
+    load.UpdatesPerSecond = 2000;
+    load.Chats = 20;
+    load.Updates = 500;
+    telegram::FakeServer fake(load);
+    fake.Start();
+
+    const std::string offset_file = "test_load_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    config->dispatch.pipelined = true;
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    REQUIRE(fake.GetReport().find("Served 500 updates and received 500 replies") == 0);
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Bot under load from a misbehaving server") {
+    telegram::LoadConfig load;
+    load.UpdatesPerSecond = 1000;
+    load.Chats = 10;
+    load.Updates = 200;
+    telegram::FakeServer fake(load);
+
+    // Replies are not retried yet, so only polling misbehaves.
+    telegram::FaultConfig faults;
+    faults.Methods = {"getUpdates"};
+    faults.Distribution = telegram::DelayDistribution::LogNormal;
+    faults.Delay = std::chrono::milliseconds(2);
+    faults.TooManyRequestsRate = 0.05;
+    faults.RetryAfter = 0;
+    faults.ServerErrorRate = 0.05;
+    faults.ResetRate = 0.05;
+    faults.TrickleRate = 0.2;
+    faults.TricklePause = std::chrono::milliseconds(1);
+    fake.InjectFaults(faults);
+    fake.Start();
+
+    const std::string offset_file = "test_faults_offset.data";
+    std::remove(offset_file.c_str());
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    config->dispatch.pipelined = true;
+
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    REQUIRE(fake.GetReport().find("Served 200 updates and received 200 replies") == 0);
+    std::remove(offset_file.c_str());
+}
+
+TEST_CASE("Record and replay bot traffic") {
+    const std::string trace_file = "test_replay.trace";
+    const std::string offset_file = "test_replay_offset.data";
+    std::remove(offset_file.c_str());
+
+    {
+        telegram::LoadConfig load;
+        load.UpdatesPerSecond = 500;
+        load.Chats = 5;
+        load.Updates = 50;
+        telegram::FakeServer fake(load);
+        fake.Start();
+
+        auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()),
+                                                        offset_file, NetworkMode::HTTP);
+        config->polling.idle_timeout = std::chrono::seconds(1);
+        config->api.trace_path = trace_file;
+        {
+            BotServer server{config};
+            server.Start();
+        }
+        fake.StopAndCheckExpectations();
+    }
+    std::remove(offset_file.c_str());
+
+    // The recorded traffic ends with /stop, which stops the bot again.
+    telegram::ReplayConfig replay;
+    replay.TracePath = trace_file;
+    replay.Speed = 4;
+    telegram::FakeServer fake(replay);
+    fake.Start();
+
+    auto config = std::make_shared<BotServerConfig>(GetTestCredentials(fake.GetUrl()), offset_file,
+                                                    NetworkMode::HTTP);
+    config->polling.idle_timeout = std::chrono::seconds(1);
+    BotServer server{config};
+    server.Start();
+
+    fake.StopAndCheckExpectations();
+    auto report = fake.GetReport();
+    // Replay counts /stop as an update, it can't tell which ones the bot answers.
+    REQUIRE(report.find("Served 51 updates and received 50 replies") == 0);
+    REQUIRE(report.find("the recording had 50 replies") != std::string::npos);
+
+    std::remove(offset_file.c_str());
+    std::remove(trace_file.c_str());
+}
+
+TEST_CASE("Handler dispatch by command") {
+    // Matches anything mentioning cats, whatever the command.
+    class CatHandler : public MessageHandler {
+    public:
+        using MessageHandler::MessageHandler;
+        void handle(const tg::TelegramApiMessage &) override {
+        }
+        bool matches(const tg::TelegramApiMessage &message) const override {
+            return message.text && message.text->find("cat") != std::string::npos;
+        }
+    };
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials("http://localhost/"));
+    MessageHandlerFactory factory(api);
+    auto cats = std::make_shared<CatHandler>(api);
+    factory.AddHandler(cats);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    auto handler_for = [&](const std::string &text, int64_t command_length) -> MessageHandler & {
+        message.text = text;
+        message.entities.at(0).length = command_length;
+        return factory.GetHandler(message);
+    };
+
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random", 7)));
+    REQUIRE(dynamic_cast<ExitOkComandHandler *>(&handler_for("/stop", 5)));
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random 10", 7)));
+    REQUIRE(dynamic_cast<DefaultMessageHandler *>(&handler_for("/randomly", 9)));
+    REQUIRE(&handler_for("/randomly cat", 9) == cats.get());
+    REQUIRE(&handler_for("/weather", 8) != cats.get());
+    // The command is taken from the entity, not from the text.
+    REQUIRE(dynamic_cast<DefaultMessageHandler *>(&handler_for("/weather", 3)));
+
+    message.entities.clear();
+    message.text = "/styleguide";
+    REQUIRE(dynamic_cast<ReviewJokeMessageHandler *>(&factory.GetHandler(message)));
+}
+
+TEST_CASE("Handlers sharing a command are tried in order") {
+    // Answers /echo when the text has the word, if one is given.
+    class Echo : public MessageHandler {
+    public:
+        Echo(std::shared_ptr<tg::TelegramApi> api, std::string word)
+            : MessageHandler(api), word_{std::move(word)} {
+        }
+        void handle(const tg::TelegramApiMessage &) override {
+        }
+        bool matches(const tg::TelegramApiMessage &message) const override {
+            return message.text && message.text->find(word_) != std::string::npos;
+        }
+        std::string_view Command() const override {
+            return "/echo";
+        }
+
+    private:
+        std::string word_;
+    };
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials("http://localhost/"));
+    MessageHandlerFactory factory(api);
+    auto loud = std::make_shared<Echo>(api, "LOUD");
+    auto plain = std::make_shared<Echo>(api, "");
+    factory.AddHandler(loud);
+    factory.AddHandler(plain);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    auto handler_for = [&](const std::string &text) -> MessageHandler & {
+        message.text = text;
+        message.entities.at(0).length = 5;
+        return factory.GetHandler(message);
+    };
+
+    REQUIRE(&handler_for("/echo LOUD") == loud.get());
+    // Not matched by the first one, so the second gets it.
+    REQUIRE(&handler_for("/echo quiet") == plain.get());
+}
+
+TEST_CASE("Handler dispatch by regex triggers") {
+    class Greeting : public RegexMessageHandler {
+    public:
+        using RegexMessageHandler::RegexMessageHandler;
+        void handle(const tg::TelegramApiMessage &) override {
+        }
+    };
+    class Question : public MessageHandler {
+    public:
+        using MessageHandler::MessageHandler;
+        void handle(const tg::TelegramApiMessage &) override {
+        }
+        bool matches(const tg::TelegramApiMessage &message) const override {
+            return message.text && !message.text->empty() && message.text->back() == '?';
+        }
+    };
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials("http://localhost/"));
+    MessageHandlerFactory factory(api);
+    auto hello = std::make_shared<Greeting>(api, std::vector<std::string>{"(?i)\\bhello\\b"});
+    auto question = std::make_shared<Question>(api);
+    auto bye = std::make_shared<Greeting>(api, std::vector<std::string>{"^bye", "ciao$"});
+    factory.AddHandler(hello);
+    factory.AddHandler(question);
+    factory.AddHandler(bye);
+    REQUIRE_THROWS_AS(factory.AddHandler(std::make_shared<Greeting>(
+                          api, std::vector<std::string>{"(unclosed"})),
+                      std::invalid_argument);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    message.entities.clear();
+    auto handler_for = [&](const std::string &text) -> MessageHandler * {
+        message.text = text;
+        return &factory.GetHandler(message);
+    };
+
+    REQUIRE(handler_for("Well, HELLO there") == hello.get());
+    REQUIRE(handler_for("hello, who is it?") == hello.get());
+    // Added before bye, so it is asked first.
+    REQUIRE(handler_for("bye?") == question.get());
+    REQUIRE(handler_for("bye now") == bye.get());
+    REQUIRE(handler_for("well, ciao") == bye.get());
+    REQUIRE(dynamic_cast<DefaultMessageHandler *>(handler_for("othello")));
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(handler_for("/random")));
+    REQUIRE(hello->matches(message) == false);
+
+    REQUIRE_THROWS_AS(factory.AddHandler(std::make_shared<Greeting>(
+                          api, std::vector<std::string>{"late"})),
+                      std::logic_error);
+}
+
+TEST_CASE("Failed getMe is not repeated for every addressed command") {
+    telegram::FakeServer fake("Failing getMe");
+    fake.Start();
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials(fake.GetUrl()));
+    MessageHandlerFactory factory(api);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    auto handler_for = [&](const std::string &text, int64_t command_length) -> MessageHandler & {
+        message.text = text;
+        message.entities.at(0).length = command_length;
+        return factory.GetHandler(message);
+    };
+
+    // Without a username the commands are taken for ours.
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random@test_bot", 16)));
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random@other_bot", 17)));
+    REQUIRE_THROWS_AS(api->Username(), tg::TelegramApiError);
+
+    fake.StopAndCheckExpectations();
+}
+
+TEST_CASE("Handler with a malformed trigger adds none of its triggers") {
+    // The factory gets the patterns from Triggers(), nothing checks them before.
+    class Unchecked : public MessageHandler {
+    public:
+        Unchecked(std::shared_ptr<tg::TelegramApi> api, std::vector<std::string> triggers)
+            : MessageHandler(api), triggers_{std::move(triggers)} {
+        }
+        void handle(const tg::TelegramApiMessage &) override {
+        }
+        bool matches(const tg::TelegramApiMessage &) const override {
+            return false;
+        }
+        std::vector<std::string> Triggers() const override {
+            return triggers_;
+        }
+
+    private:
+        std::vector<std::string> triggers_;
+    };
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials("http://localhost/"));
+    MessageHandlerFactory factory(api);
+    auto bad = std::make_shared<Unchecked>(api, std::vector<std::string>{"ok", "(bad"});
+    REQUIRE_THROWS_AS(factory.AddHandler(bad), std::invalid_argument);
+    auto later = std::make_shared<Unchecked>(api, std::vector<std::string>{"later"});
+    factory.AddHandler(later);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    message.entities.clear();
+    message.text = "ok";
+    REQUIRE(dynamic_cast<DefaultMessageHandler *>(&factory.GetHandler(message)));
+    message.text = "later";
+    REQUIRE(&factory.GetHandler(message) == later.get());
+}
+
+TEST_CASE("Commands addressed to bots") {
+    telegram::FakeServer fake("Single getMe");
+    fake.Start();
+
+    auto api = std::make_shared<tg::TelegramApi>(GetTestCredentials(fake.GetUrl()));
+    MessageHandlerFactory factory(api);
+
+    std::istringstream reply(FakeData::GetupdatesOneMessage);
+    auto message = tg::ParseUpdates(reply).at(0).message.value();
+    auto handler_for = [&](const std::string &text, int64_t command_length) -> MessageHandler & {
+        message.text = text;
+        message.entities.at(0).length = command_length;
+        return factory.GetHandler(message);
+    };
+
+    // The username is asked for once, and only for addressed commands.
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random", 7)));
+    REQUIRE(dynamic_cast<RandomMessageHandler *>(&handler_for("/random@test_bot 10", 16)));
+    REQUIRE(dynamic_cast<WeatherMessageHandler *>(&handler_for("/weather@Test_Bot", 17)));
+    REQUIRE(dynamic_cast<IgnoreMessageHandler *>(&handler_for("/random@other_bot", 17)));
+    REQUIRE(dynamic_cast<IgnoreMessageHandler *>(&handler_for("/unknown@other_bot 1", 18)));
+
+    fake.StopAndCheckExpectations();
+}
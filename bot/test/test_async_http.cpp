@@ -0,0 +1,333 @@
+#include <catch.hpp>
+
+#include "../telegram/async_http_client.h"
+#include "../telegram/http_parser.h"
+#include "../telegram/uring_loop.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+HttpResponse ParseInPieces(const std::string& response, size_t piece) {
+    HttpResponseParser parser;
+    for (size_t pos = 0; pos < response.size() && !parser.Done(); pos += piece) {
+        parser.Feed(std::string_view(response).substr(pos, piece));
+    }
+    REQUIRE(parser.Done());
+    return parser.Response();
+}
+
+}  // namespace
+
+TEST_CASE("HTTP parser reads responses split anywhere") {
+    const std::string fixed =
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 11\r\n\r\n"
+        "{\"ok\":true}";
+    const std::string chunked =
+        "HTTP/1.1 429 Too Many Requests\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5;ext=1\r\n{\"ok\"\r\n6\r\n:true}\r\n0\r\nX-Trailer: 1\r\n\r\n";
+
+    for (size_t piece : {1, 2, 7, 1000}) {
+        auto response = ParseInPieces(fixed, piece);
+        REQUIRE(response.status == 200);
+        REQUIRE(response.reason == "OK");
+        REQUIRE(response.Header("content-type") == "application/json");
+        REQUIRE(response.body == "{\"ok\":true}");
+        REQUIRE(response.keep_alive);
+
+        response = ParseInPieces(chunked, piece);
+        REQUIRE(response.status == 429);
+        REQUIRE(response.body == "{\"ok\":true}");
+    }
+}
+
+TEST_CASE("HTTP parser handles connection and body edge cases") {
+    HttpResponseParser parser;
+    const std::string two =
+        "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 204 No Content\r\n\r\nHTTP/1.1 200 OK\r\n";
+    auto used = parser.Feed(two);
+    REQUIRE(parser.Done());
+    REQUIRE(parser.Response().status == 204);
+    REQUIRE(two.substr(used) == "HTTP/1.1 200 OK\r\n");
+
+    parser.Reset();
+    REQUIRE_FALSE(parser.Started());
+    parser.Feed("HTTP/1.0 200 OK\r\n\r\nuntil the end");
+    REQUIRE_FALSE(parser.Done());
+    parser.Finish();
+    REQUIRE(parser.Response().body == "until the end");
+    REQUIRE_FALSE(parser.Response().keep_alive);
+
+    parser.Reset();
+    parser.Feed("HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 10\r\n\r\nBad");
+    REQUIRE(parser.Started());
+    REQUIRE_THROWS_AS(parser.Finish(), HttpParseError);
+
+    parser.Reset();
+    REQUIRE_THROWS_AS(parser.Feed("SSH-2.0-OpenSSH\r\n"), HttpParseError);
+    parser.Reset();
+    REQUIRE_THROWS_AS(parser.Feed("HTTP/1.1 200 OK\r\nContent-Length: x\r\n\r\n"),
+                      HttpParseError);
+}
+
+TEST_CASE("HTTP request formatting") {
+    REQUIRE(FormatHttpRequest("POST", "/bot1/sendMessage", "localhost", "application/json",
+                              "{}") ==
+            "POST /bot1/sendMessage HTTP/1.1\r\nHost: localhost\r\n"
+            "Content-Type: application/json\r\nContent-Length: 2\r\n\r\n{}");
+    REQUIRE(FormatHttpRequest("GET", "/bot1/getMe", "localhost", "", "") ==
+            "GET /bot1/getMe HTTP/1.1\r\nHost: localhost\r\n\r\n");
+}
+
+TEST_CASE("HTTP request templates") {
+    HttpRequestTemplate send("POST", "/bot1/sendMessage", "localhost", "application/json");
+    HttpRequestTemplate get("GET", "/bot1/getUpdates", "localhost");
+
+    REQUIRE(send.Format("", "{}") ==
+            FormatHttpRequest("POST", "/bot1/sendMessage", "localhost", "application/json", "{}"));
+    REQUIRE(send.Format("", "") ==
+            FormatHttpRequest("POST", "/bot1/sendMessage", "localhost", "application/json", ""));
+    REQUIRE(get.Format("", "") ==
+            FormatHttpRequest("GET", "/bot1/getUpdates", "localhost", "", ""));
+    REQUIRE(get.Format("offset=5&timeout=1", "") ==
+            "GET /bot1/getUpdates?offset=5&timeout=1 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    REQUIRE(get.Target("") == "/bot1/getUpdates");
+    REQUIRE(get.Target("limit=2") == "/bot1/getUpdates?limit=2");
+
+    std::string query;
+    AppendQueryParameter(query, "offset", "-5");
+    AppendQueryParameter(query, "allowed_updates", R"(["message"])");
+    AppendQueryParameter(query, "url", "https://example.org/hook?a=b c");
+    REQUIRE(query == "offset=-5&allowed_updates=%5B%22message%22%5D"
+                     "&url=https%3A%2F%2Fexample.org%2Fhook%3Fa%3Db%20c");
+}
+
+#if defined(__linux__)
+
+namespace {
+
+// Answers every request on a connection after a delay, keeping the connection open.
+// Requests whose path contains "hang" are never answered.
+class SlowServer {
+public:
+    explicit SlowServer(std::chrono::milliseconds delay) : delay_{delay} {
+        listener_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        REQUIRE(bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+        socklen_t length = sizeof(address);
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length);
+        port_ = ntohs(address.sin_port);
+        REQUIRE(listen(listener_, 128) == 0);
+        acceptor_ = std::thread([this] { Accept(); });
+    }
+
+    ~SlowServer() {
+        shutdown(listener_, SHUT_RDWR);
+        close(listener_);
+        acceptor_.join();
+        for (auto& connection : connections_) {
+            connection.join();
+        }
+    }
+
+    uint16_t Port() const {
+        return port_;
+    }
+
+    int Connections() const {
+        return accepted_;
+    }
+
+private:
+    void Accept() {
+        while (true) {
+            auto fd = accept(listener_, nullptr, nullptr);
+            if (fd < 0) {
+                return;
+            }
+            ++accepted_;
+            connections_.emplace_back([this, fd] { Serve(fd); });
+        }
+    }
+
+    void Serve(int fd) {
+        std::string buffer;
+        char chunk[4096];
+        while (true) {
+            auto end = buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                auto received = recv(fd, chunk, sizeof(chunk), 0);
+                if (received <= 0) {
+                    break;
+                }
+                buffer.append(chunk, received);
+                continue;
+            }
+            auto request = buffer.substr(0, end);
+            buffer.erase(0, end + 4);
+            if (request.find("hang") != std::string::npos) {
+                continue;
+            }
+            std::this_thread::sleep_for(delay_);
+            auto target = request.substr(4, request.find(' ', 4) - 4);
+            auto response = "HTTP/1.1 200 OK\r\nContent-Length: " +
+                            std::to_string(target.size()) + "\r\n\r\n" + target;
+            send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+        }
+        close(fd);
+    }
+
+private:
+    const std::chrono::milliseconds delay_;
+    int listener_;
+    uint16_t port_;
+    std::atomic<int> accepted_{0};
+    std::thread acceptor_;
+    std::vector<std::thread> connections_;
+};
+
+// Every I/O engine that works on this machine: io_uring may be missing or forbidden.
+std::vector<std::pair<std::string, std::unique_ptr<IoLoop>>> Engines() {
+    std::vector<std::pair<std::string, std::unique_ptr<IoLoop>>> engines;
+    engines.emplace_back("epoll", std::make_unique<Reactor>());
+#if defined(HAVE_IO_URING)
+    try {
+        engines.emplace_back("io_uring", std::make_unique<UringLoop>());
+    } catch (const std::system_error&) {
+    }
+#endif
+    return engines;
+}
+
+HttpRequestSpec Get(uint16_t port, std::string target) {
+    HttpRequestSpec request;
+    request.host = "127.0.0.1";
+    request.port = port;
+    request.method = "GET";
+    request.target = std::move(target);
+    request.timeout = std::chrono::seconds(5);
+    return request;
+}
+
+}  // namespace
+
+TEST_CASE("I/O loop runs timers in order and posted callbacks") {
+    for (auto& [name, engine] : Engines()) {
+        INFO(name);
+        IoThread thread(std::move(engine));
+        auto& loop = thread.Get();
+        std::promise<std::vector<int>> done;
+        std::vector<int> order;
+
+        loop.Post([&] {
+            auto start = IoLoop::Clock::now();
+            loop.RunAt(start + std::chrono::milliseconds(30), [&] {
+                order.push_back(3);
+                done.set_value(order);
+            });
+            loop.RunAt(start + std::chrono::milliseconds(10), [&] { order.push_back(1); });
+            auto cancelled =
+                loop.RunAt(start + std::chrono::milliseconds(20), [&] { order.push_back(-1); });
+            loop.RunAt(start + std::chrono::milliseconds(20), [&] { order.push_back(2); });
+            loop.Cancel(cancelled);
+        });
+
+        REQUIRE(done.get_future().get() == std::vector<int>{1, 2, 3});
+    }
+}
+
+TEST_CASE("Async HTTP client keeps many requests in flight on one thread") {
+    constexpr int kRequests = 50;
+    for (auto& [name, engine] : Engines()) {
+        INFO(name);
+        SlowServer server(std::chrono::milliseconds(200));
+        IoThread thread(std::move(engine));
+        AsyncHttpClient client(thread.Get());
+
+        std::vector<std::future<HttpResponse>> responses(kRequests);
+        std::vector<std::promise<HttpResponse>> results(kRequests);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < kRequests; ++i) {
+            responses[i] = results[i].get_future();
+            client.Request(Get(server.Port(), "/" + std::to_string(i)),
+                           [&results, i](std::future<HttpResponse> response) {
+                               results[i].set_value(response.get());
+                           });
+        }
+        for (int i = 0; i < kRequests; ++i) {
+            REQUIRE(responses[i].get().body == "/" + std::to_string(i));
+        }
+        // Served in parallel: one after another they would take 10 seconds.
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(3));
+        REQUIRE(server.Connections() == kRequests);
+
+        // The connections are kept alive and reused.
+        std::promise<HttpResponse> again;
+        client.Request(Get(server.Port(), "/again"), [&](std::future<HttpResponse> response) {
+            again.set_value(response.get());
+        });
+        REQUIRE(again.get_future().get().body == "/again");
+        REQUIRE(server.Connections() == kRequests);
+
+        thread.Stop();
+    }
+}
+
+TEST_CASE("Async HTTP client reports timeouts and refused connections") {
+    for (auto& [name, engine] : Engines()) {
+        INFO(name);
+        SlowServer server(std::chrono::milliseconds(0));
+        IoThread thread(std::move(engine));
+        AsyncHttpClient client(thread.Get());
+
+        auto hang = Get(server.Port(), "/hang");
+        hang.timeout = std::chrono::milliseconds(100);
+        std::promise<bool> timed_out;
+        client.Request(hang, [&](std::future<HttpResponse> response) {
+            try {
+                response.get();
+                timed_out.set_value(false);
+            } catch (const HttpTransportError& error) {
+                timed_out.set_value(error.TimedOut());
+            }
+        });
+        REQUIRE(timed_out.get_future().get());
+
+        // Nothing listens on the port of a closed socket.
+        auto probe = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        socklen_t length = sizeof(address);
+        getsockname(probe, reinterpret_cast<sockaddr*>(&address), &length);
+        close(probe);
+
+        std::promise<bool> refused;
+        client.Request(Get(ntohs(address.sin_port), "/"),
+                       [&](std::future<HttpResponse> response) {
+                           try {
+                               response.get();
+                               refused.set_value(false);
+                           } catch (const HttpTransportError& error) {
+                               refused.set_value(!error.TimedOut());
+                           }
+                       });
+        REQUIRE(refused.get_future().get());
+
+        thread.Stop();
+    }
+}
+
+#endif  // __linux__
@@ -0,0 +1,98 @@
+#include <catch.hpp>
+
+#include "../telegram/offset_checkpoint.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace {
+
+std::optional<int64_t> ReadCommitted(const std::string& path) {
+    std::ifstream in(path);
+    int64_t value;
+    if (in >> value) {
+        return value;
+    }
+    return {};
+}
+
+}  // namespace
+
+TEST_CASE("Offset checkpoint commits per batch") {
+    const std::string path = "test_checkpoint_batch.data";
+    std::remove(path.c_str());
+
+    {
+        OffsetCheckpoint checkpoint(path, CheckpointConfig{CheckpointMode::EveryBatch});
+        REQUIRE_FALSE(checkpoint.LastUpdateId());
+
+        checkpoint.Advance(10);
+        checkpoint.Advance(12);
+        checkpoint.Advance(11);
+        REQUIRE(checkpoint.LastUpdateId() == 12);
+        REQUIRE_FALSE(ReadCommitted(path));
+
+        checkpoint.EndBatch();
+        REQUIRE(ReadCommitted(path) == 12);
+
+        checkpoint.Advance(13);
+        checkpoint.Flush();
+        REQUIRE(ReadCommitted(path) == 13);
+    }
+
+    OffsetCheckpoint reloaded(path, CheckpointConfig{});
+    REQUIRE(reloaded.LastUpdateId() == 13);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Offset checkpoint commits by interval") {
+    const std::string path = "test_checkpoint_interval.data";
+    std::remove(path.c_str());
+
+    CheckpointConfig config{CheckpointMode::Interval, std::chrono::milliseconds(50), false};
+    OffsetCheckpoint checkpoint(path, config);
+
+    // Nothing was committed yet, so the first offset goes out right away.
+    checkpoint.Advance(1);
+    REQUIRE(ReadCommitted(path) == 1);
+
+    checkpoint.Advance(2);
+    checkpoint.EndBatch();
+    REQUIRE(ReadCommitted(path) == 1);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    checkpoint.EndBatch();
+    REQUIRE(ReadCommitted(path) == 2);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Update tracker reports the handled prefix") {
+    UpdateTracker tracker(10);
+    REQUIRE_FALSE(tracker.Take(10));
+    REQUIRE(tracker.Take(11));
+    REQUIRE(tracker.Take(12));
+    REQUIRE(tracker.Take(13));
+    REQUIRE_FALSE(tracker.Take(12));
+
+    // Handled out of order, the prefix waits for the oldest.
+    REQUIRE_FALSE(tracker.Done(12).has_value());
+    REQUIRE(tracker.Done(11) == 12);
+    REQUIRE(tracker.LastHandled() == 12);
+    REQUIRE(tracker.Done(13) == 13);
+
+    std::thread handler([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        tracker.Take(14);
+        tracker.Done(14);
+    });
+    tracker.WaitUntilHandled(14);
+    REQUIRE(tracker.LastHandled() == 14);
+    handler.join();
+
+    tracker.Interrupt();
+    tracker.WaitUntilHandled(100);
+}
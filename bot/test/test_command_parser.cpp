@@ -0,0 +1,39 @@
+#include <catch.hpp>
+
+#include "../telegram/command_parser.h"
+
+TEST_CASE("UTF-16 entity lengths to bytes") {
+    // "é" is one UTF-16 unit in two bytes, the emoji two units in four bytes.
+    const std::string text = "a\xC3\xA9\xF0\x9F\x98\x80" "b";
+    REQUIRE(tg::Utf16ToBytes(text, 0) == 0);
+    REQUIRE(tg::Utf16ToBytes(text, 1) == 1);
+    REQUIRE(tg::Utf16ToBytes(text, 2) == 3);
+    REQUIRE(tg::Utf16ToBytes(text, 4) == 7);
+    REQUIRE(tg::Utf16ToBytes(text, 5) == 8);
+    REQUIRE(tg::Utf16ToBytes(text, 6) == std::string_view::npos);
+}
+
+TEST_CASE("Bot commands split into name, bot and arguments") {
+    const std::string text = "/random@our_bot  10 20\n";
+    auto command = tg::ParseBotCommand(text, 15);
+    REQUIRE(command);
+    REQUIRE(command->name == "/random");
+    REQUIRE(command->bot == "our_bot");
+    REQUIRE(command->arguments == "10 20");
+    // Views into the text, nothing is copied.
+    REQUIRE(command->arguments.data() == text.data() + 17);
+
+    command = tg::ParseBotCommand("/weather");
+    REQUIRE(command);
+    REQUIRE(command->name == "/weather");
+    REQUIRE(command->bot.empty());
+    REQUIRE(command->arguments.empty());
+
+    command = tg::ParseBotCommand("/random\t5");
+    REQUIRE(command->name == "/random");
+    REQUIRE(command->arguments == "5");
+
+    REQUIRE_FALSE(tg::ParseBotCommand("random 5"));
+    REQUIRE_FALSE(tg::ParseBotCommand(""));
+    REQUIRE_FALSE(tg::ParseBotCommand("/random", 8));
+}
@@ -0,0 +1,66 @@
+#include <catch.hpp>
+
+#include "../telegram/flood_control.h"
+
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("Token bucket paces after a burst") {
+    TokenBucket bucket(10, 3);
+    auto now = TokenBucket::Clock::now();
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(bucket.Earliest(now) == now);
+        bucket.Take(now);
+    }
+    auto next = bucket.Earliest(now);
+    REQUIRE(next - now == 100ms);
+    bucket.Take(next);
+    REQUIRE(bucket.Earliest(now) - now == 200ms);
+
+    // A long pause refills the bucket, but not beyond the burst.
+    auto later = now + 10s;
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(bucket.Earliest(later) == later);
+        bucket.Take(later);
+    }
+    REQUIRE(bucket.Earliest(later) > later);
+
+    bucket.PauseUntil(later + 5s);
+    REQUIRE(bucket.Earliest(later) == later + 5s);
+}
+
+TEST_CASE("Flood control enforces global and per-chat limits") {
+    FloodControlConfig config;
+    config.enabled = true;
+    config.global_per_second = 30;
+    config.chat_per_second = 1;
+    config.group_per_minute = 20;
+    FloodControl flood_control(config);
+    auto now = FloodControl::Clock::now();
+
+    // One private chat gets a message per second, a group one per three seconds.
+    REQUIRE(flood_control.TryTake(1, now) == now);
+    REQUIRE(flood_control.TryTake(1, now) - now == 1s);
+    REQUIRE(flood_control.TryTake(-1, now + 1s) == now + 1s);
+    REQUIRE(flood_control.TryTake(-1, now + 2s) - now == 4s);
+
+    // A waiting chat does not hold up the others, which share the global rate.
+    auto start = now + 1min;
+    auto time = start;
+    int64_t sent = 0;
+    for (int64_t chat = 100; sent < 90; ++chat) {
+        auto at = flood_control.TryTake(chat, time);
+        if (at == time) {
+            ++sent;
+        } else {
+            time = at;
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(time - start).count();
+    REQUIRE(elapsed == Approx(89.0 / 30).margin(0.01));
+
+    flood_control.Backoff(100, 1h);
+    REQUIRE(flood_control.TryTake(100, start) - FloodControl::Clock::now() > 59min);
+}
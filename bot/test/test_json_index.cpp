@@ -0,0 +1,81 @@
+#include <catch.hpp>
+
+#include "../telegram/json_index.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+TEST_CASE("JSON document structural index") {
+    const json::JsonDocument document(R"( {"a":[1,{"b":"]}\"\\"}],"c":-12 , "d":"x\\"} )");
+    auto text = document.Text();
+    REQUIRE(document.ValueEnd(0) == text.rfind('}') + 1);
+    REQUIRE(document.ValueEnd(text.find('[')) == text.find(",\"c\""));
+    REQUIRE(document.ValueEnd(text.find("{\"b")) == text.find("],"));
+    REQUIRE(document.ValueEnd(text.find("-12")) == text.find(" ,"));
+    REQUIRE(document.ValueEnd(text.find("\"x")) == text.rfind('}'));
+
+    REQUIRE_THROWS_AS(json::JsonDocument(R"({"a":[1,2})"), json::ParseError);
+    REQUIRE_THROWS_AS(json::JsonDocument(R"({"a":1}})"), json::ParseError);
+    REQUIRE_THROWS_AS(json::JsonDocument(R"({"a":"b\"})"), json::ParseError);
+}
+
+TEST_CASE("JSON object index") {
+    const json::JsonDocument document(
+        R"({ "id" : 42, "chat": {"id": -5, "type": "group"}, "text":"hi", "none": null })");
+    json::ObjectIndex index(document, document.Text());
+    REQUIRE(index.Find("id") == "42");
+    REQUIRE(index.Find("chat") == R"({"id": -5, "type": "group"})");
+    REQUIRE(index.Find("text") == R"("hi")");
+    REQUIRE(index.Find("none") == "null");
+    REQUIRE(index.Find("type").empty());
+
+    json::ObjectIndex chat(document, index.Find("chat"));
+    REQUIRE(json::ParseInt64(chat.Find("id")) == -5);
+    REQUIRE(chat.Find("type") == R"("group")");
+
+    auto index_of = [](std::string text) {
+        json::JsonDocument document(std::move(text));
+        return json::ObjectIndex(document, document.Text()).Find("id");
+    };
+    REQUIRE(index_of("{}").empty());
+    REQUIRE_THROWS_AS(index_of(R"({"id":})"), json::ParseError);
+    REQUIRE_THROWS_AS(index_of(R"({"id" 1})"), json::ParseError);
+    REQUIRE_THROWS_AS(index_of("[]"), json::ParseError);
+}
+
+TEST_CASE("JSON array elements") {
+    const json::JsonDocument document(R"({"a":[ {"a":[1,2]}, "b,c" ,3 ],"b":[ ]})");
+    json::ObjectIndex index(document, document.Text());
+    std::vector<std::string_view> elements;
+    json::ForEachElement(document, index.Find("a"), [&](std::string_view element) {
+        elements.push_back(element);
+    });
+    REQUIRE(elements.size() == 3);
+    REQUIRE(elements[0] == R"({"a":[1,2]})");
+    REQUIRE(elements[1] == R"("b,c")");
+    REQUIRE(elements[2] == "3");
+
+    elements.clear();
+    json::ForEachElement(document, index.Find("b"), [&](std::string_view element) {
+        elements.push_back(element);
+    });
+    REQUIRE(elements.empty());
+}
+
+TEST_CASE("JSON strings read in place unless escaped") {
+    std::string scratch;
+    const std::string plain = R"("hello")";
+    auto text = json::ParseString(plain, scratch);
+    REQUIRE(text == "hello");
+    REQUIRE(text.data() == plain.data() + 1);
+
+    text = json::ParseString(R"("\"hi\"\n\u00e9\ud83d\ude00")", scratch);
+    REQUIRE(text == "\"hi\"\n\xC3\xA9\xF0\x9F\x98\x80");
+    REQUIRE(text.data() == scratch.data());
+
+    REQUIRE(json::ParseInt64("-9223372036854775808") == INT64_MIN);
+    REQUIRE_THROWS_AS(json::ParseString("42", scratch), json::ParseError);
+    REQUIRE_THROWS_AS(json::ParseInt64("4.2"), json::ParseError);
+    REQUIRE_THROWS_AS(json::ParseInt64(""), json::ParseError);
+}
@@ -0,0 +1,66 @@
+#include <catch.hpp>
+
+#include "../telegram/json_reader.h"
+#include "../telegram/json_writer.h"
+
+#include <sstream>
+#include <string>
+
+TEST_CASE("JSON string escaping") {
+    auto quoted = [](std::string_view text) {
+        std::string out;
+        json::AppendString(out, text);
+        return out;
+    };
+    REQUIRE(quoted("") == R"("")");
+    REQUIRE(quoted("hello") == R"("hello")");
+    REQUIRE(quoted("say \"hi\"") == R"("say \"hi\"")");
+    REQUIRE(quoted("a\\b") == R"("a\\b")");
+    REQUIRE(quoted("1\n2\r\t\b\f") == R"("1\n2\r\t\b\f")");
+    REQUIRE(quoted(std::string("\0\x1f", 2)) == R"("\u0000\u001f")");
+    // UTF-8 and DEL are not escaped.
+    REQUIRE(quoted("\xD0\xBF\xF0\x9F\x98\x80\x7f") == "\"\xD0\xBF\xF0\x9F\x98\x80\x7f\"");
+}
+
+TEST_CASE("JSON strings escape at every position of a block") {
+    // The escaped character falls on each byte of the 16 byte blocks scanned at once,
+    // and the text is read back the same.
+    for (size_t length = 1; length <= 40; ++length) {
+        for (size_t pos = 0; pos < length; ++pos) {
+            for (char special : {'"', '\\', '\n', '\x01'}) {
+                std::string text(length, '\xC3');
+                text[pos] = special;
+                std::string out;
+                json::AppendString(out, text);
+                REQUIRE(out.size() == length + 3 + (special == '\x01' ? 4 : 0));
+
+                std::istringstream in(out);
+                json::JsonReader reader(in);
+                REQUIRE(reader.Read<std::string>() == text);
+            }
+        }
+    }
+}
+
+TEST_CASE("JSON writer objects") {
+    std::string out = "stale";
+    out.clear();
+    json::JsonWriter writer(out);
+    writer.BeginObject();
+    writer.Key("chat_id");
+    writer.WriteInt64(-1001234567890);
+    writer.Key("text");
+    writer.WriteString("Hi!");
+    writer.Key("inner");
+    writer.BeginObject();
+    writer.Key("min");
+    writer.WriteInt64(INT64_MIN);
+    writer.Key("ok");
+    writer.WriteBool(true);
+    writer.EndObject();
+    writer.Key("silent");
+    writer.WriteBool(false);
+    writer.EndObject();
+    REQUIRE(out == R"({"chat_id":-1001234567890,"text":"Hi!",)"
+                   R"("inner":{"min":-9223372036854775808,"ok":true},"silent":false})");
+}
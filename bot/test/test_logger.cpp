@@ -0,0 +1,83 @@
+#include <catch.hpp>
+
+#include "../telegram/logger.h"
+
+#include <algorithm>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+size_t CountLines(const std::string& text, const std::string& needle) {
+    size_t count = 0;
+    std::istringstream in(text);
+    for (std::string line; std::getline(in, line);) {
+        count += line.find(needle) != std::string::npos;
+    }
+    return count;
+}
+
+}  // namespace
+
+TEST_CASE("Async logger writes every record") {
+    std::ostringstream out;
+    {
+        logger::AsyncLogger logger(out, 64, logger::OverflowPolicy::Block);
+
+        std::vector<std::thread> threads;
+        for (int thread = 0; thread < 4; ++thread) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 1000; ++i) {
+                    logger.LogInfo("message " + std::to_string(i));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        logger.Flush();
+        REQUIRE(CountLines(out.str(), "INFO\tmessage ") == 4000);
+
+        logger.LogError("last words");
+    }
+    REQUIRE(CountLines(out.str(), "ERROR\tlast words\t") == 1);
+}
+
+TEST_CASE("Async logger reports dropped records") {
+    std::ostringstream out;
+    logger::AsyncLogger logger(out, 2, logger::OverflowPolicy::Drop);
+    for (int i = 0; i < 10000; ++i) {
+        logger.LogInfo("spam");
+    }
+    logger.Flush();
+
+    auto text = out.str();
+    auto written = CountLines(text, "INFO\tspam\t");
+    REQUIRE(written >= 2);
+    if (written < 10000) {
+        REQUIRE(CountLines(text, "Logger buffer overflow, dropped") >= 1);
+    }
+}
+
+TEST_CASE("Disabled levels are not formatted") {
+    std::ostringstream out;
+    logger::OstreamLogger logger(out);
+    logger.SetMinLevel(logger::LogLevel::Error);
+
+    int evaluated = 0;
+    auto expensive = [&] {
+        ++evaluated;
+        return std::string("expensive");
+    };
+    logger.LogInfo("value: ", expensive);
+    REQUIRE(evaluated == 0);
+    REQUIRE(out.str().empty());
+
+    std::optional<int64_t> offset = 42;
+    logger.LogError("value: ", expensive, ", offset: ", offset, ", ok: ", true, ", ", 'x');
+    REQUIRE(evaluated == 1);
+    REQUIRE(out.str().find("ERROR\tvalue: expensive, offset: 42, ok: true, x\t") == 0);
+}
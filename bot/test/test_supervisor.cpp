@@ -0,0 +1,124 @@
+#include <catch.hpp>
+
+#include "../telegram/supervisor.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace {
+
+// Workers append their index to the file on every start.
+const std::string kStartsFile = "test_supervisor_starts.data";
+
+std::map<size_t, int> ReadStarts() {
+    std::map<size_t, int> starts;
+    std::ifstream input(kStartsFile);
+    size_t index;
+    while (input >> index) {
+        ++starts[index];
+    }
+    return starts;
+}
+
+int WaitForShutdownSignal() {
+    ShutdownSignalWatcher signals;
+    std::mutex mutex;
+    std::condition_variable signalled;
+    bool stop = false;
+    signals.Watch([&] {
+        std::lock_guard<std::mutex> guard(mutex);
+        stop = true;
+        signalled.notify_all();
+    });
+    std::unique_lock<std::mutex> guard(mutex);
+    signalled.wait(guard, [&] { return stop; });
+    return 0;
+}
+
+}  // namespace
+
+TEST_CASE("Supervisor restarts crashed workers until one stops") {
+    std::remove(kStartsFile.c_str());
+
+    RestartPolicy policy;
+    policy.delay = std::chrono::milliseconds(50);
+    Supervisor supervisor(
+        3,
+        [](size_t index) {
+            std::ofstream(kStartsFile, std::ios::app) << index << std::endl;
+            if (index != 1) {
+                return WaitForShutdownSignal();
+            }
+            // Crashes on the first start like /crash, stops the bot on the second.
+            if (ReadStarts()[1] == 1) {
+                std::_Exit(-1);
+            }
+            return 0;
+        },
+        policy);
+    REQUIRE(supervisor.Run() == 0);
+
+    auto starts = ReadStarts();
+    REQUIRE(starts[0] == 1);
+    REQUIRE(starts[1] == 2);
+    REQUIRE(starts[2] == 1);
+    std::remove(kStartsFile.c_str());
+}
+
+TEST_CASE("Supervisor gives up on a worker that keeps failing") {
+    std::remove(kStartsFile.c_str());
+
+    RestartPolicy policy;
+    policy.delay = std::chrono::milliseconds(20);
+    policy.max_failures = 4;
+    Supervisor supervisor(
+        2,
+        [](size_t index) {
+            std::ofstream(kStartsFile, std::ios::app) << index << std::endl;
+            if (index == 0) {
+                return WaitForShutdownSignal();
+            }
+            // Like a worker that can't bind its port.
+            return EXIT_FAILURE;
+        },
+        policy);
+
+    auto started = std::chrono::steady_clock::now();
+    REQUIRE(supervisor.Run() == EXIT_FAILURE);
+    // Restarted after 20, 40 and 80 ms.
+    REQUIRE(std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(140));
+
+    auto starts = ReadStarts();
+    REQUIRE(starts[0] == 1);
+    REQUIRE(starts[1] == 4);
+    std::remove(kStartsFile.c_str());
+}
+
+TEST_CASE("Supervisor doesn't count crashes on request") {
+    std::remove(kStartsFile.c_str());
+
+    RestartPolicy policy;
+    policy.delay = std::chrono::milliseconds(10);
+    policy.max_failures = 2;
+    Supervisor supervisor(
+        1,
+        [](size_t index) {
+            std::ofstream(kStartsFile, std::ios::app) << index << std::endl;
+            // A /crash on each of the first five starts.
+            if (ReadStarts()[0] <= 5) {
+                std::_Exit(-1);
+            }
+            return 0;
+        },
+        policy);
+    REQUIRE(supervisor.Run() == 0);
+
+    REQUIRE(ReadStarts()[0] == 6);
+    std::remove(kStartsFile.c_str());
+}
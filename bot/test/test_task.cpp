@@ -0,0 +1,141 @@
+#include <catch.hpp>
+
+#include "../telegram/task.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+
+Task<int> Add(int lhs, int rhs) {
+    co_return lhs + rhs;
+}
+
+Task<int> Sum(int count) {
+    int sum = 0;
+    for (int i = 1; i <= count; ++i) {
+        sum = co_await Add(sum, i);
+    }
+    co_return sum;
+}
+
+Task<int> Fail() {
+    throw std::runtime_error("failed");
+    co_return 0;
+}
+
+// Stands in for an API call: completes on another thread through a callback.
+class FakeRemote {
+public:
+    using Callback = std::function<void(std::future<int>)>;
+
+    void Call(int value, Callback callback) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        pending_.emplace_back(value, std::move(callback));
+    }
+
+    // Answers the calls made so far, returns how many.
+    size_t Answer() {
+        std::vector<std::pair<int, Callback>> pending;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            pending.swap(pending_);
+        }
+        for (auto& [value, callback] : pending) {
+            std::promise<int> result;
+            result.set_value(value * 2);
+            callback(result.get_future());
+        }
+        return pending.size();
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::pair<int, Callback>> pending_;
+};
+
+// Coroutines take their state as arguments: a lambda coroutine's captures are gone
+// by the time a lazily started task runs.
+Task<void> SumAndFail(std::promise<int>* sum, std::promise<bool>* failed) {
+    sum->set_value(co_await Sum(100));
+    try {
+        co_await Fail();
+        failed->set_value(false);
+    } catch (const std::runtime_error&) {
+        failed->set_value(true);
+    }
+}
+
+Task<void> Converse(EventLoop* loop, FakeRemote* remote, int value, std::atomic<int>* total) {
+    // Two calls in a row, both suspended while the remote side is busy.
+    auto first = co_await AwaitCallback<int>(
+        *loop, [&](FakeRemote::Callback done) { remote->Call(value, std::move(done)); });
+    auto second = co_await AwaitCallback<int>(
+        *loop, [&](FakeRemote::Callback done) { remote->Call(first, std::move(done)); });
+    *total += second;
+}
+
+Task<void> MaybeThrow(EventLoop* loop, int value, std::atomic<int>* done) {
+    co_await loop->Schedule();
+    if (value % 2) {
+        throw std::runtime_error("handler failed");
+    }
+    ++*done;
+}
+
+}  // namespace
+
+TEST_CASE("Tasks return values and exceptions to the awaiter") {
+    EventLoop loop(1);
+    std::promise<int> sum;
+    std::promise<bool> failed;
+
+    loop.Spawn(SumAndFail(&sum, &failed));
+    loop.Drain();
+
+    REQUIRE(sum.get_future().get() == 5050);
+    REQUIRE(failed.get_future().get());
+}
+
+TEST_CASE("Waiting coroutines do not hold loop threads") {
+    constexpr int kConversations = 5000;
+    FakeRemote remote;
+    std::atomic<int> total{0};
+
+    EventLoop loop(2);
+    for (int i = 0; i < kConversations; ++i) {
+        loop.Spawn(Converse(&loop, &remote, i, &total));
+    }
+
+    // Every conversation gets to wait at once although the loop has two threads.
+    size_t answered = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (answered < 2 * kConversations && std::chrono::steady_clock::now() < deadline) {
+        answered += remote.Answer();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    loop.Drain();
+
+    REQUIRE(answered == 2 * kConversations);
+    REQUIRE(total == 4 * (kConversations - 1) * kConversations / 2);
+}
+
+TEST_CASE("Spawned task errors are contained") {
+    EventLoop loop(2);
+    std::atomic<int> done{0};
+    for (int i = 0; i < 10; ++i) {
+        loop.Spawn(MaybeThrow(&loop, i, &done));
+    }
+    loop.Shutdown();
+    REQUIRE(done == 5);
+}
+
+#endif  // __cpp_impl_coroutine
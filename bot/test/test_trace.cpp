@@ -0,0 +1,76 @@
+#include <catch.hpp>
+
+#include "../telegram/trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+TEST_CASE("Trace records round trip") {
+    const std::string path = "test_trace_round_trip.trace";
+    const std::string big(1000, 'x');
+    {
+        TraceWriter writer(path);
+        writer.Write(TraceRecordKind::GetUpdatesReply, R"({"ok":true,"result":[]})");
+        writer.Write(TraceRecordKind::SendMessageRequest, big);
+        writer.Write(TraceRecordKind::GetUpdatesReply, "");
+    }
+
+    TraceReader reader(path);
+    auto first = reader.Next();
+    REQUIRE(first);
+    REQUIRE(first->kind == TraceRecordKind::GetUpdatesReply);
+    REQUIRE(first->time.count() == 0);
+    REQUIRE(first->payload == R"({"ok":true,"result":[]})");
+
+    auto second = reader.Next();
+    REQUIRE(second);
+    REQUIRE(second->kind == TraceRecordKind::SendMessageRequest);
+    REQUIRE(second->payload == big);
+
+    auto third = reader.Next();
+    REQUIRE(third);
+    REQUIRE(third->payload.empty());
+    REQUIRE(third->time >= second->time);
+
+    REQUIRE_FALSE(reader.Next());
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Broken traces are rejected") {
+    const std::string path = "test_trace_broken.trace";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << "NOTATRACE";
+    }
+    REQUIRE_THROWS_AS(TraceReader(path), TraceError);
+
+    {
+        TraceWriter writer(path);
+        writer.Write(TraceRecordKind::SendMessageRequest, "payload");
+    }
+    {
+        // Cut the last byte of the payload.
+        std::ifstream in(path, std::ios::binary);
+        std::string data{std::istreambuf_iterator<char>(in), {}};
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << data.substr(0, data.size() - 1);
+    }
+    TraceReader reader(path);
+    REQUIRE_THROWS_AS(reader.Next(), TraceError);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Flushed trace records are readable while the writer is open") {
+    const std::string path = "test_trace_flush.trace";
+    TraceWriter writer(path);
+    writer.Write(TraceRecordKind::SendMessageRequest, R"({"chat_id":1,"text":"/crash"})");
+    writer.Flush();
+
+    TraceReader reader(path);
+    auto record = reader.Next();
+    REQUIRE(record);
+    REQUIRE(record->payload == R"({"chat_id":1,"text":"/crash"})");
+    std::remove(path.c_str());
+}
@@ -0,0 +1,114 @@
+#include <catch.hpp>
+
+#include "../telegram/keyed_worker_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Keyed worker pool keeps per-key order") {
+    std::mutex mutex;
+    std::map<int64_t, std::vector<int>> seen;
+
+    KeyedWorkerPool pool(4, 16);
+    for (int i = 0; i < 1000; ++i) {
+        int64_t key = i % 7 - 3;
+        REQUIRE(pool.Submit(key, [&, key, i] {
+            std::lock_guard<std::mutex> guard(mutex);
+            seen[key].push_back(i);
+        }));
+    }
+    pool.Shutdown();
+
+    REQUIRE(seen.size() == 7);
+    for (const auto& [key, values] : seen) {
+        REQUIRE(values.size() == 1000 / 7 + (key + 3 < 1000 % 7 ? 1 : 0));
+        REQUIRE(std::is_sorted(values.begin(), values.end()));
+    }
+    REQUIRE_FALSE(pool.Submit(0, [] {}));
+}
+
+TEST_CASE("Keyed worker pool steals work from a blocked worker") {
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::atomic<bool> other_done{false};
+
+    // Both keys have the same home worker, the second one has to be stolen.
+    KeyedWorkerPool pool(2, 16);
+    pool.Submit(0, [released] { released.wait(); });
+    pool.Submit(2, [&] { other_done = true; });
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!other_done && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(other_done);
+
+    release.set_value();
+    pool.Shutdown();
+}
+
+TEST_CASE("Keyed worker pool drains without shutting down") {
+    std::atomic<int> done{0};
+    KeyedWorkerPool pool(3, 8);
+    for (int round = 1; round <= 3; ++round) {
+        for (int i = 0; i < 50; ++i) {
+            REQUIRE(pool.Submit(i % 5, [&] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                ++done;
+            }));
+        }
+        pool.Drain();
+        REQUIRE(done == 50 * round);
+    }
+    pool.Drain();
+    pool.Shutdown();
+}
+
+TEST_CASE("Keyed worker pool parks a key its gate holds back") {
+    auto start = std::chrono::steady_clock::now();
+    auto hold_until = start + std::chrono::milliseconds(200);
+    std::mutex mutex;
+    std::vector<int64_t> order;
+
+    // A single worker, so the held key can only wait without blocking it.
+    KeyedWorkerPool pool(1, 16, [&](int64_t key, std::chrono::steady_clock::time_point now) {
+        return key == 1 ? hold_until : now;
+    });
+    pool.Submit(1, [&] {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(1);
+    });
+    pool.Submit(2, [&] {
+        std::lock_guard<std::mutex> guard(mutex);
+        order.push_back(2);
+    });
+    pool.Drain();
+
+    REQUIRE(order == std::vector<int64_t>{2, 1});
+    REQUIRE(std::chrono::steady_clock::now() >= hold_until);
+    pool.Shutdown();
+}
+
+TEST_CASE("Keyed worker pool runs a requeued task before the rest of its key") {
+    std::vector<int> seen;
+    int attempts = 0;
+
+    KeyedWorkerPool pool(2, 16);
+    std::function<void()> retried = [&] {
+        seen.push_back(0);
+        if (++attempts < 3) {
+            pool.Requeue(5, retried);
+        }
+    };
+    pool.Submit(5, retried);
+    pool.Submit(5, [&] { seen.push_back(1); });
+    pool.Drain();
+
+    REQUIRE(seen == std::vector<int>{0, 0, 0, 1});
+    pool.Shutdown();
+}
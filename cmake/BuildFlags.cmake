@@ -1,4 +1,11 @@
-if (CMAKE_COMPILER_IS_GNUCC AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 9.3)
+# Coroutine message handlers need C++20, older compilers build the bot without them.
+if (CMAKE_VERSION VERSION_LESS 3.12)
+  set(CMAKE_CXX_STANDARD 17)
+elseif (CMAKE_COMPILER_IS_GNUCC AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 11.0)
+  set(CMAKE_CXX_STANDARD 20)
+elseif(CMAKE_CXX_COMPILER_ID MATCHES "Clang" AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 14.0)
+  set(CMAKE_CXX_STANDARD 20)
+elseif (CMAKE_COMPILER_IS_GNUCC AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 9.3)
   set(CMAKE_CXX_STANDARD 17)
 elseif(CMAKE_CXX_COMPILER_ID MATCHES "Clang" AND CMAKE_CXX_COMPILER_VERSION VERSION_GREATER_EQUAL 10.0)
   set(CMAKE_CXX_STANDARD 17)